@@ -65,6 +65,16 @@ int connman_inet_clear_ipv6_gateway_address(int index, const char *gateway);
 int connman_inet_set_ipv6_gateway_interface(int index);
 int connman_inet_clear_ipv6_gateway_interface(int index);
 
+typedef void (*connman_inet_route_cb_t) (int error, void *user_data);
+int connman_inet_add_route_async(int family, int index, const char *host,
+				const char *gateway, unsigned char prefixlen,
+				connman_inet_route_cb_t callback,
+				void *user_data);
+int connman_inet_del_route_async(int family, int index, const char *host,
+				unsigned char prefixlen,
+				connman_inet_route_cb_t callback,
+				void *user_data);
+
 int connman_inet_add_to_bridge(int index, const char *bridge);
 int connman_inet_remove_from_bridge(int index, const char *bridge);
 
@@ -1394,14 +1394,19 @@ static void set_route(struct connection_data *data, struct vpn_route *route)
 	if (route->family == AF_INET6) {
 		unsigned char prefix_len = atoi(route->netmask);
 
-		connman_inet_add_ipv6_network_route(data->index,
-							route->network,
-							route->gateway,
-							prefix_len);
+		connman_inet_add_route_async(AF_INET6, data->index,
+						route->network, route->gateway,
+						prefix_len, NULL, NULL);
 	} else {
-		connman_inet_add_network_route(data->index, route->network,
-						route->gateway,
-						route->netmask);
+		unsigned char prefix_len = 32;
+
+		if (route->netmask)
+			prefix_len = connman_ipaddress_calc_netmask_len(
+							route->netmask);
+
+		connman_inet_add_route_async(AF_INET, data->index,
+						route->network, route->gateway,
+						prefix_len, NULL, NULL);
 	}
 }
 
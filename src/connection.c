@@ -819,6 +819,8 @@ int __connman_connection_gateway_add(struct connman_service *service,
 	if (!new_gateway)
 		return -EINVAL;
 
+	__connman_trace_begin(service, "gateway");
+
 	active_gateway = find_active_gateway();
 
 	DBG("active %p index %d new %p", active_gateway,
@@ -879,6 +881,8 @@ int __connman_connection_gateway_add(struct connman_service *service,
 	}
 
 done:
+	__connman_trace_end(service, "gateway");
+
 	if (type4 == CONNMAN_IPCONFIG_TYPE_IPV4)
 		__connman_service_ipconfig_indicate_state(service,
 						CONNMAN_SERVICE_STATE_READY,
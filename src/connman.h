@@ -85,6 +85,15 @@ int __connman_counter_register(const char *owner, const char *path,
 						unsigned int interval);
 int __connman_counter_unregister(const char *owner, const char *path);
 
+struct connman_stats_data;
+
+void __connman_counter_memory_update(const char *ident, bool roaming,
+					struct connman_stats_data *home,
+					struct connman_stats_data *roam);
+void __connman_counter_memory_remove(const char *ident);
+int __connman_counter_memory_open(const char *owner, unsigned int interval);
+int __connman_counter_memory_close(const char *owner);
+
 int __connman_counter_init(void);
 void __connman_counter_cleanup(void);
 
@@ -301,6 +310,7 @@ struct connman_ipconfig_ops {
 	void (*ip_release) (struct connman_ipconfig *ipconfig, const char *ifname);
 	void (*route_set) (struct connman_ipconfig *ipconfig, const char *ifname);
 	void (*route_unset) (struct connman_ipconfig *ipconfig, const char *ifname);
+	void (*index_changed) (struct connman_ipconfig *ipconfig, int old_index);
 };
 
 struct connman_ipconfig *__connman_ipconfig_create(int index,
@@ -340,6 +350,9 @@ void __connman_ipconfig_newlink(int index, unsigned short type,
 							unsigned short mtu,
 						struct rtnl_link_stats *stats);
 void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats);
+void __connman_ipconfig_update_stats(int index,
+					struct rtnl_link_stats *stats);
+GSList *__connman_ipconfig_get_stats_indexes(void);
 int __connman_ipconfig_newaddr(int index, int family, const char *label,
 				unsigned char prefixlen, const char *address);
 void __connman_ipconfig_deladdr(int index, int family, const char *label,
@@ -792,6 +805,7 @@ void __connman_service_notify(struct connman_service *service,
 
 int __connman_service_counter_register(const char *counter);
 void __connman_service_counter_unregister(const char *counter);
+void __connman_service_counter_due(const char *counter);
 
 #include <connman/peer.h>
 
@@ -860,8 +874,11 @@ void __connman_rtnl_start(void);
 void __connman_rtnl_cleanup(void);
 
 enum connman_device_type __connman_rtnl_get_device_type(int index);
-unsigned int __connman_rtnl_update_interval_add(unsigned int interval);
-unsigned int __connman_rtnl_update_interval_remove(unsigned int interval);
+typedef void (*__connman_rtnl_update_cb_t) (void *user_data);
+unsigned int __connman_rtnl_update_add(unsigned int interval,
+					__connman_rtnl_update_cb_t callback,
+					void *user_data);
+void __connman_rtnl_update_remove(unsigned int id);
 int __connman_rtnl_request_update(void);
 int __connman_rtnl_send(const void *buf, size_t len);
 
@@ -896,6 +913,26 @@ int __connman_stats_get(struct connman_service *service,
 				bool roaming,
 				struct connman_stats_data *data);
 
+typedef void (*connman_stats_range_cb_t) (time_t start,
+					struct connman_stats_data *usage,
+					void *user_data);
+int __connman_stats_get_range(struct connman_service *service,
+				bool roaming, time_t start, time_t end,
+				unsigned int interval,
+				connman_stats_range_cb_t func,
+				void *user_data);
+
+int __connman_trace_init(void);
+void __connman_trace_cleanup(void);
+void __connman_trace_begin(struct connman_service *service,
+				const char *name);
+void __connman_trace_end(struct connman_service *service, const char *name);
+void __connman_trace_event(struct connman_service *service,
+				const char *name);
+void __connman_trace_abort(struct connman_service *service,
+				const char *name);
+void __connman_trace_append(DBusMessageIter *iter);
+
 int __connman_iptables_dump(const char *table_name);
 int __connman_iptables_new_chain(const char *table_name,
 					const char *chain);
@@ -932,6 +969,9 @@ int __connman_dnsproxy_add_listener(int index);
 void __connman_dnsproxy_remove_listener(int index);
 int __connman_dnsproxy_append(int index, const char *domain, const char *server);
 int __connman_dnsproxy_remove(int index, const char *domain, const char *server);
+void __connman_dnsproxy_append_server_stats(DBusMessageIter *iter);
+void __connman_dnsproxy_set_listen_port(unsigned int port);
+void __connman_dnsproxy_set_server_port(unsigned int port);
 
 int __connman_6to4_probe(struct connman_service *service);
 void __connman_6to4_remove(struct connman_ipconfig *ipconfig);
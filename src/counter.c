@@ -23,21 +23,98 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <gdbus.h>
 
 #include "connman.h"
 
+#define MEMORY_MAGIC		0x434D4E43
+#define MEMORY_VERSION		1
+#define MEMORY_SLOTS		64
+#define MEMORY_IDENT_LEN	128
+
+#define MEMORY_SLOT_USED	0x1
+#define MEMORY_SLOT_ROAMING	0x2
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+/*
+ * The counters of the services can also be read from a shared memory
+ * region which is handed out as a memfd sealed against writes, only
+ * the mapping of the daemon made before sealing can change it. Each
+ * connected service has its own slot which is updated in place. A
+ * writer increments the sequence number before and after changing a
+ * slot, so readers retry as long as the number is odd or changed
+ * while reading the slot.
+ */
+struct memory_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;
+	uint32_t nr_slots;
+	uint32_t reserved;
+};
+
+struct memory_values {
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
+	uint64_t time;
+};
+
+struct memory_slot {
+	uint32_t sequence;
+	uint32_t flags;
+	char ident[MEMORY_IDENT_LEN];
+	struct memory_values home;
+	struct memory_values roaming;
+};
+
+#define MEMORY_SIZE	(sizeof(struct memory_header) + \
+				MEMORY_SLOTS * sizeof(struct memory_slot))
+
+struct counter_memory {
+	int fd;
+	struct memory_header *hdr;
+	struct memory_slot *slots;
+	GHashTable *slot_table;
+	GHashTable *client_table;
+	bool full;
+};
+
+struct memory_client {
+	char *owner;
+	unsigned int update_id;
+	guint watch;
+};
+
 static DBusConnection *connection;
 
 static GHashTable *counter_table;
 static GHashTable *owner_mapping;
 
+static struct counter_memory *memory;
+
 struct connman_counter {
 	char *owner;
 	char *path;
 	unsigned int interval;
+	unsigned int update_id;
 	guint watch;
 };
 
@@ -47,7 +124,8 @@ static void remove_counter(gpointer user_data)
 
 	DBG("owner %s path %s", counter->owner, counter->path);
 
-	__connman_rtnl_update_interval_remove(counter->interval);
+	if (counter->update_id > 0)
+		__connman_rtnl_update_remove(counter->update_id);
 
 	__connman_service_counter_unregister(counter->path);
 
@@ -56,6 +134,13 @@ static void remove_counter(gpointer user_data)
 	g_free(counter);
 }
 
+static void counter_update(void *user_data)
+{
+	struct connman_counter *counter = user_data;
+
+	__connman_service_counter_due(counter->path);
+}
+
 static void owner_disconnect(DBusConnection *conn, void *user_data)
 {
 	struct connman_counter *counter = user_data;
@@ -97,7 +182,8 @@ int __connman_counter_register(const char *owner, const char *path,
 	g_hash_table_replace(owner_mapping, counter->owner, counter);
 
 	counter->interval = interval;
-	__connman_rtnl_update_interval_add(counter->interval);
+	counter->update_id = __connman_rtnl_update_add(counter->interval,
+							counter_update, counter);
 
 	counter->watch = g_dbus_add_disconnect_watch(connection, owner,
 					owner_disconnect, counter, NULL);
@@ -148,6 +234,302 @@ void __connman_counter_send_usage(const char *path,
 	g_dbus_send_message(connection, message);
 }
 
+static void memory_write_begin(struct memory_slot *slot)
+{
+	g_atomic_int_inc((gint *) &slot->sequence);
+}
+
+static void memory_write_end(struct memory_slot *slot)
+{
+	g_atomic_int_inc((gint *) &slot->sequence);
+}
+
+static void memory_copy_values(struct memory_values *values,
+				struct connman_stats_data *data)
+{
+	values->rx_packets = data->rx_packets;
+	values->tx_packets = data->tx_packets;
+	values->rx_bytes = data->rx_bytes;
+	values->tx_bytes = data->tx_bytes;
+	values->rx_errors = data->rx_errors;
+	values->tx_errors = data->tx_errors;
+	values->rx_dropped = data->rx_dropped;
+	values->tx_dropped = data->tx_dropped;
+	values->time = data->time;
+}
+
+static struct memory_slot *memory_get_slot(const char *ident)
+{
+	struct memory_slot *slot;
+	gpointer value;
+	int i;
+
+	if (g_hash_table_lookup_extended(memory->slot_table, ident,
+							NULL, &value))
+		return &memory->slots[GPOINTER_TO_INT(value)];
+
+	for (i = 0; i < MEMORY_SLOTS; i++) {
+		slot = &memory->slots[i];
+
+		if (slot->flags & MEMORY_SLOT_USED)
+			continue;
+
+		memory_write_begin(slot);
+		memset(slot->ident, 0, sizeof(slot->ident));
+		g_strlcpy(slot->ident, ident, sizeof(slot->ident));
+		slot->flags = MEMORY_SLOT_USED;
+		memory_write_end(slot);
+
+		g_hash_table_replace(memory->slot_table, g_strdup(ident),
+							GINT_TO_POINTER(i));
+
+		return slot;
+	}
+
+	return NULL;
+}
+
+void __connman_counter_memory_update(const char *ident, bool roaming,
+					struct connman_stats_data *home,
+					struct connman_stats_data *roam)
+{
+	struct memory_slot *slot;
+
+	if (!memory || !ident)
+		return;
+
+	slot = memory_get_slot(ident);
+	if (!slot) {
+		if (!memory->full)
+			connman_warn("Counter memory full, %d services "
+					"supported, %s is left out",
+					MEMORY_SLOTS, ident);
+		memory->full = true;
+		return;
+	}
+
+	memory_write_begin(slot);
+
+	memory_copy_values(&slot->home, home);
+	memory_copy_values(&slot->roaming, roam);
+
+	if (roaming)
+		slot->flags |= MEMORY_SLOT_ROAMING;
+	else
+		slot->flags &= ~MEMORY_SLOT_ROAMING;
+
+	memory_write_end(slot);
+}
+
+void __connman_counter_memory_remove(const char *ident)
+{
+	struct memory_slot *slot;
+	gpointer value;
+
+	if (!memory || !ident)
+		return;
+
+	if (!g_hash_table_lookup_extended(memory->slot_table, ident,
+							NULL, &value))
+		return;
+
+	slot = &memory->slots[GPOINTER_TO_INT(value)];
+
+	memory_write_begin(slot);
+	slot->flags = 0;
+	memset(slot->ident, 0, sizeof(slot->ident));
+	memset(&slot->home, 0, sizeof(slot->home));
+	memset(&slot->roaming, 0, sizeof(slot->roaming));
+	memory_write_end(slot);
+
+	g_hash_table_remove(memory->slot_table, ident);
+	memory->full = false;
+}
+
+static void remove_client(gpointer user_data)
+{
+	struct memory_client *client = user_data;
+
+	DBG("owner %s", client->owner);
+
+	if (client->update_id > 0)
+		__connman_rtnl_update_remove(client->update_id);
+
+	if (client->watch > 0)
+		g_dbus_remove_watch(connection, client->watch);
+
+	g_free(client->owner);
+	g_free(client);
+}
+
+static void client_update(void *user_data)
+{
+	/*
+	 * Nothing to do, the slots are written whenever the statistics
+	 * of a service are updated. The client only drives the polling.
+	 */
+}
+
+static void client_disconnect(DBusConnection *conn, void *user_data)
+{
+	struct memory_client *client = user_data;
+
+	DBG("owner %s", client->owner);
+
+	client->watch = 0;
+
+	g_hash_table_remove(memory->client_table, client->owner);
+}
+
+static void free_memory(void)
+{
+	if (!memory)
+		return;
+
+	g_hash_table_destroy(memory->client_table);
+	g_hash_table_destroy(memory->slot_table);
+
+	munmap(memory->hdr, MEMORY_SIZE);
+	close(memory->fd);
+
+	g_free(memory);
+	memory = NULL;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+static int create_memory(void)
+{
+	void *addr;
+	int fd, err;
+
+	fd = memfd_create("connman-counters",
+				MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, MEMORY_SIZE) < 0) {
+		err = -errno;
+		goto err;
+	}
+
+	/* Readers must not be able to shrink the region under us */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+		err = -errno;
+		goto err;
+	}
+
+	addr = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+						MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		err = -errno;
+		goto err;
+	}
+
+	/* From now on only the mapping above can write to the region */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0) {
+		err = -errno;
+		connman_error("Cannot seal counter memory against writes "
+				"(%s), F_SEAL_FUTURE_WRITE needs Linux 5.1",
+				strerror(-err));
+		munmap(addr, MEMORY_SIZE);
+		goto err;
+	}
+
+	memory = g_try_new0(struct counter_memory, 1);
+	if (!memory) {
+		munmap(addr, MEMORY_SIZE);
+		err = -ENOMEM;
+		goto err;
+	}
+
+	memory->fd = fd;
+	memory->hdr = addr;
+	memory->slots = (struct memory_slot *) (memory->hdr + 1);
+	memory->slot_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+	memory->client_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, remove_client);
+
+	memory->hdr->magic = MEMORY_MAGIC;
+	memory->hdr->version = MEMORY_VERSION;
+	memory->hdr->slot_size = sizeof(struct memory_slot);
+	memory->hdr->nr_slots = MEMORY_SLOTS;
+
+	return 0;
+
+err:
+	close(fd);
+	return err;
+}
+#else
+static int create_memory(void)
+{
+	return -ENOSYS;
+}
+#endif
+
+static int open_read_only(int fd)
+{
+	char path[32];
+	int ro_fd;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	ro_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (ro_fd < 0)
+		return -errno;
+
+	return ro_fd;
+}
+
+int __connman_counter_memory_open(const char *owner, unsigned int interval)
+{
+	struct memory_client *client;
+	int err;
+
+	DBG("owner %s interval %u", owner, interval);
+
+	if (!memory) {
+		err = create_memory();
+		if (err < 0)
+			return err;
+	}
+
+	client = g_hash_table_lookup(memory->client_table, owner);
+	if (client) {
+		__connman_rtnl_update_remove(client->update_id);
+	} else {
+		client = g_try_new0(struct memory_client, 1);
+		if (!client)
+			return -ENOMEM;
+
+		client->owner = g_strdup(owner);
+		client->watch = g_dbus_add_disconnect_watch(connection,
+					owner, client_disconnect, client, NULL);
+
+		g_hash_table_replace(memory->client_table, client->owner,
+								client);
+	}
+
+	client->update_id = __connman_rtnl_update_add(interval,
+							client_update, client);
+
+	return open_read_only(memory->fd);
+}
+
+int __connman_counter_memory_close(const char *owner)
+{
+	DBG("owner %s", owner);
+
+	if (!memory)
+		return -ESRCH;
+
+	if (!g_hash_table_remove(memory->client_table, owner))
+		return -ESRCH;
+
+	return 0;
+}
+
 static void release_counter(gpointer key, gpointer value, gpointer user_data)
 {
 	struct connman_counter *counter = value;
@@ -196,5 +578,7 @@ void __connman_counter_cleanup(void)
 	g_hash_table_destroy(owner_mapping);
 	g_hash_table_destroy(counter_table);
 
+	free_memory();
+
 	dbus_connection_unref(connection);
 }
@@ -243,6 +243,14 @@ static gboolean dhcp_retry_cb(gpointer user_data)
 	return FALSE;
 }
 
+static struct connman_service *dhcp_service(struct connman_dhcp *dhcp)
+{
+	if (!dhcp->network)
+		return NULL;
+
+	return connman_service_lookup_from_network(dhcp->network);
+}
+
 static void no_lease_cb(GDHCPClient *dhcp_client, gpointer user_data)
 {
 	struct connman_dhcp *dhcp = user_data;
@@ -251,6 +259,8 @@ static void no_lease_cb(GDHCPClient *dhcp_client, gpointer user_data)
 	DBG("No lease available ipv4ll %d client %p", ipv4ll_running,
 		dhcp->ipv4ll_client);
 
+	__connman_trace_event(dhcp_service(dhcp), "dhcp-no-lease");
+
 	dhcp->timeout = g_timeout_add_seconds(RATE_LIMIT_INTERVAL,
 						dhcp_retry_cb,
 						dhcp);
@@ -420,6 +430,8 @@ static void lease_available_cb(GDHCPClient *dhcp_client, gpointer user_data)
 
 	DBG("Lease available");
 
+	__connman_trace_end(dhcp_service(dhcp), "dhcp");
+
 	if (dhcp->ipv4ll_client) {
 		ipv4ll_stop_client(dhcp);
 		dhcp_invalidate(dhcp, false);
@@ -485,6 +497,8 @@ static void ipv4ll_available_cb(GDHCPClient *ipv4ll_client, gpointer user_data)
 
 	DBG("IPV4LL available");
 
+	__connman_trace_event(dhcp_service(dhcp), "ipv4ll");
+
 	address = g_dhcp_client_get_address(ipv4ll_client);
 	netmask = g_dhcp_client_get_netmask(ipv4ll_client);
 
@@ -649,6 +663,8 @@ int __connman_dhcp_start(struct connman_ipconfig *ipconfig,
 	dhcp->callback = callback;
 	dhcp->user_data = user_data;
 
+	__connman_trace_begin(dhcp_service(dhcp), "dhcp");
+
 	return g_dhcp_client_start(dhcp->dhcp_client, last_addr);
 }
 
@@ -769,6 +769,7 @@ static void dad_reply(struct nd_neighbor_advert *reply,
 		unsigned int length, struct in6_addr *addr, void *user_data)
 {
 	struct own_address *data = user_data;
+	struct connman_service *service;
 	GSList *list;
 	char address[INET6_ADDRSTRLEN];
 	enum __connman_dhcpv6_status status = CONNMAN_DHCPV6_STATUS_FAIL;
@@ -804,7 +805,12 @@ static void dad_reply(struct nd_neighbor_advert *reply,
 		set_address(data->ifindex, data->ipconfig, data->prefixes,
 								list->data);
 
+	service = __connman_service_lookup_from_index(data->ifindex);
+	__connman_trace_end(service, "dad");
+
 	if (data->dad_failed) {
+		__connman_trace_event(service, "dad-failed");
+
 		dhcpv6_decline(data->dhcp_client, data->ifindex,
 			data->callback, data->dad_failed);
 	} else {
@@ -813,10 +819,7 @@ static void dad_reply(struct nd_neighbor_advert *reply,
 
 		if (data->callback) {
 			struct connman_network *network;
-			struct connman_service *service;
 
-			service = __connman_service_lookup_from_index(
-								data->ifindex);
 			network = __connman_service_get_network(service);
 			if (network)
 				data->callback(network, status, NULL);
@@ -868,6 +871,9 @@ static void do_dad(GDHCPClient *dhcp_client, struct connman_dhcpv6 *dhcp)
 	GList *option, *list;
 	struct own_address *user_data;
 
+	service = connman_service_lookup_from_network(dhcp->network);
+	__connman_trace_end(service, "dhcpv6");
+
 	option = g_dhcp_client_get_option(dhcp_client, G_DHCPV6_IA_NA);
 	if (!option)
 		option = g_dhcp_client_get_option(dhcp_client, G_DHCPV6_IA_TA);
@@ -891,7 +897,6 @@ static void do_dad(GDHCPClient *dhcp_client, struct connman_dhcpv6 *dhcp)
 
 	DBG("index %d", ifindex);
 
-	service = connman_service_lookup_from_network(dhcp->network);
 	if (!service) {
 		connman_error("Can not lookup service for index %d", ifindex);
 		goto error;
@@ -944,6 +949,8 @@ static void do_dad(GDHCPClient *dhcp_client, struct connman_dhcpv6 *dhcp)
 	 * via dhcp callback.
 	 */
 
+	__connman_trace_begin(service, "dad");
+
 	for (list = option; list; list = list->next) {
 		char *address = option->data;
 		struct in6_addr addr;
@@ -1829,6 +1836,8 @@ int __connman_dhcpv6_start(struct connman_network *network,
 
 	g_hash_table_replace(network_table, network, dhcp);
 
+	__connman_trace_begin(service, "dhcpv6");
+
 	/* Initial timeout, RFC 3315, 17.1.2 */
 	__connman_util_get_random(&rand);
 	delay = rand % 1000;
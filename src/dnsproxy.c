@@ -23,7 +23,9 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -78,8 +80,8 @@ struct domain_hdr {
 #endif
 
 struct partial_reply {
-	uint16_t len;
-	uint16_t received;
+	unsigned int len;
+	unsigned int received;
 	unsigned char buf[];
 };
 
@@ -96,6 +98,19 @@ struct server_data {
 	bool enabled;
 	bool connected;
 	struct partial_reply *incoming_reply;
+	unsigned int queries;
+	unsigned int answers;
+	unsigned int timeouts;
+	unsigned int failures;	/* failures in a row */
+	time_t failed_at;
+	gint64 srtt;		/* smoothed round trip time in usec */
+	gint64 rttvar;
+};
+
+struct request_server {
+	struct server_data *server;
+	gint64 sent;
+	bool done;
 };
 
 struct request_data {
@@ -111,6 +126,7 @@ struct request_data {
 	guint16 dstid;
 	guint16 altid;
 	guint timeout;
+	guint stale_timeout;
 	guint watch;
 	guint numserv;
 	guint numresp;
@@ -121,6 +137,13 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	bool append_domain;
+	bool answered;	/* client already got a stale answer */
+	bool prefetch;	/* internal cache refresh, there is no client */
+	GList *link;	/* position in request_queue */
+	GSList *followers; /* clients waiting for the same answer */
+	GSList *servers; /* struct request_server for each server tried */
+	guint hedge_timeout;
+	uint16_t udp_size; /* EDNS0 payload size, 0 if the client has none */
 };
 
 struct listener_data {
@@ -160,6 +183,7 @@ struct cache_data {
 	uint16_t answers;
 	unsigned int data_len;
 	unsigned char *data; /* contains DNS header + body */
+	bool negative;	/* NXDOMAIN or NODATA answer */
 };
 
 struct cache_entry {
@@ -168,6 +192,12 @@ struct cache_entry {
 	int hits;
 	struct cache_data *ipv4;
 	struct cache_data *ipv6;
+	time_t prefetched;
+	GList *lru_link;	/* position in cache_lru, head is most recent */
+	unsigned int heap_index; /* position in cache_expiry heap */
+	size_t size;		/* bytes accounted in cache_bytes */
+	GList *negative_link;	/* position in cache_negative */
+	size_t negative_size;	/* bytes accounted in cache_negative_bytes */
 };
 
 struct domain_question {
@@ -182,11 +212,54 @@ struct domain_rr {
 	uint16_t rdlen;
 } __attribute__ ((packed));
 
+/*
+ * A view of a domain name inside a DNS message. The labels are read
+ * directly from the message, following the compression pointers, so
+ * that names can be hashed and compared without copying them.
+ */
+struct dns_name_view {
+	const unsigned char *msg;	/* start of the DNS message */
+	const unsigned char *end;	/* end of the DNS message */
+	const unsigned char *name;	/* first label of the name */
+};
+
+/* Max number of compression pointers followed for one label */
+#define DNS_MAX_JUMPS 16
+
+/* Max number of aliases (CNAME) of the question followed in a reply */
+#define MAX_ALIASES 8
+
 /*
  * Max length of the DNS TCP packet.
  */
 #define TCP_MAX_BUF_LEN 4096
 
+/*
+ * Seconds an upstream TCP connection is kept open without queries.
+ */
+#define TCP_IDLE_TIMEOUT 10
+
+/*
+ * UDP payload sizes (RFC 6891). A client without EDNS0 takes answers
+ * of up to 512 bytes, and no UDP message is larger than EDNS0_MAX_SIZE.
+ */
+#define DNS_UDP_SIZE 512
+#define EDNS0_MAX_SIZE 4096
+
+/*
+ * Max number of datagrams received with one recvmmsg() call, and
+ * answers sent with one sendmmsg() call, when a UDP socket wakes up.
+ * Anything left waiting is handled on the next round of the main loop
+ * so that the other sources are not starved.
+ */
+#define UDP_BATCH_SIZE 16
+
+/* Size of the buffers the queries of the UDP clients are received in */
+#define UDP_QUERY_BUF_SIZE 768
+
+/* Size of an OPT record without options (RFC 6891 section 6.1.2) */
+#define EDNS0_OPT_SIZE 11
+
 /*
  * We limit how long the cached DNS entry stays in the cache.
  * By default the TTL (time-to-live) of the DNS response is used
@@ -197,33 +270,335 @@ struct domain_rr {
  * Also limit the other end, cache at least for 30 seconds.
  */
 #define MIN_CACHE_TTL (30)
+/*
+ * Negative answers are cached for the time given by the SOA record
+ * of the answer (RFC 2308), but at most for MAX_NEGATIVE_TTL seconds.
+ */
+#define MAX_NEGATIVE_TTL (60 * 60 * 3)
 
 /*
- * We limit the cache size to some sane value so that cached data does
- * not occupy too much memory. Each cached entry occupies on average
- * about 100 bytes memory (depending on DNS name length).
- * Example: caching www.connman.net uses 97 bytes memory.
- * The value is the max amount of cached DNS responses (count).
+ * Expired entries can be kept in the cache for DNSProxyServeStale
+ * seconds and are used as an answer if the upstream servers fail or
+ * do not answer in time (RFC 8767). The TTL of such an answer is
+ * capped to STALE_ANSWER_TTL seconds and the client waits at most
+ * STALE_CLIENT_TIMEOUT milliseconds before getting it.
+ */
+#define STALE_ANSWER_TTL (30)
+#define STALE_CLIENT_TIMEOUT (1800)
+
+/*
+ * Popular entries are refreshed from upstream in the background when
+ * less than DNSProxyPrefetchThreshold percent of their lifetime is
+ * left. A refresh is not retried for PREFETCH_RETRY seconds.
+ */
+#define PREFETCH_RETRY (5)
+
+/*
+ * A query is sent first to the healthy upstream server with the
+ * shortest smoothed round trip time. If that server has not answered
+ * within its round trip time plus four times the variance, clamped
+ * between HEDGE_MIN_DELAY and HEDGE_MAX_DELAY milliseconds, the query
+ * is sent to the next best server too. HEDGE_DELAY is used for the
+ * servers without measurements. A server that has failed to answer
+ * SERVER_MAX_FAILURES times in a row is tried after the healthy ones
+ * until SERVER_RETRY_TIME seconds have passed since the last failure.
  */
-#define MAX_CACHE_SIZE 256
+#define HEDGE_MIN_DELAY (20)
+#define HEDGE_MAX_DELAY (1500)
+#define HEDGE_DELAY (400)
+#define SERVER_MAX_FAILURES (3)
+#define SERVER_RETRY_TIME (30)
 
-static int cache_size;
+/*
+ * We limit the cache size to some sane value so that cached data does
+ * not occupy too much memory. The limit is the amount of memory (in
+ * bytes) used by the cached entries, including the DNS name and the
+ * cached packet, and it is set by DNSProxyCacheSize in main.conf.
+ * Example: caching www.connman.net uses about 150 bytes memory.
+ *
+ * When the limit is reached, the expired entries are removed first
+ * using the expiry heap and then the least recently used entries
+ * from the tail of the LRU queue. Both operations avoid walking
+ * through the whole cache.
+ *
+ * Negative answers have a budget of their own, DNSProxyNegativeCacheSize,
+ * so that lookups of non-existent names cannot push the real answers
+ * out of the cache. The entries holding negative answers are queued
+ * in cache_negative in the order they were added, and the oldest
+ * negative answers are dropped when the budget is used up.
+ */
+#define CACHE_HEAP_NONE G_MAXUINT
+
+static size_t cache_max_bytes;
+static unsigned int cache_stale_time;
+static unsigned int cache_prefetch_threshold;
+static size_t cache_bytes;
+static size_t cache_negative_max_bytes;
+static size_t cache_negative_bytes;
 static GHashTable *cache;
+static GQueue *cache_negative;
+static GQueue *cache_lru;
+static GPtrArray *cache_expiry;
 static int cache_refcount;
+
+static struct {
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
+	unsigned int expirations;
+	unsigned int prefetches;
+	unsigned int stale_answers;
+	unsigned int negative_hits;
+	unsigned int negative_evictions;
+} cache_stats;
+
 static GSList *server_list = NULL;
-static GSList *request_list = NULL;
+
+static unsigned int edns0_size = DNS_UDP_SIZE;
+static unsigned int dns_listener_port = 53;
+static unsigned int dns_server_port = 53;
+
+/*
+ * The outstanding requests are kept in request_queue in the order
+ * they were received. The request_table maps both upstream IDs
+ * (dstid and altid) of a request to the request, and client_table
+ * maps the client address and client ID to the request, so that
+ * replies and retransmitted queries are matched without walking
+ * through the queue. The question_table maps the UDP queries that
+ * were sent upstream, so that identical queries from other clients
+ * can wait for the same answer.
+ */
+static GQueue request_queue = G_QUEUE_INIT;
+static GHashTable *request_table = NULL;
+static GHashTable *client_table = NULL;
+static GHashTable *question_table = NULL;
 static GHashTable *listener_table = NULL;
 static time_t next_refresh;
 static GHashTable *partial_tcp_req_table;
 static guint cache_timer = 0;
 
+/*
+ * The cache can be saved to CACHE_SNAPSHOT_FILE when it is destroyed
+ * and every CACHE_SNAPSHOT_INTERVAL seconds, and it is loaded back
+ * when dnsproxy starts. The file starts with a header carrying the
+ * version of the format and a checksum of the rest of the file. Then
+ * comes the identifier of the default service the cache was filled
+ * for, followed by one record for each cached answer with its absolute
+ * expiry times. The records are written from the least recently used
+ * entry to the most recently used one, so loading them restores the
+ * LRU order.
+ */
+#define CACHE_SNAPSHOT_FILE STORAGEDIR "/dnsproxy.cache"
+#define CACHE_SNAPSHOT_MAGIC 0x434e4d44
+#define CACHE_SNAPSHOT_VERSION 1
+#define CACHE_SNAPSHOT_INTERVAL (10 * 60)
+
+struct cache_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t length;	/* bytes after the header */
+	uint32_t checksum;	/* FNV-1a of the bytes after the header */
+	uint32_t ident_len;
+} __attribute__ ((packed));
+
+struct cache_snapshot_record {
+	int64_t inserted;
+	int64_t valid_until;
+	int64_t cache_until;
+	int32_t timeout;
+	uint16_t type;
+	uint16_t answers;
+	uint16_t key_len;
+	uint8_t negative;
+	uint8_t reserved;
+	uint32_t data_len;
+} __attribute__ ((packed));
+
+static bool cache_snapshot_enabled;
+static bool cache_dirty;
+static guint cache_snapshot_timer;
+static char *cache_snapshot_ident;	/* service the loaded cache is for */
+static char *default_ident;
+
+static void cache_prefetch(struct cache_entry *entry, uint16_t type);
+static bool send_stale_response(struct request_data *req);
+static void cache_snapshot_save(void);
+static guint cache_key_hash(gconstpointer key);
+static gboolean cache_key_equal(gconstpointer a, gconstpointer b);
+
+/*
+ * Get a random ID that is not used by any outstanding request, so
+ * that a reply cannot be matched to the wrong request. If we are
+ * unlucky, the free ID is searched sequentially.
+ */
 static guint16 get_id(void)
 {
 	uint64_t rand;
+	guint16 id;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		__connman_util_get_random(&rand);
+		id = rand;
+
+		if (!g_hash_table_lookup(request_table, GUINT_TO_POINTER(id)))
+			return id;
+	}
+
+	for (i = 0; i <= G_MAXUINT16; i++, id++) {
+		if (!g_hash_table_lookup(request_table, GUINT_TO_POINTER(id)))
+			break;
+	}
+
+	return id;
+}
+
+static void request_set_ids(struct request_data *req)
+{
+	req->dstid = get_id();
+
+	do {
+		req->altid = get_id();
+	} while (req->altid == req->dstid);
+}
 
-	__connman_util_get_random(&rand);
+/*
+ * Requests of the same client are identified by the client address
+ * and the client ID. TCP clients have their own socket.
+ */
+static guint client_hash(gconstpointer key)
+{
+	const struct request_data *req = key;
+	const unsigned char *addr = (const unsigned char *) &req->sa;
+	guint hash = req->srcid;
+	socklen_t i;
+
+	if (req->protocol == IPPROTO_TCP)
+		return hash ^ req->client_sk << 16;
+
+	for (i = 0; i < req->sa_len; i++)
+		hash = hash * 31 + addr[i];
+
+	return hash;
+}
+
+static gboolean client_equal(gconstpointer a, gconstpointer b)
+{
+	const struct request_data *req_a = a;
+	const struct request_data *req_b = b;
+
+	if (req_a->srcid != req_b->srcid ||
+			req_a->protocol != req_b->protocol)
+		return FALSE;
+
+	if (req_a->protocol == IPPROTO_TCP)
+		return req_a->client_sk == req_b->client_sk;
+
+	return req_a->ifdata == req_b->ifdata &&
+		req_a->sa_len == req_b->sa_len &&
+		memcmp(&req_a->sa, &req_b->sa, req_a->sa_len) == 0;
+}
+
+/*
+ * Two UDP queries are identical if everything else than the ID
+ * matches, including the case of the name and the EDNS0 options,
+ * so that the answer of one is a valid answer to the other.
+ */
+static guint question_hash(gconstpointer key)
+{
+	const struct request_data *req = key;
+	const unsigned char *buf = req->request;
+	guint hash = 5381;
+	gsize i;
+
+	for (i = 2; i < req->request_len; i++)
+		hash = hash * 33 + buf[i];
+
+	return hash;
+}
+
+static gboolean question_equal(gconstpointer a, gconstpointer b)
+{
+	const struct request_data *req_a = a;
+	const struct request_data *req_b = b;
+
+	if (req_a->request_len != req_b->request_len)
+		return FALSE;
+
+	return memcmp((unsigned char *) req_a->request + 2,
+			(unsigned char *) req_b->request + 2,
+			req_a->request_len - 2) == 0;
+}
+
+static void request_add(struct request_data *req)
+{
+	g_queue_push_tail(&request_queue, req);
+	req->link = g_queue_peek_tail_link(&request_queue);
+
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->dstid),
+									req);
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->altid),
+									req);
+
+	if (!req->prefetch)
+		g_hash_table_replace(client_table, req, req);
+
+	if (!req->prefetch && req->protocol == IPPROTO_UDP && req->request)
+		g_hash_table_replace(question_table, req, req);
+}
+
+static void request_remove(struct request_data *req)
+{
+	if (!req->link)
+		return;
+
+	g_queue_delete_link(&request_queue, req->link);
+	req->link = NULL;
+
+	if (g_hash_table_lookup(request_table,
+				GUINT_TO_POINTER(req->dstid)) == req)
+		g_hash_table_remove(request_table,
+					GUINT_TO_POINTER(req->dstid));
+
+	if (g_hash_table_lookup(request_table,
+				GUINT_TO_POINTER(req->altid)) == req)
+		g_hash_table_remove(request_table,
+					GUINT_TO_POINTER(req->altid));
+
+	if (g_hash_table_lookup(client_table, req) == req)
+		g_hash_table_remove(client_table, req);
+
+	if (req->request && g_hash_table_lookup(question_table, req) == req)
+		g_hash_table_remove(question_table, req);
+}
+
+/*
+ * If the same question is already being resolved, attach the request
+ * to the outstanding one instead of sending it upstream again.
+ */
+static bool request_join(struct request_data *req, unsigned char *buf)
+{
+	struct request_data *leader;
+
+	req->request = buf;
+	leader = g_hash_table_lookup(question_table, req);
+	req->request = NULL;
+
+	if (!leader)
+		return false;
+
+	req->request = g_try_malloc(req->request_len);
+	if (!req->request)
+		return false;
+
+	memcpy(req->request, buf, req->request_len);
 
-	return rand;
+	leader->followers = g_slist_prepend(leader->followers, req);
+	g_hash_table_replace(client_table, req, req);
+
+	DBG("id 0x%04x waits for 0x%04x", req->srcid, leader->dstid);
+
+	return true;
 }
 
 static int protocol_offset(int protocol)
@@ -264,16 +639,7 @@ static time_t round_down_ttl(time_t end_time, int ttl)
 
 static struct request_data *find_request(guint16 id)
 {
-	GSList *list;
-
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
-
-		if (req->dstid == id || req->altid == id)
-			return req;
-	}
-
-	return NULL;
+	return g_hash_table_lookup(request_table, GUINT_TO_POINTER(id));
 }
 
 static struct server_data *find_server(int index,
@@ -323,13 +689,15 @@ static void refresh_dns_entry(struct cache_entry *entry, char *name)
 	if (!ipv4_resolve) {
 		ipv4_resolve = g_resolv_new(0);
 		g_resolv_set_address_family(ipv4_resolve, AF_INET);
-		g_resolv_add_nameserver(ipv4_resolve, "127.0.0.1", 53, 0);
+		g_resolv_add_nameserver(ipv4_resolve, "127.0.0.1",
+						dns_listener_port, 0);
 	}
 
 	if (!ipv6_resolve) {
 		ipv6_resolve = g_resolv_new(0);
 		g_resolv_set_address_family(ipv6_resolve, AF_INET6);
-		g_resolv_add_nameserver(ipv6_resolve, "::1", 53, 0);
+		g_resolv_add_nameserver(ipv6_resolve, "::1",
+						dns_listener_port, 0);
 	}
 
 	if (!entry->ipv4) {
@@ -407,12 +775,213 @@ static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
 	}
 }
 
+/*
+ * While a batch of datagrams is handled, the UDP answers to the
+ * clients are queued and sent with one sendmmsg() call when the batch
+ * is done, or when the queue is full or the answers go to another
+ * socket.
+ */
+static struct {
+	bool active;
+	int sk;
+	unsigned int count;
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct sockaddr_in6 addr[UDP_BATCH_SIZE];
+} udp_out;
+
+static void udp_batch_flush(void)
+{
+	unsigned int i, sent = 0;
+	int err;
+
+	while (sent < udp_out.count) {
+		err = sendmmsg(udp_out.sk, udp_out.msgs + sent,
+				udp_out.count - sent, MSG_NOSIGNAL);
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* skip the answer that failed and send the rest */
+			DBG("Cannot send DNS response, sk %d: %s",
+				udp_out.sk, strerror(errno));
+			err = 1;
+		}
+
+		sent += err;
+	}
+
+	for (i = 0; i < udp_out.count; i++)
+		g_free(udp_out.iov[i].iov_base);
+
+	udp_out.count = 0;
+}
+
+static void udp_batch_begin(void)
+{
+	udp_out.active = true;
+}
+
+static void udp_batch_end(void)
+{
+	udp_batch_flush();
+	udp_out.active = false;
+}
+
+static ssize_t udp_sendto(int sk, const void *buf, size_t len,
+			const struct sockaddr *to, socklen_t tolen)
+{
+	struct msghdr *hdr;
+	unsigned int i;
+	void *copy;
+
+	if (!udp_out.active || !to || tolen > sizeof(udp_out.addr[0]))
+		return sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+
+	if (udp_out.count == UDP_BATCH_SIZE ||
+			(udp_out.count > 0 && udp_out.sk != sk))
+		udp_batch_flush();
+
+	copy = g_try_malloc(len);
+	if (!copy)
+		return sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+
+	memcpy(copy, buf, len);
+
+	i = udp_out.count++;
+	udp_out.sk = sk;
+
+	udp_out.iov[i].iov_base = copy;
+	udp_out.iov[i].iov_len = len;
+	memcpy(&udp_out.addr[i], to, tolen);
+
+	hdr = &udp_out.msgs[i].msg_hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name = &udp_out.addr[i];
+	hdr->msg_namelen = tolen;
+	hdr->msg_iov = &udp_out.iov[i];
+	hdr->msg_iovlen = 1;
+
+	return len;
+}
+
+static int skip_name(unsigned char *ptr, unsigned char *max);
+
+/*
+ * Copy the message to buf without its OPT record. Returns the new
+ * length, or a negative error if there is no OPT record or the copy
+ * does not fit.
+ */
+static int strip_opt(unsigned char *msg, size_t len, unsigned char *buf,
+								size_t size)
+{
+	struct domain_hdr *hdr = (void *) msg;
+	unsigned char *end = msg + len, *rr;
+	int count, skip, i, name_len;
+	uint16_t type, rdlen;
+	size_t rr_len;
+
+	if (len < sizeof(struct domain_hdr) || ntohs(hdr->qdcount) != 1 ||
+			hdr->arcount == 0)
+		return -ENOENT;
+
+	rr = msg + sizeof(struct domain_hdr);
+	name_len = skip_name(rr, end);
+	if (name_len < 0 || rr + name_len + 4 > end)
+		return -EINVAL;
+
+	rr += name_len + 4;
+
+	skip = ntohs(hdr->ancount) + ntohs(hdr->nscount);
+	count = skip + ntohs(hdr->arcount);
+
+	for (i = 0; i < count; i++) {
+		name_len = skip_name(rr, end);
+		if (name_len < 0 || rr + name_len + 10 > end)
+			return -EINVAL;
+
+		type = rr[name_len] << 8 | rr[name_len + 1];
+		rdlen = rr[name_len + 8] << 8 | rr[name_len + 9];
+		rr_len = name_len + 10 + rdlen;
+		if (rr + rr_len > end)
+			return -EINVAL;
+
+		if (i >= skip && type == ns_t_opt) {
+			if (len - rr_len > size)
+				return -ENOBUFS;
+
+			memcpy(buf, msg, rr - msg);
+			memcpy(buf + (rr - msg), rr + rr_len,
+						end - (rr + rr_len));
+
+			hdr = (void *) buf;
+			hdr->arcount = htons(ntohs(hdr->arcount) - 1);
+
+			return len - rr_len;
+		}
+
+		rr += rr_len;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * An answer that is larger than the UDP payload size of the client is
+ * sent as the header and the question only, with TC set, so that the
+ * client asks again over TCP (RFC 6891 section 7). The OPT record the
+ * proxy added to the query is removed from the answer to a client
+ * without EDNS0.
+ */
+static ssize_t udp_send_answer(int sk, unsigned char *msg, size_t len,
+			uint16_t udp_size, const struct sockaddr *to,
+			socklen_t tolen)
+{
+	unsigned char buf[sizeof(struct domain_hdr) + NS_MAXCDNAME + 4];
+	unsigned char stripped[DNS_UDP_SIZE];
+	struct domain_hdr *hdr = (void *) buf;
+	int qlen;
+
+	if (udp_size == 0) {
+		qlen = strip_opt(msg, len, stripped, sizeof(stripped));
+		if (qlen > 0) {
+			msg = stripped;
+			len = qlen;
+		}
+	}
+
+	if (len <= MAX(udp_size, DNS_UDP_SIZE) ||
+			len < sizeof(struct domain_hdr))
+		return udp_sendto(sk, msg, len, to, tolen);
+
+	qlen = skip_name(msg + sizeof(struct domain_hdr), msg + len);
+	if (qlen < 0 || qlen > NS_MAXCDNAME ||
+			sizeof(struct domain_hdr) + qlen + 4 > len)
+		return -EINVAL;
+
+	qlen += 4;
+	memcpy(buf, msg, sizeof(struct domain_hdr) + qlen);
+
+	hdr->tc = 1;
+	hdr->qdcount = htons(1);
+	hdr->ancount = 0;
+	hdr->nscount = 0;
+	hdr->arcount = 0;
+
+	DBG("answer of %zd bytes truncated for client size %u", len,
+								udp_size);
+
+	return udp_sendto(sk, buf, sizeof(struct domain_hdr) + qlen, to,
+									tolen);
+}
+
 static void send_cached_response(int sk, unsigned char *buf, int len,
 				const struct sockaddr *to, socklen_t tolen,
-				int protocol, int id, uint16_t answers, int ttl)
+				int protocol, int id, uint16_t answers, int ttl,
+				const char *question, uint16_t udp_size)
 {
 	struct domain_hdr *hdr;
-	unsigned char *ptr = buf;
+	unsigned char *ptr = buf, *copy = NULL;
 	int err, offset, dns_len, adj_len = len - 2;
 
 	/*
@@ -439,33 +1008,72 @@ static void send_cached_response(int sk, unsigned char *buf, int len,
 
 	hdr = (void *) (ptr + offset);
 
+	/*
+	 * The cache is looked up ignoring the case of the name, so the
+	 * answer is sent with the name written the way the client did.
+	 * The cached packet is shared by all clients, the name is only
+	 * changed in a copy of it.
+	 */
+	if (question) {
+		char *cached = (char *) hdr + sizeof(struct domain_hdr);
+		size_t qlen = strlen(question);
+
+		if (offset + sizeof(struct domain_hdr) + qlen < (size_t) len &&
+				strnlen(cached, qlen + 1) == qlen &&
+				memcmp(cached, question, qlen) != 0) {
+			copy = g_try_malloc(len);
+			if (!copy)
+				return;
+
+			memcpy(copy, ptr, len);
+			ptr = copy;
+			hdr = (void *) (ptr + offset);
+
+			memcpy((char *) hdr + sizeof(struct domain_hdr),
+							question, qlen);
+		}
+	}
+
 	hdr->id = id;
 	hdr->qr = 1;
-	hdr->rcode = ns_r_noerror;
 	hdr->ancount = htons(answers);
-	hdr->nscount = 0;
 	hdr->arcount = 0;
 
-	/* if this is a negative reply, we are authorative */
-	if (answers == 0)
+	/*
+	 * If this is a negative reply, we are authorative. The cached
+	 * negative reply keeps its rcode and the SOA record in the
+	 * authority section, whose TTL tells the client how long it
+	 * may cache the answer.
+	 */
+	if (answers == 0) {
 		hdr->aa = 1;
-	else
-		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+	} else {
+		hdr->rcode = ns_r_noerror;
+		hdr->nscount = 0;
+	}
+
+	update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
 
 	DBG("sk %d id 0x%04x answers %d ptr %p length %d dns %d",
 		sk, hdr->id, answers, ptr, len, dns_len);
 
-	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
+	if (protocol == IPPROTO_UDP)
+		err = udp_send_answer(sk, ptr, len, udp_size, to, tolen);
+	else
+		err = udp_sendto(sk, ptr, len, to, tolen);
 	if (err < 0) {
 		connman_error("Cannot send cached DNS response: %s",
 				strerror(errno));
-		return;
+		goto out;
 	}
 
 	if (err != len || (dns_len != (len - 2) && protocol == IPPROTO_TCP) ||
 				(dns_len != len && protocol == IPPROTO_UDP))
 		DBG("Packet length mismatch, sent %d wanted %d dns %d",
 			err, len, dns_len);
+
+out:
+	g_free(copy);
 }
 
 static void send_response(int sk, unsigned char *buf, int len,
@@ -494,7 +1102,7 @@ static void send_response(int sk, unsigned char *buf, int len,
 	hdr->nscount = 0;
 	hdr->arcount = 0;
 
-	err = sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+	err = udp_sendto(sk, buf, len, to, tolen);
 	if (err < 0) {
 		connman_error("Failed to send DNS response to %d: %s",
 				sk, strerror(errno));
@@ -517,48 +1125,316 @@ static int get_req_udp_socket(struct request_data *req)
 	return g_io_channel_unix_get_fd(channel);
 }
 
-static void destroy_request_data(struct request_data *req)
+/*
+ * The round trip time is smoothed like the TCP retransmission
+ * timer (RFC 6298).
+ */
+static void server_rtt_sample(struct server_data *server, gint64 rtt)
 {
-	if (req->timeout > 0)
-		g_source_remove(req->timeout);
+	if (!server->srtt) {
+		server->srtt = rtt;
+		server->rttvar = rtt / 2;
+		return;
+	}
 
-	g_free(req->resp);
-	g_free(req->request);
-	g_free(req->name);
-	g_free(req);
+	server->rttvar = (3 * server->rttvar + ABS(server->srtt - rtt)) / 4;
+	server->srtt = (7 * server->srtt + rtt) / 8;
 }
 
-static gboolean request_timeout(gpointer user_data)
+static void server_failed(struct server_data *server)
 {
-	struct request_data *req = user_data;
-	struct sockaddr *sa;
-	int sk;
+	server->failures++;
+	server->failed_at = time(NULL);
+}
 
-	if (!req)
-		return FALSE;
+static bool server_is_healthy(struct server_data *server,
+				time_t current_time)
+{
+	if (server->failures < SERVER_MAX_FAILURES)
+		return true;
 
-	DBG("id 0x%04x", req->srcid);
+	return server->failed_at + SERVER_RETRY_TIME < current_time;
+}
 
-	request_list = g_slist_remove(request_list, req);
+static guint server_hedge_delay(struct server_data *server)
+{
+	gint64 delay;
 
-	if (req->protocol == IPPROTO_UDP) {
-		sk = get_req_udp_socket(req);
-		sa = &req->sa;
-	} else if (req->protocol == IPPROTO_TCP) {
-		sk = req->client_sk;
-		sa = NULL;
-	} else
-		goto out;
+	if (!server->srtt)
+		return HEDGE_DELAY;
 
-	if (req->resplen > 0 && req->resp) {
-		/*
-		 * Here we have received at least one reply (probably telling
-		 * "not found" result), so send that back to client instead
-		 * of more fatal server failed error.
+	delay = (server->srtt + 4 * server->rttvar) / 1000;
+
+	return CLAMP(delay, HEDGE_MIN_DELAY, HEDGE_MAX_DELAY);
+}
+
+static struct request_server *request_server_find(struct request_data *req,
+						struct server_data *server)
+{
+	GSList *list;
+
+	for (list = req->servers; list; list = list->next) {
+		struct request_server *rs = list->data;
+
+		if (rs->server == server)
+			return rs;
+	}
+
+	return NULL;
+}
+
+static struct request_server *request_server_add(struct request_data *req,
+						struct server_data *server)
+{
+	struct request_server *rs;
+
+	rs = request_server_find(req, server);
+	if (rs)
+		return rs;
+
+	rs = g_new0(struct request_server, 1);
+	rs->server = server;
+	rs->sent = g_get_monotonic_time();
+
+	server->queries++;
+
+	req->servers = g_slist_prepend(req->servers, rs);
+
+	return rs;
+}
+
+static void request_server_reply(struct request_data *req,
+				struct server_data *server, int rcode)
+{
+	struct request_server *rs;
+
+	rs = request_server_find(req, server);
+	if (!rs || rs->done)
+		return;
+
+	rs->done = true;
+
+	server->answers++;
+	server_rtt_sample(server, g_get_monotonic_time() - rs->sent);
+
+	if (rcode == ns_r_servfail || rcode == ns_r_refused)
+		server_failed(server);
+	else
+		server->failures = 0;
+}
+
+/*
+ * The servers that did not answer before the request was finished
+ * are at least as slow as the time we waited for them.
+ */
+static void request_servers_free(struct request_data *req)
+{
+	gint64 now = g_get_monotonic_time();
+	GSList *list;
+
+	for (list = req->servers; list; list = list->next) {
+		struct request_server *rs = list->data;
+
+		if (!rs->done && now - rs->sent > rs->server->srtt)
+			server_rtt_sample(rs->server, now - rs->sent);
+	}
+
+	g_slist_free_full(req->servers, g_free);
+	req->servers = NULL;
+}
+
+/*
+ * Choose the best enabled UDP server the request has not been sent
+ * to yet. Healthy servers go before the failing ones, and then the
+ * server with the shortest round trip time wins. Servers without
+ * measurements go first so that they get measured.
+ */
+static struct server_data *server_select(struct request_data *req)
+{
+	time_t current_time = time(NULL);
+	struct server_data *best = NULL;
+	bool best_healthy = false;
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+		bool healthy;
+
+		if (data->protocol != IPPROTO_UDP || !data->enabled)
+			continue;
+
+		if (request_server_find(req, data))
+			continue;
+
+		healthy = server_is_healthy(data, current_time);
+
+		if (best && (best_healthy && !healthy))
+			continue;
+
+		if (best && best_healthy == healthy &&
+				data->srtt >= best->srtt)
+			continue;
+
+		best = data;
+		best_healthy = healthy;
+	}
+
+	return best;
+}
+
+static void destroy_request_data(struct request_data *req)
+{
+	GSList *list;
+
+	request_remove(req);
+	request_servers_free(req);
+
+	for (list = req->followers; list; list = list->next) {
+		struct request_data *follower = list->data;
+
+		if (g_hash_table_lookup(client_table, follower) == follower)
+			g_hash_table_remove(client_table, follower);
+
+		g_free(follower->request);
+		g_free(follower);
+	}
+
+	g_slist_free(req->followers);
+
+	if (req->timeout > 0)
+		g_source_remove(req->timeout);
+
+	if (req->stale_timeout > 0)
+		g_source_remove(req->stale_timeout);
+
+	if (req->hedge_timeout > 0)
+		g_source_remove(req->hedge_timeout);
+
+	g_free(req->resp);
+	g_free(req->request);
+	g_free(req->name);
+	g_free(req);
+}
+
+/*
+ * Send the answer of the request also to the clients that asked the
+ * same question while it was outstanding, each with its own ID. If
+ * there is no answer, the clients get a server failure.
+ */
+static void reply_followers(struct request_data *req)
+{
+	GSList *list;
+
+	for (list = req->followers; list; list = list->next) {
+		struct request_data *follower = list->data;
+		unsigned char *buf;
+		int sk;
+
+		if (follower->answered)
+			continue;
+
+		sk = get_req_udp_socket(follower);
+		if (sk < 0)
+			continue;
+
+		follower->answered = true;
+
+		if (!req->resp || req->resplen < 12) {
+			send_response(sk, follower->request,
+					follower->request_len, &follower->sa,
+					follower->sa_len, IPPROTO_UDP);
+			continue;
+		}
+
+		buf = g_try_malloc(req->resplen);
+		if (!buf)
+			continue;
+
+		memcpy(buf, req->resp, req->resplen);
+		buf[0] = follower->srcid & 0xff;
+		buf[1] = follower->srcid >> 8;
+
+		if (udp_send_answer(sk, buf, req->resplen,
+				follower->udp_size, &follower->sa,
+				follower->sa_len) < 0)
+			DBG("Cannot send msg to follower 0x%04x: %s",
+				follower->srcid, strerror(errno));
+
+		g_free(buf);
+	}
+}
+
+/*
+ * The upstream servers failed to answer if all we got from them
+ * is a server failure or a refusal, or nothing at all.
+ */
+static bool request_failed(struct request_data *req)
+{
+	struct domain_hdr *hdr;
+	int offset = protocol_offset(req->protocol);
+
+	if (!req->resp || offset < 0 || req->resplen < (gsize) offset + 12)
+		return true;
+
+	hdr = (void *) ((unsigned char *) req->resp + offset);
+
+	return hdr->rcode == ns_r_servfail || hdr->rcode == ns_r_refused;
+}
+
+static gboolean request_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+	struct sockaddr *sa;
+	GSList *list;
+	int sk;
+
+	if (!req)
+		return FALSE;
+
+	DBG("id 0x%04x", req->srcid);
+
+	request_remove(req);
+
+	for (list = req->servers; list; list = list->next) {
+		struct request_server *rs = list->data;
+
+		if (rs->done)
+			continue;
+
+		rs->server->timeouts++;
+		server_failed(rs->server);
+	}
+
+	/* Nobody is waiting for the answer of a prefetch */
+	if (req->prefetch)
+		goto out;
+
+	if (req->protocol == IPPROTO_UDP) {
+		sk = get_req_udp_socket(req);
+		sa = &req->sa;
+	} else if (req->protocol == IPPROTO_TCP) {
+		sk = req->client_sk;
+		sa = NULL;
+	} else
+		goto out;
+
+	if (!req->answered && request_failed(req))
+		send_stale_response(req);
+
+	if (req->answered) {
+		DBG("client already got a stale answer");
+	} else if (req->resplen > 0 && req->resp) {
+		/*
+		 * Here we have received at least one reply (probably telling
+		 * "not found" result), so send that back to client instead
+		 * of more fatal server failed error.
 		 */
-		if (sk >= 0)
-			sendto(sk, req->resp, req->resplen, MSG_NOSIGNAL,
-				sa, req->sa_len);
+		if (sk >= 0 && req->protocol == IPPROTO_UDP)
+			udp_send_answer(sk, req->resp, req->resplen,
+					req->udp_size, sa, req->sa_len);
+		else if (sk >= 0)
+			udp_sendto(sk, req->resp, req->resplen, sa,
+				req->sa_len);
 
 	} else if (req->request) {
 		/*
@@ -574,6 +1450,8 @@ static gboolean request_timeout(gpointer user_data)
 				sa, req->sa_len, req->protocol);
 	}
 
+	reply_followers(req);
+
 	/*
 	 * We cannot leave TCP client hanging so just kick it out
 	 * if we get a request timeout from server.
@@ -646,6 +1524,164 @@ static int append_query(unsigned char *buf, unsigned int size,
 	return ptr - buf;
 }
 
+static time_t cache_entry_expiry(struct cache_entry *entry)
+{
+	if (entry->ipv4 && entry->ipv6)
+		return MIN(entry->ipv4->cache_until,
+					entry->ipv6->cache_until);
+
+	if (entry->ipv4)
+		return entry->ipv4->cache_until;
+
+	return entry->ipv6->cache_until;
+}
+
+static void cache_heap_swap(unsigned int a, unsigned int b)
+{
+	struct cache_entry *entry_a = g_ptr_array_index(cache_expiry, a);
+	struct cache_entry *entry_b = g_ptr_array_index(cache_expiry, b);
+
+	g_ptr_array_index(cache_expiry, a) = entry_b;
+	g_ptr_array_index(cache_expiry, b) = entry_a;
+
+	entry_a->heap_index = b;
+	entry_b->heap_index = a;
+}
+
+static bool cache_heap_less(unsigned int a, unsigned int b)
+{
+	return cache_entry_expiry(g_ptr_array_index(cache_expiry, a)) <
+		cache_entry_expiry(g_ptr_array_index(cache_expiry, b));
+}
+
+static void cache_heap_sift(unsigned int i)
+{
+	while (i > 0 && cache_heap_less(i, (i - 1) / 2)) {
+		cache_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	while (true) {
+		unsigned int child = 2 * i + 1;
+
+		if (child >= cache_expiry->len)
+			break;
+
+		if (child + 1 < cache_expiry->len &&
+				cache_heap_less(child + 1, child))
+			child++;
+
+		if (!cache_heap_less(child, i))
+			break;
+
+		cache_heap_swap(i, child);
+		i = child;
+	}
+}
+
+static void cache_heap_remove(struct cache_entry *entry)
+{
+	unsigned int i = entry->heap_index, last;
+
+	if (i == CACHE_HEAP_NONE)
+		return;
+
+	last = cache_expiry->len - 1;
+	if (i != last)
+		cache_heap_swap(i, last);
+
+	g_ptr_array_remove_index(cache_expiry, last);
+	entry->heap_index = CACHE_HEAP_NONE;
+
+	if (i != last)
+		cache_heap_sift(i);
+}
+
+/*
+ * Entries without any cached data are kept only because they are
+ * waiting for a refresh. They never expire, only the LRU eviction
+ * can remove them.
+ */
+static void cache_heap_update(struct cache_entry *entry)
+{
+	if (!entry->ipv4 && !entry->ipv6) {
+		cache_heap_remove(entry);
+		return;
+	}
+
+	if (entry->heap_index == CACHE_HEAP_NONE) {
+		entry->heap_index = cache_expiry->len;
+		g_ptr_array_add(cache_expiry, entry);
+	}
+
+	cache_heap_sift(entry->heap_index);
+}
+
+/*
+ * Recalculate the memory used by the entry after its cached data
+ * has changed, and move the entry to its new place in the expiry heap.
+ */
+static void cache_entry_resize(struct cache_entry *entry)
+{
+	size_t size, negative_size = 0;
+
+	size = sizeof(*entry) + strlen(entry->key) + 1;
+
+	if (entry->ipv4) {
+		size += sizeof(*entry->ipv4) + entry->ipv4->data_len;
+		if (entry->ipv4->negative)
+			negative_size += sizeof(*entry->ipv4) +
+						entry->ipv4->data_len;
+	}
+
+	if (entry->ipv6) {
+		size += sizeof(*entry->ipv6) + entry->ipv6->data_len;
+		if (entry->ipv6->negative)
+			negative_size += sizeof(*entry->ipv6) +
+						entry->ipv6->data_len;
+	}
+
+	cache_bytes = cache_bytes - entry->size + size;
+	entry->size = size;
+	cache_dirty = true;
+
+	cache_negative_bytes = cache_negative_bytes - entry->negative_size +
+							negative_size;
+	entry->negative_size = negative_size;
+
+	if (negative_size && !entry->negative_link) {
+		g_queue_push_head(cache_negative, entry);
+		entry->negative_link = g_queue_peek_head_link(cache_negative);
+	} else if (!negative_size && entry->negative_link) {
+		g_queue_delete_link(cache_negative, entry->negative_link);
+		entry->negative_link = NULL;
+	}
+
+	cache_heap_update(entry);
+}
+
+static struct cache_entry *cache_entry_new(const char *question)
+{
+	struct cache_entry *entry;
+
+	entry = g_try_new(struct cache_entry, 1);
+	if (!entry)
+		return NULL;
+
+	entry->key = g_strdup(question);
+	entry->ipv4 = entry->ipv6 = NULL;
+	entry->want_refresh = false;
+	entry->hits = 0;
+	entry->prefetched = 0;
+	entry->lru_link = NULL;
+	entry->heap_index = CACHE_HEAP_NONE;
+	entry->size = 0;
+	entry->negative_link = NULL;
+	entry->negative_size = 0;
+
+	return entry;
+}
+
 static bool cache_check_is_valid(struct cache_data *data,
 				time_t current_time)
 {
@@ -658,6 +1694,167 @@ static bool cache_check_is_valid(struct cache_data *data,
 	return true;
 }
 
+/*
+ * Data that has expired less than cache_stale_time seconds ago
+ * can still be served when the upstream servers are not answering.
+ */
+static bool cache_check_is_usable(struct cache_data *data,
+				time_t current_time)
+{
+	if (!data)
+		return false;
+
+	if (data->cache_until + (time_t) cache_stale_time < current_time)
+		return false;
+
+	return true;
+}
+
+static bool cache_check_wants_prefetch(struct cache_data *data,
+				time_t current_time)
+{
+	time_t lifetime, left;
+
+	if (!cache_prefetch_threshold || !data)
+		return false;
+
+	lifetime = data->cache_until - data->inserted;
+	left = data->cache_until - current_time;
+
+	return left * 100 <= lifetime * (time_t) cache_prefetch_threshold;
+}
+
+static struct cache_data *cache_get_stale(struct request_data *req)
+{
+	struct cache_entry *entry;
+	struct cache_data *data;
+	struct domain_question *q;
+	char *question;
+	int offset;
+
+	if (!cache_stale_time || !cache || !req->request)
+		return NULL;
+
+	offset = protocol_offset(req->protocol);
+	if (offset < 0)
+		return NULL;
+
+	question = (char *) req->request + offset + 12;
+	q = (void *) (question + strlen(question) + 1);
+
+	entry = g_hash_table_lookup(cache, question);
+	if (!entry)
+		return NULL;
+
+	switch (ntohs(q->type)) {
+	case 1:
+		data = entry->ipv4;
+		break;
+	case 28:
+		data = entry->ipv6;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (!cache_check_is_usable(data, time(NULL)))
+		return NULL;
+
+	return data;
+}
+
+/*
+ * Answer the client from the cache even if the cached data has
+ * already expired. The TTL of the stale answer is kept short so that
+ * the client asks again soon.
+ */
+static bool send_stale_response(struct request_data *req)
+{
+	time_t current_time = time(NULL);
+	struct cache_data *data;
+	struct sockaddr *sa = NULL;
+	socklen_t sa_len = 0;
+	GSList *list;
+	int sk, ttl;
+
+	for (list = req->followers; list; list = list->next)
+		send_stale_response(list->data);
+
+	if (req->prefetch || req->answered)
+		return false;
+
+	data = cache_get_stale(req);
+	if (!data)
+		return false;
+
+	if (req->protocol == IPPROTO_UDP) {
+		sk = get_req_udp_socket(req);
+		sa = &req->sa;
+		sa_len = req->sa_len;
+	} else
+		sk = req->client_sk;
+
+	if (sk < 0)
+		return false;
+
+	if (cache_check_is_valid(data, current_time))
+		ttl = data->valid_until - current_time;
+	else
+		ttl = STALE_ANSWER_TTL;
+
+	DBG("id 0x%04x stale answer ttl %d", req->srcid, ttl);
+
+	send_cached_response(sk, data->data, data->data_len, sa, sa_len,
+				req->protocol, req->srcid, data->answers, ttl,
+				(char *) req->request +
+				protocol_offset(req->protocol) +
+				sizeof(struct domain_hdr), req->udp_size);
+
+	cache_stats.stale_answers++;
+	req->answered = true;
+
+	return true;
+}
+
+static gboolean stale_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+
+	req->stale_timeout = 0;
+
+	send_stale_response(req);
+
+	return FALSE;
+}
+
+static void cache_hit(struct cache_entry *entry, uint16_t type)
+{
+	time_t current_time = time(NULL);
+	struct cache_data *data;
+
+	entry->hits++;
+	cache_stats.hits++;
+
+	g_queue_unlink(cache_lru, entry->lru_link);
+	g_queue_push_head_link(cache_lru, entry->lru_link);
+
+	data = type == 1 ? entry->ipv4 : entry->ipv6;
+
+	if (data && data->negative)
+		cache_stats.negative_hits++;
+
+	/*
+	 * Refresh a popular entry before it expires so that the clients
+	 * do not see the latency of the upstream query when it does.
+	 */
+	if (entry->hits > 2 &&
+			entry->prefetched + PREFETCH_RETRY < current_time &&
+			cache_check_wants_prefetch(data, current_time)) {
+		entry->prefetched = current_time;
+		cache_prefetch(entry, type);
+	}
+}
+
 /*
  * remove stale cached entries so that they can be refreshed
  */
@@ -665,7 +1862,7 @@ static void cache_enforce_validity(struct cache_entry *entry)
 {
 	time_t current_time = time(NULL);
 
-	if (!cache_check_is_valid(entry->ipv4, current_time)
+	if (!cache_check_is_usable(entry->ipv4, current_time)
 							&& entry->ipv4) {
 		DBG("cache timeout \"%s\" type A", entry->key);
 		g_free(entry->ipv4->data);
@@ -674,13 +1871,15 @@ static void cache_enforce_validity(struct cache_entry *entry)
 
 	}
 
-	if (!cache_check_is_valid(entry->ipv6, current_time)
+	if (!cache_check_is_usable(entry->ipv6, current_time)
 							&& entry->ipv6) {
 		DBG("cache timeout \"%s\" type AAAA", entry->key);
 		g_free(entry->ipv6->data);
 		g_free(entry->ipv6);
 		entry->ipv6 = NULL;
 	}
+
+	cache_entry_resize(entry);
 }
 
 static uint16_t cache_check_validity(char *question, uint16_t type,
@@ -709,12 +1908,12 @@ static uint16_t cache_check_validity(char *question, uint16_t type,
 
 			/*
 			 * We do not remove cache entry if there is still
-			 * valid IPv6 entry found in the cache.
+			 * valid IPv6 entry or stale data found in the cache.
 			 */
-			if (!cache_check_is_valid(entry->ipv6, current_time) && !want_refresh) {
+			if (!entry->ipv4 && !entry->ipv6 && !want_refresh)
 				g_hash_table_remove(cache, question);
-				type = 0;
-			}
+
+			type = 0;
 		}
 		break;
 
@@ -726,10 +1925,10 @@ static uint16_t cache_check_validity(char *question, uint16_t type,
 			if (want_refresh)
 				entry->want_refresh = true;
 
-			if (!cache_check_is_valid(entry->ipv4, current_time) && !want_refresh) {
+			if (!entry->ipv4 && !entry->ipv6 && !want_refresh)
 				g_hash_table_remove(cache, question);
-				type = 0;
-			}
+
+			type = 0;
 		}
 		break;
 	}
@@ -754,11 +1953,49 @@ static void cache_element_destroy(gpointer value)
 		g_free(entry->ipv6);
 	}
 
+	if (entry->lru_link)
+		g_queue_delete_link(cache_lru, entry->lru_link);
+
+	if (entry->negative_link)
+		g_queue_delete_link(cache_negative, entry->negative_link);
+
+	cache_heap_remove(entry);
+	cache_bytes -= entry->size;
+	cache_negative_bytes -= entry->negative_size;
+	cache_dirty = true;
+
 	g_free(entry->key);
 	g_free(entry);
+}
+
+static void destroy_cache(void)
+{
+	cache_snapshot_save();
+
+	DBG("cache %u entries %zu bytes hits %u misses %u evictions %u "
+		"expired %u prefetches %u stale %u negative %zu bytes "
+		"hits %u evictions %u",
+		g_hash_table_size(cache), cache_bytes,
+		cache_stats.hits, cache_stats.misses,
+		cache_stats.evictions, cache_stats.expirations,
+		cache_stats.prefetches, cache_stats.stale_answers,
+		cache_negative_bytes, cache_stats.negative_hits,
+		cache_stats.negative_evictions);
+
+	g_hash_table_destroy(cache);
+	cache = NULL;
+
+	g_queue_free(cache_lru);
+	cache_lru = NULL;
 
-	if (--cache_size < 0)
-		cache_size = 0;
+	g_queue_free(cache_negative);
+	cache_negative = NULL;
+
+	g_ptr_array_free(cache_expiry, TRUE);
+	cache_expiry = NULL;
+
+	cache_bytes = 0;
+	cache_negative_bytes = 0;
 }
 
 static gboolean try_remove_cache(gpointer user_data)
@@ -768,8 +2005,7 @@ static gboolean try_remove_cache(gpointer user_data)
 	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
 		DBG("No cache users, removing it.");
 
-		g_hash_table_destroy(cache);
-		cache = NULL;
+		destroy_cache();
 	}
 
 	return FALSE;
@@ -777,11 +2013,15 @@ static gboolean try_remove_cache(gpointer user_data)
 
 static void create_cache(void)
 {
-	if (__sync_fetch_and_add(&cache_refcount, 1) == 0)
-		cache = g_hash_table_new_full(g_str_hash,
-					g_str_equal,
+	if (__sync_fetch_and_add(&cache_refcount, 1) == 0) {
+		cache = g_hash_table_new_full(cache_key_hash,
+					cache_key_equal,
 					NULL,
 					cache_element_destroy);
+		cache_lru = g_queue_new();
+		cache_negative = g_queue_new();
+		cache_expiry = g_ptr_array_new();
+	}
 }
 
 static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
@@ -815,109 +2055,211 @@ static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
 	}
 
 	entry = g_hash_table_lookup(cache, question);
-	if (!entry)
+	if (!entry) {
+		cache_stats.misses++;
 		return NULL;
+	}
 
 	type = cache_check_validity(question, type, entry);
-	if (type == 0)
+	if (type == 0) {
+		cache_stats.misses++;
 		return NULL;
+	}
 
 	*qtype = type;
 	return entry;
 }
 
 /*
- * Get a label/name from DNS resource record. The function decompresses the
- * label if necessary. The function does not convert the name to presentation
- * form. This means that the result string will contain label lengths instead
- * of dots between labels. We intentionally do not want to convert to dotted
- * format so that we can cache the wire format string directly.
+ * Return the number of bytes a possibly compressed name takes in
+ * the message.
  */
-static int get_name(int counter,
-		unsigned char *pkt, unsigned char *start, unsigned char *max,
-		unsigned char *output, int output_max, int *output_len,
-		unsigned char **end, char *name, int *name_len)
+static int skip_name(unsigned char *ptr, unsigned char *max)
 {
-	unsigned char *p;
-
-	/* Limit recursion to 10 (this means up to 10 labels in domain name) */
-	if (counter > 10)
-		return -EINVAL;
+	unsigned char *p = ptr;
 
-	p = start;
-	while (*p) {
+	while (p < max) {
 		if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
-			uint16_t offset = (*p & 0x3F) * 256 + *(p + 1);
-
-			if (offset >= max - pkt)
+			if (p + 2 > max)
 				return -ENOBUFS;
 
-			if (!*end)
-				*end = p + 2;
+			return p + 2 - ptr;
+		}
 
-			return get_name(counter + 1, pkt, pkt + offset, max,
-					output, output_max, output_len, end,
-					name, name_len);
-		} else {
-			unsigned label_len = *p;
+		if (*p & NS_CMPRSFLGS)
+			return -EINVAL;
 
-			if (pkt + label_len > max)
-				return -ENOBUFS;
+		if (*p == 0)
+			return p + 1 - ptr;
 
-			if (*output_len > output_max)
-				return -ENOBUFS;
+		p += *p + 1;
+	}
 
-			/*
-			 * We need the original name in order to check
-			 * if this answer is the correct one.
-			 */
-			name[(*name_len)++] = label_len;
-			memcpy(name + *name_len, p + 1,	label_len + 1);
-			*name_len += label_len;
+	return -ENOBUFS;
+}
+
+/*
+ * Follow the compression pointers of the name at *pos to its next
+ * label. Returns the length of the label and sets *label to point to
+ * it and *pos to the label after it, or returns 0 at the end of the
+ * name. A malformed name gives a negative error.
+ */
+static int dns_name_next_label(const struct dns_name_view *view,
+				const unsigned char **pos,
+				const unsigned char **label)
+{
+	const unsigned char *p = *pos;
+	int jumps = 0;
 
-			/* We compress the result */
-			output[0] = NS_CMPRSFLGS;
-			output[1] = 0x0C;
-			*output_len = 2;
+	while (p >= view->msg && p < view->end) {
+		if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+			if (p + 1 >= view->end || ++jumps > DNS_MAX_JUMPS)
+				return -EINVAL;
 
-			p += label_len + 1;
+			p = view->msg + ((*p & 0x3F) << 8 | p[1]);
+			continue;
+		}
 
-			if (!*end)
-				*end = p;
+		if (*p & NS_CMPRSFLGS)
+			return -EINVAL;
 
-			if (p >= max)
-				return -ENOBUFS;
+		if (*p == 0) {
+			*pos = p;
+			return 0;
 		}
+
+		if (p + 1 + *p > view->end)
+			return -EINVAL;
+
+		*label = p + 1;
+		*pos = p + 1 + *p;
+
+		return *p;
 	}
 
-	return 0;
+	return -EINVAL;
+}
+
+static guint dns_name_hash(const struct dns_name_view *view)
+{
+	const unsigned char *pos = view->name, *label = NULL;
+	int len, total = 0, i;
+	guint hash = 5381;
+
+	while ((len = dns_name_next_label(view, &pos, &label)) > 0) {
+		total += len + 1;
+		if (total > NS_MAXCDNAME)
+			break;
+
+		hash = hash * 33 + len;
+		for (i = 0; i < len; i++)
+			hash = hash * 33 + g_ascii_tolower(label[i]);
+	}
+
+	return hash;
+}
+
+static bool dns_label_equal(const unsigned char *a, const unsigned char *b,
+				int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (g_ascii_tolower(a[i]) != g_ascii_tolower(b[i]))
+			return false;
+
+	return true;
+}
+
+/*
+ * Compare two names, ignoring the case of the letters (RFC 4343).
+ * The names can be in different messages and compressed differently.
+ */
+static bool dns_name_equal(const struct dns_name_view *a,
+				const struct dns_name_view *b)
+{
+	const unsigned char *pos_a = a->name, *pos_b = b->name;
+	const unsigned char *label_a = NULL, *label_b = NULL;
+	int len_a, len_b, total = 0;
+
+	for (;;) {
+		len_a = dns_name_next_label(a, &pos_a, &label_a);
+		len_b = dns_name_next_label(b, &pos_b, &label_b);
+
+		if (len_a < 0 || len_b < 0 || len_a != len_b)
+			return false;
+
+		if (len_a == 0)
+			return true;
+
+		total += len_a + 1;
+		if (total > NS_MAXCDNAME)
+			return false;
+
+		if (!dns_label_equal(label_a, label_b, len_a))
+			return false;
+	}
+}
+
+/*
+ * The cache is keyed by the uncompressed question name in wire
+ * format, and the lookups are done with the name in the message.
+ */
+static void cache_key_view(const char *key, struct dns_name_view *view)
+{
+	view->msg = (const unsigned char *) key;
+	view->end = view->msg + strlen(key) + 1;
+	view->name = view->msg;
+}
+
+static guint cache_key_hash(gconstpointer key)
+{
+	struct dns_name_view view;
+
+	cache_key_view(key, &view);
+
+	return dns_name_hash(&view);
+}
+
+static gboolean cache_key_equal(gconstpointer a, gconstpointer b)
+{
+	struct dns_name_view view_a, view_b;
+
+	cache_key_view(a, &view_a);
+	cache_key_view(b, &view_b);
+
+	return dns_name_equal(&view_a, &view_b);
 }
 
 static int parse_rr(unsigned char *buf, unsigned char *start,
 			unsigned char *max,
 			unsigned char *response, unsigned int *response_size,
 			uint16_t *type, uint16_t *class, int *ttl, int *rdlen,
-			unsigned char **end,
-			char *name)
+			unsigned char **end)
 {
 	struct domain_rr *rr;
-	int err, offset;
-	int name_len = 0, output_len = 0, max_rsp = *response_size;
+	int len, offset = 2;
 
-	err = get_name(0, buf, start, max, response, max_rsp,
-		&output_len, end, name, &name_len);
-	if (err < 0)
-		return err;
+	len = skip_name(start, max);
+	if (len < 0)
+		return len;
 
-	offset = output_len;
+	*end = start + len;
 
-	if ((unsigned int) offset > *response_size)
+	if (*end + sizeof(struct domain_rr) > max)
 		return -ENOBUFS;
 
-	rr = (void *) (*end);
+	if ((unsigned int) offset + sizeof(struct domain_rr) > *response_size)
+		return -ENOBUFS;
 
-	if (!rr)
-		return -EINVAL;
+	/*
+	 * The name of the record is replaced by a pointer to the question,
+	 * the records we cache answer the question or one of its aliases.
+	 */
+	response[0] = NS_CMPRSFLGS;
+	response[1] = 0x0C;
+
+	rr = (void *) (*end);
 
 	*type = ntohs(rr->type);
 	*class = ntohs(rr->class);
@@ -932,7 +2274,8 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 	offset += sizeof(struct domain_rr);
 	*end += sizeof(struct domain_rr);
 
-	if ((unsigned int) (offset + *rdlen) > *response_size)
+	if ((unsigned int) (offset + *rdlen) > *response_size ||
+			*end + *rdlen > max)
 		return -ENOBUFS;
 
 	memcpy(response + offset, *end, *rdlen);
@@ -944,38 +2287,38 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 	return 0;
 }
 
-static bool check_alias(GSList *aliases, char *name)
+static bool check_alias(const struct dns_name_view *name,
+			const struct dns_name_view *aliases,
+			unsigned int num_aliases)
 {
-	GSList *list;
+	unsigned int i;
 
-	if (aliases) {
-		for (list = aliases; list; list = list->next) {
-			int len = strlen((char *)list->data);
-			if (strncmp((char *)list->data, name, len) == 0)
-				return true;
-		}
-	}
+	for (i = 0; i < num_aliases; i++)
+		if (dns_name_equal(name, &aliases[i]))
+			return true;
 
 	return false;
 }
 
 static int parse_response(unsigned char *buf, int buflen,
-			char *question, int qlen,
+			char **question,
 			uint16_t *type, uint16_t *class, int *ttl,
 			unsigned char *response, unsigned int *response_len,
 			uint16_t *answers)
 {
 	struct domain_hdr *hdr = (void *) buf;
 	struct domain_question *q;
-	unsigned char *ptr;
+	struct dns_name_view qname, name;
+	struct dns_name_view aliases[MAX_ALIASES];
+	unsigned int num_aliases = 0;
+	unsigned char *ptr, *max = buf + buflen;
 	uint16_t qdcount = ntohs(hdr->qdcount);
 	uint16_t ancount = ntohs(hdr->ancount);
 	int err, i;
 	uint16_t qtype, qclass;
 	unsigned char *next = NULL;
 	unsigned int maxlen = *response_len;
-	GSList *aliases = NULL, *list;
-	char name[NS_MAXDNAME + 1];
+	size_t qlen;
 
 	if (buflen < 12)
 		return -EINVAL;
@@ -988,8 +2331,20 @@ static int parse_response(unsigned char *buf, int buflen,
 
 	ptr = buf + sizeof(struct domain_hdr);
 
-	strncpy(question, (char *) ptr, qlen);
-	qlen = strlen(question);
+	/*
+	 * The question is the first name in the message so it is never
+	 * compressed, and it is used in place as the cache key.
+	 */
+	qlen = strnlen((char *) ptr, max - ptr);
+	if (ptr + qlen + 1 + sizeof(struct domain_question) > max)
+		return -EINVAL;
+
+	*question = (char *) ptr;
+
+	qname.msg = buf;
+	qname.end = max;
+	qname.name = ptr;
+
 	ptr += qlen + 1; /* skip \0 */
 
 	q = (void *) ptr;
@@ -1007,8 +2362,6 @@ static int parse_response(unsigned char *buf, int buflen,
 	*response_len = 0;
 	*answers = 0;
 
-	memset(name, 0, sizeof(name));
-
 	/*
 	 * We have a bunch of answers (like A, AAAA, CNAME etc) to
 	 * A or AAAA question. We traverse the answers and parse the
@@ -1028,22 +2381,22 @@ static int parse_response(unsigned char *buf, int buflen,
 		unsigned int rsp_len = sizeof(rsp) - 1;
 		int ret, rdlen;
 
-		memset(rsp, 0, sizeof(rsp));
-
-		ret = parse_rr(buf, ptr, buf + buflen, rsp, &rsp_len,
-			type, class, ttl, &rdlen, &next, name);
+		ret = parse_rr(buf, ptr, max, rsp, &rsp_len,
+			type, class, ttl, &rdlen, &next);
 		if (ret != 0) {
 			err = ret;
 			goto out;
 		}
 
 		/*
-		 * Now rsp contains compressed or uncompressed resource
-		 * record. Next we check if this record answers the question.
-		 * The name var contains the uncompressed label.
-		 * One tricky bit is the CNAME records as they alias
-		 * the name we might be interested in.
+		 * Now rsp contains the resource record with its name
+		 * compressed. Next we check if this record answers the
+		 * question. The name of the record is compared in place,
+		 * following the compression pointers of the message.
 		 */
+		name.msg = buf;
+		name.end = max;
+		name.name = ptr;
 
 		/*
 		 * Go to next answer if the class is not the one we are
@@ -1076,43 +2429,27 @@ static int parse_response(unsigned char *buf, int buflen,
 		 * address of ipv6.l.google.com. For caching purposes this
 		 * should not cause any issues.
 		 */
-		if (*type == 5 && strncmp(question, name, qlen) == 0) {
+		if (*type == 5 && (dns_name_equal(&qname, &name) ||
+				check_alias(&name, aliases, num_aliases))) {
 			/*
 			 * So now the alias answered the question. This is
 			 * not very useful from caching point of view as
 			 * the following A or AAAA records will not match the
 			 * question. We need to find the real A/AAAA record
 			 * of the alias and cache that.
+			 *
+			 * Alias is in rdata part of the message, and
+			 * next-rdlen points to it. We remember it for a
+			 * while and check the aliases when we have parsed
+			 * the A or AAAA record.
 			 */
-			unsigned char *end = NULL;
-			int name_len = 0, output_len = 0;
-
-			memset(rsp, 0, sizeof(rsp));
-			rsp_len = sizeof(rsp) - 1;
-
-			/*
-			 * Alias is in rdata part of the message,
-			 * and next-rdlen points to it. So we need to get
-			 * the real name of the alias.
-			 */
-			ret = get_name(0, buf, next - rdlen, buf + buflen,
-					rsp, rsp_len, &output_len, &end,
-					name, &name_len);
-			if (ret != 0) {
-				/* just ignore the error at this point */
-				ptr = next;
-				next = NULL;
-				continue;
+			if (num_aliases < MAX_ALIASES) {
+				aliases[num_aliases].msg = buf;
+				aliases[num_aliases].end = max;
+				aliases[num_aliases].name = next - rdlen;
+				num_aliases++;
 			}
 
-			/*
-			 * We should now have the alias of the entry we might
-			 * want to cache. Just remember it for a while.
-			 * We check the alias list when we have parsed the
-			 * A or AAAA record.
-			 */
-			aliases = g_slist_prepend(aliases, g_strdup(name));
-
 			ptr = next;
 			next = NULL;
 			continue;
@@ -1122,9 +2459,9 @@ static int parse_response(unsigned char *buf, int buflen,
 			/*
 			 * We found correct type (A or AAAA)
 			 */
-			if (check_alias(aliases, name) ||
-				(!aliases && strncmp(question, name,
-							qlen) == 0)) {
+			if (check_alias(&name, aliases, num_aliases) ||
+				(!num_aliases &&
+					dns_name_equal(&qname, &name))) {
 				/*
 				 * We found an alias or the name of the rr
 				 * matches the question. If so, we append
@@ -1149,104 +2486,191 @@ static int parse_response(unsigned char *buf, int buflen,
 	}
 
 out:
-	for (list = aliases; list; list = list->next)
-		g_free(list->data);
-	g_slist_free(aliases);
-
 	return err;
 }
 
-struct cache_timeout {
-	time_t current_time;
-	int max_timeout;
-	int try_harder;
-};
-
-static gboolean cache_check_entry(gpointer key, gpointer value,
-					gpointer user_data)
+/*
+ * Check if the response is a negative answer to an A or AAAA question
+ * that can be cached (RFC 2308): a name error (NXDOMAIN) or an answer
+ * without records (NODATA) with a SOA record in the authority section.
+ * The answer can be cached for the TTL of the SOA record or for the
+ * SOA minimum field, whichever is smaller. Returns the length of the
+ * response without the additional section, which is not cached.
+ */
+static int parse_negative_response(unsigned char *buf, int buflen,
+					uint16_t *type, int *ttl)
 {
-	struct cache_timeout *data = user_data;
-	struct cache_entry *entry = value;
-	int max_timeout;
+	struct domain_hdr *hdr = (void *) buf;
+	unsigned char *ptr, *max = buf + buflen;
+	uint16_t ancount, nscount;
+	int64_t soa_ttl = -1;
+	int len, i;
+
+	if (buflen < 12)
+		return -EINVAL;
 
-	/* Scale the number of hits by half as part of cache aging */
+	if (hdr->qr != 1 || ntohs(hdr->qdcount) != 1)
+		return -EINVAL;
 
-	entry->hits /= 2;
+	ancount = ntohs(hdr->ancount);
+	nscount = ntohs(hdr->nscount);
 
-	/*
-	 * If either IPv4 or IPv6 cached entry has expired, we
-	 * remove both from the cache.
-	 */
+	if (ancount != 0 || (hdr->rcode != ns_r_noerror &&
+				hdr->rcode != ns_r_nxdomain))
+		return -ENOMSG;
 
-	if (entry->ipv4 && entry->ipv4->timeout > 0) {
-		max_timeout = entry->ipv4->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	ptr = buf + sizeof(struct domain_hdr);
 
-		if (entry->ipv4->cache_until < data->current_time)
-			return TRUE;
+	len = skip_name(ptr, max);
+	if (len < 0)
+		return len;
+
+	ptr += len;
+	if (ptr + sizeof(struct domain_question) > max)
+		return -ENOBUFS;
+
+	*type = ptr[0] << 8 | ptr[1];
+	if (*type != 1 && *type != 28)
+		return -ENOMSG;
+
+	ptr += sizeof(struct domain_question);
+
+	for (i = 0; i < nscount; i++) {
+		struct domain_rr *rr;
+		uint16_t rdlen;
+
+		len = skip_name(ptr, max);
+		if (len < 0)
+			return len;
+
+		ptr += len;
+		if (ptr + sizeof(struct domain_rr) > max)
+			return -ENOBUFS;
+
+		rr = (void *) ptr;
+		rdlen = ntohs(rr->rdlen);
+		ptr += sizeof(struct domain_rr);
+
+		if (ptr + rdlen > max)
+			return -ENOBUFS;
+
+		/* type SOA(6), the minimum field is the last of the rdata */
+		if (ntohs(rr->type) == 6 && rdlen >= 22) {
+			uint32_t minimum;
+
+			memcpy(&minimum, ptr + rdlen - 4, sizeof(minimum));
+			soa_ttl = MIN(ntohl(rr->ttl), ntohl(minimum));
+		}
+
+		ptr += rdlen;
 	}
 
-	if (entry->ipv6 && entry->ipv6->timeout > 0) {
-		max_timeout = entry->ipv6->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	if (soa_ttl < 0)
+		return -ENOMSG;
+
+	*ttl = MIN(soa_ttl, MAX_NEGATIVE_TTL);
+
+	return ptr - buf;
+}
+
+/*
+ * Remove the entries whose cached data has expired. The expiry heap
+ * has the entry that expires first on top, so we only look at the
+ * entries that are really going away.
+ */
+static void cache_expire(time_t current_time)
+{
+	while (cache_expiry->len > 0) {
+		struct cache_entry *entry;
+
+		entry = g_ptr_array_index(cache_expiry, 0);
+		if (cache_entry_expiry(entry) + (time_t) cache_stale_time >=
+								current_time)
+			break;
+
+		DBG("cache expired \"%s\"", entry->key);
+
+		cache_stats.expirations++;
+		g_hash_table_remove(cache, entry->key);
+	}
+}
+
+/*
+ * Make room for size bytes of new cached data. Expired entries are
+ * removed first and if that is not enough, the least recently used
+ * entries are evicted.
+ */
+static bool cache_make_room(size_t size, time_t current_time)
+{
+	if (size > cache_max_bytes)
+		return false;
+
+	cache_expire(current_time);
+
+	while (cache_bytes + size > cache_max_bytes) {
+		struct cache_entry *entry;
+		GList *link;
+
+		link = g_queue_peek_tail_link(cache_lru);
+		if (!link)
+			break;
+
+		entry = link->data;
+
+		DBG("cache evict \"%s\" hits %d size %zd", entry->key,
+			entry->hits, entry->size);
 
-		if (entry->ipv6->cache_until < data->current_time)
-			return TRUE;
+		cache_stats.evictions++;
+		g_hash_table_remove(cache, entry->key);
 	}
 
-	/*
-	 * if we're asked to try harder, also remove entries that have
-	 * few hits
-	 */
-	if (data->try_harder && entry->hits < 4)
-		return TRUE;
-
-	return FALSE;
+	return cache_bytes + size <= cache_max_bytes;
 }
 
-static void cache_cleanup(void)
+/*
+ * Make room for size bytes of new negative data by dropping the
+ * oldest negative answers. The positive answers of the same entries
+ * are kept.
+ */
+static bool cache_make_negative_room(size_t size)
 {
-	static int max_timeout;
-	struct cache_timeout data;
-	int count = 0;
+	if (size > cache_negative_max_bytes)
+		return false;
 
-	data.current_time = time(NULL);
-	data.max_timeout = 0;
-	data.try_harder = 0;
+	while (cache_negative_bytes + size > cache_negative_max_bytes) {
+		struct cache_entry *entry;
+		GList *link;
 
-	/*
-	 * In the first pass, we only remove entries that have timed out.
-	 * We use a cache of the first time to expire to do this only
-	 * when it makes sense.
-	 */
-	if (max_timeout <= data.current_time) {
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
-	}
-	DBG("removed %d in the first pass", count);
+		link = g_queue_peek_tail_link(cache_negative);
+		if (!link)
+			break;
 
-	/*
-	 * In the second pass, if the first pass turned up blank,
-	 * we also expire entries with a low hit count,
-	 * while aging the hit count at the same time.
-	 */
-	data.try_harder = 1;
-	if (count == 0)
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
+		entry = link->data;
 
-	if (count == 0)
-		/*
-		 * If we could not remove anything, then remember
-		 * what is the max timeout and do nothing if we
-		 * have not yet reached it. This will prevent
-		 * constant traversal of the cache if it is full.
-		 */
-		max_timeout = data.max_timeout;
-	else
-		max_timeout = 0;
+		DBG("cache evict negative \"%s\" size %zd", entry->key,
+			entry->negative_size);
+
+		cache_stats.negative_evictions++;
+
+		if (entry->ipv4 && entry->ipv4->negative) {
+			g_free(entry->ipv4->data);
+			g_free(entry->ipv4);
+			entry->ipv4 = NULL;
+		}
+
+		if (entry->ipv6 && entry->ipv6->negative) {
+			g_free(entry->ipv6->data);
+			g_free(entry->ipv6);
+			entry->ipv6 = NULL;
+		}
+
+		if (!entry->ipv4 && !entry->ipv6)
+			g_hash_table_remove(cache, entry->key);
+		else
+			cache_entry_resize(entry);
+	}
+
+	return cache_negative_bytes + size <= cache_negative_max_bytes;
 }
 
 static gboolean cache_invalidate_entry(gpointer key, gpointer value,
@@ -1274,6 +2698,8 @@ static gboolean cache_invalidate_entry(gpointer key, gpointer value,
 		entry->ipv6 = NULL;
 	}
 
+	cache_entry_resize(entry);
+
 	/* keep the entry if we want it refreshed, delete it otherwise */
 	if (entry->want_refresh)
 		return FALSE;
@@ -1364,6 +2790,126 @@ static int reply_query_type(unsigned char *msg, int len)
 	return type;
 }
 
+static int cache_update_negative(struct server_data *srv,
+				unsigned char *msg, unsigned int msg_len,
+				time_t current_time)
+{
+	int offset = protocol_offset(srv->protocol);
+	struct cache_entry *entry;
+	struct cache_data *data, **slot;
+	struct domain_hdr *hdr;
+	char *question;
+	unsigned char *ptr;
+	uint16_t type = 0;
+	int len, ttl = 0;
+	bool new_entry = false;
+	size_t size;
+
+	len = parse_negative_response(msg + offset, msg_len - offset,
+					&type, &ttl);
+	if (len < 0)
+		return len;
+
+	if (ttl == 0)
+		return 0;
+
+	question = (char *) msg + offset + sizeof(struct domain_hdr);
+
+	size = sizeof(*entry) + strlen(question) + 1 + sizeof(*data) +
+		2 + len;
+	if (!cache_make_negative_room(size)) {
+		DBG("no room for negative \"%s\"", question);
+		return -ENOSPC;
+	}
+
+	if (!cache_make_room(size, current_time)) {
+		DBG("no room in cache for negative \"%s\"", question);
+		return 0;
+	}
+
+	entry = g_hash_table_lookup(cache, question);
+	if (!entry) {
+		entry = cache_entry_new(question);
+		if (!entry)
+			return -ENOMEM;
+
+		new_entry = true;
+	}
+
+	slot = type == 1 ? &entry->ipv4 : &entry->ipv6;
+
+	/*
+	 * A fresh answer is not replaced by a negative one, the name
+	 * might have been removed just now but we do not know that.
+	 */
+	if (!new_entry && cache_check_is_valid(*slot, current_time) &&
+			!cache_check_wants_prefetch(*slot, current_time))
+		return 0;
+
+	data = g_try_new(struct cache_data, 1);
+	if (!data)
+		goto fail;
+
+	data->data_len = 2 + len;
+	data->data = ptr = g_try_malloc(data->data_len);
+	if (!data->data) {
+		g_free(data);
+		goto fail;
+	}
+
+	ptr[0] = len / 256;
+	ptr[1] = len - ptr[0] * 256;
+	memcpy(ptr + 2, msg + offset, len);
+
+	hdr = (void *) (ptr + 2);
+	hdr->arcount = 0;
+
+	data->inserted = current_time;
+	data->type = type;
+	data->answers = 0;
+	data->timeout = ttl;
+	data->valid_until = current_time + ttl;
+	data->cache_until = current_time + ttl;
+	data->negative = true;
+
+	if (*slot) {
+		g_free((*slot)->data);
+		g_free(*slot);
+
+		/*
+		 * compensate for the hit we'll get for serving
+		 * the response out of the cache
+		 */
+		entry->hits--;
+		if (entry->hits < 0)
+			entry->hits = 0;
+	}
+
+	*slot = data;
+
+	if (new_entry) {
+		g_hash_table_replace(cache, entry->key, entry);
+		g_queue_push_head(cache_lru, entry);
+		entry->lru_link = g_queue_peek_head_link(cache_lru);
+	}
+
+	cache_entry_resize(entry);
+
+	DBG("cache negative %zu bytes question \"%s\" type %d rcode %d "
+		"ttl %d", cache_negative_bytes, question, type,
+		hdr->rcode, ttl);
+
+	return 0;
+
+fail:
+	if (new_entry) {
+		g_free(entry->key);
+		g_free(entry);
+	}
+
+	return -ENOMEM;
+}
+
 static int cache_update(struct server_data *srv, unsigned char *msg,
 			unsigned int msg_len)
 {
@@ -1374,18 +2920,13 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	struct domain_question *q;
 	struct cache_entry *entry;
 	struct cache_data *data;
-	char question[NS_MAXDNAME + 1];
-	unsigned char response[NS_MAXDNAME + 1];
+	char *question = NULL;
+	unsigned char response[EDNS0_MAX_SIZE];
 	unsigned char *ptr;
 	unsigned int rsplen;
 	bool new_entry = true;
 	time_t current_time;
-
-	if (cache_size >= MAX_CACHE_SIZE) {
-		cache_cleanup();
-		if (cache_size >= MAX_CACHE_SIZE)
-			return 0;
-	}
+	size_t size;
 
 	current_time = time(NULL);
 
@@ -1400,29 +2941,44 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 
 	DBG("offset %d hdr %p msg %p rcode %d", offset, hdr, msg, hdr->rcode);
 
+	if (!cache)
+		create_cache();
+
+	/* A truncated answer is incomplete, the TCP retry gets cached */
+	if (hdr->tc)
+		return 0;
+
+	if (hdr->rcode == ns_r_nxdomain ||
+			(hdr->rcode == ns_r_noerror && hdr->ancount == 0)) {
+		err = cache_update_negative(srv, msg, msg_len, current_time);
+		if (err != -ENOMSG && err != -ENOSPC)
+			return 0;
+	}
+
 	/* Continue only if response code is 0 (=ok) */
 	if (hdr->rcode != ns_r_noerror)
 		return 0;
 
-	if (!cache)
-		create_cache();
-
 	rsplen = sizeof(response) - 1;
-	question[sizeof(question) - 1] = '\0';
 
 	err = parse_response(msg + offset, msg_len - offset,
-				question, sizeof(question) - 1,
-				&type, &class, &ttl,
+				&question, &type, &class, &ttl,
 				response, &rsplen, &answers);
 
 	/*
 	 * special case: if we do a ipv6 lookup and get no result
 	 * for a record that's already in our ipv4 cache.. we want
-	 * to cache the negative response.
+	 * to cache the negative response. This does not depend on the
+	 * negative answer budget, the answer is stored next to the
+	 * ipv4 one and expires with it.
 	 */
-	if ((err == -ENOMSG || err == -ENOBUFS) &&
+	if ((err == -ENOMSG || err == -ENOBUFS) && question &&
 			reply_query_type(msg + offset,
 					msg_len - offset) == 28) {
+		size = sizeof(struct cache_data) + msg_len + 2;
+		if (!cache_make_room(size, current_time))
+			return 0;
+
 		entry = g_hash_table_lookup(cache, question);
 		if (entry && entry->ipv4 && !entry->ipv6) {
 			int cache_offset = 0;
@@ -1444,8 +3000,10 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 				ptr += 2;
 			data->valid_until = entry->ipv4->valid_until;
 			data->cache_until = entry->ipv4->cache_until;
+			data->negative = false;
 			memcpy(ptr, msg, msg_len);
 			entry->ipv6 = data;
+			cache_entry_resize(entry);
 			/*
 			 * we will get a "hit" when we serve the response
 			 * out of the cache
@@ -1462,6 +3020,18 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 
 	qlen = strlen(question);
 
+	/*
+	 * The "2" in start of the length is the TCP offset. We allocate it
+	 * here even for UDP packet because it simplifies the sending
+	 * of cached packet.
+	 */
+	size = sizeof(*entry) + qlen + 1 + sizeof(*data) +
+		2 + 12 + qlen + 1 + 2 + 2 + rsplen;
+	if (!cache_make_room(size, current_time)) {
+		DBG("no room in cache for \"%s\" size %zd", question, size);
+		return 0;
+	}
+
 	/*
 	 * If the cache contains already data, check if the
 	 * type of the cached data is the same and do not add
@@ -1471,40 +3041,45 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	 */
 	entry = g_hash_table_lookup(cache, question);
 	if (!entry) {
-		entry = g_try_new(struct cache_entry, 1);
+		entry = cache_entry_new(question);
 		if (!entry)
 			return -ENOMEM;
 
 		data = g_try_new(struct cache_data, 1);
 		if (!data) {
+			g_free(entry->key);
 			g_free(entry);
 			return -ENOMEM;
 		}
 
-		entry->key = g_strdup(question);
-		entry->ipv4 = entry->ipv6 = NULL;
-		entry->want_refresh = false;
-		entry->hits = 0;
-
 		if (type == 1)
 			entry->ipv4 = data;
 		else
 			entry->ipv6 = data;
 	} else {
-		if (type == 1 && entry->ipv4)
-			return 0;
+		struct cache_data **old;
 
-		if (type == 28 && entry->ipv6)
+		old = type == 1 ? &entry->ipv4 : &entry->ipv6;
+
+		/*
+		 * Fresh data is kept as is, but stale data and data that
+		 * is being prefetched is replaced by the new answer.
+		 */
+		if (cache_check_is_valid(*old, current_time) &&
+				!cache_check_wants_prefetch(*old,
+							current_time))
 			return 0;
 
 		data = g_try_new(struct cache_data, 1);
 		if (!data)
 			return -ENOMEM;
 
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
+		if (*old) {
+			g_free((*old)->data);
+			g_free(*old);
+		}
+
+		*old = data;
 
 		/*
 		 * compensate for the hit we'll get for serving
@@ -1523,12 +3098,8 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	data->inserted = current_time;
 	data->type = type;
 	data->answers = answers;
+	data->negative = false;
 	data->timeout = ttl;
-	/*
-	 * The "2" in start of the length is the TCP offset. We allocate it
-	 * here even for UDP packet because it simplifies the sending
-	 * of cached packet.
-	 */
 	data->data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
 	data->data = ptr = g_malloc(data->data_len);
 	data->valid_until = current_time + ttl;
@@ -1575,12 +3146,16 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 
 	if (new_entry) {
 		g_hash_table_replace(cache, entry->key, entry);
-		cache_size++;
+		g_queue_push_head(cache_lru, entry);
+		entry->lru_link = g_queue_peek_head_link(cache_lru);
 	}
 
-	DBG("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
-								"dns len %u",
-		cache_size, new_entry ? "new " : "old ",
+	cache_entry_resize(entry);
+
+	DBG("cache %u bytes %zu %squestion \"%s\" type %d ttl %d size %zd "
+							"packet %u dns len %u",
+		g_hash_table_size(cache), cache_bytes,
+		new_entry ? "new " : "old ",
 		question, type, ttl,
 		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
 		data->data_len,
@@ -1591,12 +3166,16 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	return 0;
 }
 
-static int ns_resolv(struct server_data *server, struct request_data *req,
-				gpointer request, gpointer name)
+/*
+ * Answer the request from the cache if possible. Returns 1 if the
+ * answer was sent.
+ */
+static int cache_answer(struct request_data *req, gpointer request,
+				gpointer name)
 {
-	GList *list;
-	int sk, err, type = 0;
-	char *dot, *lookup = (char *) name;
+	int type = 0;
+	char *lookup = (char *) name;
+	char *question;
 	struct cache_entry *entry;
 
 	entry = cache_check(request, &type, req->protocol);
@@ -1612,13 +3191,17 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 
 		if (data) {
 			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+			cache_hit(entry, type);
 		}
 
+		question = (char *) request + protocol_offset(req->protocol) +
+						sizeof(struct domain_hdr);
+
 		if (data && req->protocol == IPPROTO_TCP) {
 			send_cached_response(req->client_sk, data->data,
 					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+					req->srcid, data->answers, ttl_left,
+					question, 0);
 			return 1;
 		}
 
@@ -1631,11 +3214,21 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 			send_cached_response(udp_sk, data->data,
 				data->data_len, &req->sa, req->sa_len,
 				IPPROTO_UDP, req->srcid, data->answers,
-				ttl_left);
+				ttl_left, question, req->udp_size);
 			return 1;
 		}
 	}
 
+	return 0;
+}
+
+static int ns_send(struct server_data *server, struct request_data *req,
+				gpointer request, gpointer name)
+{
+	GList *list;
+	int sk, err;
+	char *dot, *lookup = (char *) name;
+
 	sk = g_io_channel_unix_get_fd(server->channel);
 
 	err = sendto(sk, request, req->request_len, MSG_NOSIGNAL,
@@ -1648,8 +3241,20 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 		return -EIO;
 	}
 
+	/* A partly written query would desync the pipelined stream */
+	if (err != (int) req->request_len) {
+		DBG("Short write to server %s sock %d", server->server, sk);
+		return -EIO;
+	}
+
 	req->numserv++;
 
+	request_server_add(req, server);
+
+	/* Prefetches are sent without domains */
+	if (!lookup)
+		return 0;
+
 	/* If we have more than one dot, we don't add domains */
 	dot = strchr(lookup, '.');
 	if (dot && dot != lookup + strlen(lookup) - 1)
@@ -1714,6 +3319,70 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 	return 0;
 }
 
+static int ns_resolv(struct server_data *server, struct request_data *req,
+				gpointer request, gpointer name)
+{
+	int err;
+
+	err = cache_answer(req, request, name);
+	if (err != 0)
+		return err;
+
+	return ns_send(server, req, request, name);
+}
+
+static int server_create_socket(struct server_data *data);
+static struct server_data *tcp_server_get(struct server_data *udp_server);
+static gboolean hedge_timeout(gpointer user_data);
+
+/*
+ * Send the request to the best server it has not been sent to yet,
+ * and send it to the next one as well if that server is slow.
+ */
+static bool request_send(struct request_data *req, gpointer request,
+				gpointer name)
+{
+	struct server_data *server;
+
+	while ((server = server_select(req))) {
+		guint delay;
+
+		if ((!server->channel && server_create_socket(server) < 0) ||
+				ns_send(server, req, request, name) < 0) {
+			request_server_add(req, server)->done = true;
+			continue;
+		}
+
+		delay = server_hedge_delay(server);
+
+		DBG("req %p server %s srtt %u ms hedge %u ms", req,
+			server->server, (unsigned int) (server->srtt / 1000),
+			delay);
+
+		if (req->hedge_timeout > 0)
+			g_source_remove(req->hedge_timeout);
+
+		req->hedge_timeout = g_timeout_add(delay, hedge_timeout, req);
+
+		return true;
+	}
+
+	return false;
+}
+
+static gboolean hedge_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+
+	req->hedge_timeout = 0;
+
+	DBG("req %p dstid 0x%04x", req, req->dstid);
+
+	request_send(req, req->request, req->name);
+
+	return FALSE;
+}
+
 static char *convert_label(char *start, char *end, char *ptr, char *uptr,
 			int remaining_len, int *used_comp, int *used_uncomp)
 {
@@ -1884,12 +3553,22 @@ static int strip_domains(char *name, char *answers, int maxlen)
 	char *ptr, *start = answers, *end = answers + maxlen;
 
 	while (maxlen > 0) {
-		ptr = strstr(answers, name);
-		if (ptr) {
+		ptr = answers;
+
+		/*
+		 * Only the owner name whose first label is the host
+		 * label of the question loses its domain part.
+		 */
+		if (*ptr == *name && dns_label_equal((unsigned char *) ptr,
+						(unsigned char *) name,
+						name_len)) {
 			char *domain = ptr + name_len;
 
 			if (*domain) {
-				int domain_len = strlen(domain);
+				int domain_len = strnlen(domain, end - domain);
+
+				if (domain + domain_len >= end)
+					return -EINVAL;
 
 				memmove(answers + name_len,
 					domain + domain_len,
@@ -1900,10 +3579,14 @@ static int strip_domains(char *name, char *answers, int maxlen)
 			}
 		}
 
-		answers += strlen(answers) + 1;
+		answers += strnlen(answers, end - answers) + 1;
 		answers += 2 + 2 + 4;  /* skip type, class and ttl fields */
 
-		data_len = answers[0] << 8 | answers[1];
+		if (answers + 2 > end)
+			return -EINVAL;
+
+		data_len = (unsigned char) answers[0] << 8 |
+					(unsigned char) answers[1];
 		answers += 2; /* skip the length field */
 
 		if (answers + data_len > end)
@@ -1938,6 +3621,15 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 	DBG("req %p dstid 0x%04x altid 0x%04x rcode %d",
 			req, req->dstid, req->altid, hdr->rcode);
 
+	request_server_reply(req, data, hdr->rcode);
+
+	/*
+	 * The client retries a truncated answer over TCP, so have the
+	 * connection to the server ready by the time it does.
+	 */
+	if (protocol == IPPROTO_UDP && hdr->tc)
+		tcp_server_get(data);
+
 	reply[offset] = req->srcid & 0xff;
 	reply[offset + 1] = req->srcid >> 8;
 
@@ -2121,6 +3813,16 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 	}
 
 out:
+	/*
+	 * A failing server does not have the last word if there are
+	 * servers the request has not been sent to yet.
+	 */
+	if (req->protocol == IPPROTO_UDP && req->numresp >= req->numserv &&
+			(hdr->rcode == ns_r_servfail ||
+				hdr->rcode == ns_r_refused) &&
+			request_send(req, req->request, req->name))
+		return -EINVAL;
+
 	if (req->numresp < req->numserv) {
 		if (hdr->rcode > ns_r_noerror) {
 			return -EINVAL;
@@ -2129,7 +3831,22 @@ out:
 		}
 	}
 
-	request_list = g_slist_remove(request_list, req);
+	request_remove(req);
+
+	if (!req->prefetch && !req->answered && request_failed(req))
+		send_stale_response(req);
+
+	reply_followers(req);
+
+	/*
+	 * The reply of a prefetch only refreshes the cache, and a client
+	 * that got a stale answer must not get a second one.
+	 */
+	if (req->prefetch || req->answered) {
+		DBG("req %p not forwarded", req);
+		destroy_request_data(req);
+		return 0;
+	}
 
 	if (protocol == IPPROTO_UDP) {
 		sk = get_req_udp_socket(req);
@@ -2137,8 +3854,8 @@ out:
 			errno = -EIO;
 			err = -EIO;
 		} else
-			err = sendto(sk, req->resp, req->resplen, 0,
-				&req->sa, req->sa_len);
+			err = udp_send_answer(sk, req->resp, req->resplen,
+				req->udp_size, &req->sa, req->sa_len);
 	} else {
 		sk = req->client_sk;
 		err = send(sk, req->resp, req->resplen, MSG_NOSIGNAL);
@@ -2182,6 +3899,8 @@ static void server_destroy_socket(struct server_data *data)
 
 static void destroy_server(struct server_data *server)
 {
+	GList *list;
+
 	DBG("index %d server %s sock %d", server->index, server->server,
 			server->channel ?
 			g_io_channel_unix_get_fd(server->channel): -1);
@@ -2189,6 +3908,17 @@ static void destroy_server(struct server_data *server)
 	server_list = g_slist_remove(server_list, server);
 	server_destroy_socket(server);
 
+	for (list = request_queue.head; list; list = list->next) {
+		struct request_data *req = list->data;
+		struct request_server *rs;
+
+		rs = request_server_find(req, server);
+		if (rs) {
+			req->servers = g_slist_remove(req->servers, rs);
+			g_free(rs);
+		}
+	}
+
 	if (server->protocol == IPPROTO_UDP && server->enabled)
 		DBG("Removing DNS server %s", server->server);
 
@@ -2214,8 +3944,10 @@ static void destroy_server(struct server_data *server)
 static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
-	unsigned char buf[4096];
-	int sk, err, len;
+	static unsigned char bufs[UDP_BATCH_SIZE][EDNS0_MAX_SIZE];
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	int sk, count, i;
 	struct server_data *data = user_data;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
@@ -2226,15 +3958,62 @@ static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 
 	sk = g_io_channel_unix_get_fd(channel);
 
-	len = recv(sk, buf, sizeof(buf), 0);
-	if (len < 12)
-		return TRUE;
+	memset(msgs, 0, sizeof(msgs));
 
-	err = forward_dns_reply(buf, len, IPPROTO_UDP, data);
-	if (err < 0)
+	for (i = 0; i < UDP_BATCH_SIZE; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	count = recvmmsg(sk, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (count <= 0)
 		return TRUE;
 
-	return TRUE;
+	udp_batch_begin();
+
+	for (i = 0; i < count; i++) {
+		if (msgs[i].msg_len < 12)
+			continue;
+
+		forward_dns_reply(bufs[i], msgs[i].msg_len, IPPROTO_UDP,
+									data);
+	}
+
+	udp_batch_end();
+
+	return TRUE;
+}
+
+static bool server_has_requests(struct server_data *server)
+{
+	GList *list;
+
+	for (list = request_queue.head; list; list = list->next) {
+		struct request_server *rs;
+
+		rs = request_server_find(list->data, server);
+		if (rs && !rs->done)
+			return true;
+	}
+
+	return false;
+}
+
+static gboolean tcp_idle_timeout(gpointer user_data);
+
+/*
+ * A TCP connection stays open while queries are outstanding on it, and
+ * for TCP_IDLE_TIMEOUT seconds after the last activity.
+ */
+static void tcp_server_idle(struct server_data *server)
+{
+	if (server->timeout > 0)
+		g_source_remove(server->timeout);
+
+	server->timeout = g_timeout_add_seconds(TCP_IDLE_TIMEOUT,
+						tcp_idle_timeout, server);
 }
 
 static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
@@ -2248,7 +4027,7 @@ static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
 		return FALSE;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		GSList *list;
+		GList *list;
 hangup:
 		DBG("TCP server channel closed, sk %d", sk);
 
@@ -2259,9 +4038,10 @@ hangup:
 		g_free(server->incoming_reply);
 		server->incoming_reply = NULL;
 
-		list = request_list;
+		list = request_queue.head;
 		while (list) {
 			struct request_data *req = list->data;
+			struct request_server *rs;
 			struct domain_hdr *hdr;
 			list = list->next;
 
@@ -2271,6 +4051,20 @@ hangup:
 			if (!req->request)
 				continue;
 
+			/*
+			 * Only the requests that were sent on this
+			 * connection, or that were waiting for it to
+			 * connect, are affected.
+			 */
+			rs = request_server_find(req, server);
+			if (rs) {
+				if (rs->done)
+					continue;
+
+				rs->done = true;
+			} else if (req->numserv || server->connected)
+				continue;
+
 			/*
 			 * If we're not waiting for any further response
 			 * from another name server, then we send an error
@@ -2284,7 +4078,7 @@ hangup:
 			send_response(req->client_sk, req->request,
 				req->request_len, NULL, 0, IPPROTO_TCP);
 
-			request_list = g_slist_remove(request_list, req);
+			request_remove(req);
 		}
 
 		destroy_server(server);
@@ -2293,39 +4087,16 @@ hangup:
 	}
 
 	if ((condition & G_IO_OUT) && !server->connected) {
-		GSList *list;
-		GList *domains;
-		bool no_request_sent = true;
-		struct server_data *udp_server;
-
-		udp_server = find_server(server->index, server->server,
-								IPPROTO_UDP);
-		if (udp_server) {
-			for (domains = udp_server->domains; domains;
-						domains = domains->next) {
-				char *dom = domains->data;
-
-				DBG("Adding domain %s to %s",
-						dom, server->server);
-
-				server->domains = g_list_append(server->domains,
-								g_strdup(dom));
-			}
-		}
+		GList *list;
 
 		server->connected = true;
-		server_list = g_slist_append(server_list, server);
 
-		if (server->timeout > 0) {
-			g_source_remove(server->timeout);
-			server->timeout = 0;
-		}
-
-		for (list = request_list; list; ) {
+		for (list = request_queue.head; list; ) {
 			struct request_data *req = list->data;
 			int status;
 
-			if (req->protocol == IPPROTO_UDP) {
+			if (req->protocol == IPPROTO_UDP ||
+					request_server_find(req, server)) {
 				list = list->next;
 				continue;
 			}
@@ -2340,7 +4111,6 @@ hangup:
 				 * so the request can be released
 				 */
 				list = list->next;
-				request_list = g_slist_remove(request_list, req);
 				destroy_request_data(req);
 				continue;
 			}
@@ -2350,8 +4120,6 @@ hangup:
 				continue;
 			}
 
-			no_request_sent = false;
-
 			if (req->timeout > 0)
 				g_source_remove(req->timeout);
 
@@ -2360,73 +4128,92 @@ hangup:
 			list = list->next;
 		}
 
-		if (no_request_sent) {
-			destroy_server(server);
-			return FALSE;
-		}
-
-	} else if (condition & G_IO_IN) {
-		struct partial_reply *reply = server->incoming_reply;
-		int bytes_recv;
-
-		if (!reply) {
-			unsigned char reply_len_buf[2];
-			uint16_t reply_len;
-
-			bytes_recv = recv(sk, reply_len_buf, 2, MSG_PEEK);
-			if (!bytes_recv) {
-				goto hangup;
-			} else if (bytes_recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					return TRUE;
-
-				connman_error("DNS proxy error %s",
-						strerror(errno));
-				goto hangup;
-			} else if (bytes_recv < 2)
-				return TRUE;
-
-			reply_len = reply_len_buf[1] | reply_len_buf[0] << 8;
-			reply_len += 2;
-
-			DBG("TCP reply %d bytes from %d", reply_len, sk);
-
-			reply = g_try_malloc(sizeof(*reply) + reply_len + 2);
-			if (!reply)
-				return TRUE;
+		tcp_server_idle(server);
 
-			reply->len = reply_len;
-			reply->received = 0;
+		/* From now on only the replies are of interest */
+		server->watch = g_io_add_watch(server->channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						tcp_server_event, server);
+		return FALSE;
 
-			server->incoming_reply = reply;
-		}
+	} else if (condition & G_IO_IN) {
+		/*
+		 * The replies to pipelined queries can come in any order,
+		 * forward_dns_reply() matches them by their ID.
+		 */
+		for (;;) {
+			struct partial_reply *reply = server->incoming_reply;
+			int bytes_recv;
+
+			if (!reply) {
+				unsigned char reply_len_buf[2];
+				unsigned int reply_len;
+
+				bytes_recv = recv(sk, reply_len_buf, 2,
+								MSG_PEEK);
+				if (!bytes_recv) {
+					goto hangup;
+				} else if (bytes_recv < 0) {
+					if (errno == EAGAIN ||
+						errno == EWOULDBLOCK)
+						break;
+
+					connman_error("DNS proxy error %s",
+							strerror(errno));
+					goto hangup;
+				} else if (bytes_recv < 2)
+					break;
+
+				reply_len = reply_len_buf[1] |
+						reply_len_buf[0] << 8;
+				reply_len += 2;
+
+				DBG("TCP reply %d bytes from %d", reply_len,
+									sk);
+
+				reply = g_try_malloc(sizeof(*reply) +
+								reply_len + 2);
+				if (!reply)
+					break;
+
+				reply->len = reply_len;
+				reply->received = 0;
+
+				server->incoming_reply = reply;
+			}
 
-		while (reply->received < reply->len) {
-			bytes_recv = recv(sk, reply->buf + reply->received,
+			while (reply->received < reply->len) {
+				bytes_recv = recv(sk,
+					reply->buf + reply->received,
 					reply->len - reply->received, 0);
-			if (!bytes_recv) {
-				connman_error("DNS proxy TCP disconnect");
-				break;
-			} else if (bytes_recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					return TRUE;
+				if (!bytes_recv) {
+					connman_error("DNS proxy TCP "
+							"disconnect");
+					goto hangup;
+				} else if (bytes_recv < 0) {
+					if (errno == EAGAIN ||
+						errno == EWOULDBLOCK)
+						break;
+
+					connman_error("DNS proxy error %s",
+							strerror(errno));
+					goto hangup;
+				}
+				reply->received += bytes_recv;
+			}
 
-				connman_error("DNS proxy error %s",
-						strerror(errno));
+			if (reply->received < reply->len)
 				break;
-			}
-			reply->received += bytes_recv;
-		}
 
-		forward_dns_reply(reply->buf, reply->received, IPPROTO_TCP,
-					server);
+			server->incoming_reply = NULL;
 
-		g_free(reply);
-		server->incoming_reply = NULL;
+			forward_dns_reply(reply->buf, reply->received,
+						IPPROTO_TCP, server);
 
-		destroy_server(server);
+			g_free(reply);
+		}
 
-		return FALSE;
+		tcp_server_idle(server);
 	}
 
 	return TRUE;
@@ -2441,6 +4228,11 @@ static gboolean tcp_idle_timeout(gpointer user_data)
 	if (!server)
 		return FALSE;
 
+	if (server_has_requests(server))
+		return TRUE;
+
+	server->timeout = 0;
+
 	destroy_server(server);
 
 	return FALSE;
@@ -2531,6 +4323,7 @@ static struct server_data *create_server(int index,
 {
 	struct server_data *data;
 	struct addrinfo hints, *rp;
+	char port[6];
 	int ret;
 
 	DBG("index %d server %s", index, server);
@@ -2565,7 +4358,9 @@ static struct server_data *create_server(int index,
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
 
-	ret = getaddrinfo(data->server, "53", &hints, &rp);
+	snprintf(port, sizeof(port), "%u", dns_server_port);
+
+	ret = getaddrinfo(data->server, port, &hints, &rp);
 	if (ret) {
 		connman_error("Failed to parse server %s address: %s\n",
 			      data->server, gai_strerror(ret));
@@ -2612,43 +4407,115 @@ static struct server_data *create_server(int index,
 			data->enabled = true;
 			DBG("Adding DNS server %s", data->server);
 		}
-
-		server_list = g_slist_append(server_list, data);
 	}
 
+	server_list = g_slist_append(server_list, data);
+
 	return data;
 }
 
+/*
+ * Return the TCP connection to the server of a UDP server entry, and
+ * start connecting if there is none. The connection carries any number
+ * of queries at a time (RFC 7766) and is shared by all TCP clients.
+ */
+static struct server_data *tcp_server_get(struct server_data *udp_server)
+{
+	struct server_data *server;
+	GList *list;
+
+	server = find_server(udp_server->index, udp_server->server,
+								IPPROTO_TCP);
+	if (server)
+		return server;
+
+	server = create_server(udp_server->index, NULL, udp_server->server,
+								IPPROTO_TCP);
+	if (!server)
+		return NULL;
+
+	for (list = udp_server->domains; list; list = list->next) {
+		char *dom = list->data;
+
+		DBG("Adding domain %s to %s", dom, server->server);
+
+		server->domains = g_list_append(server->domains,
+							g_strdup(dom));
+	}
+
+	return server;
+}
+
 static bool resolv(struct request_data *req,
 				gpointer request, gpointer name)
 {
-	GSList *list;
+	if (!server_select(req))
+		return false;
 
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+	if (cache_answer(req, request, name) > 0)
+		return true;
 
-		if (data->protocol == IPPROTO_TCP) {
-			DBG("server %s ignored proto TCP", data->server);
-			continue;
-		}
+	if (!request_send(req, request, name))
+		DBG("no server to send the request to");
 
-		DBG("server %s enabled %d", data->server, data->enabled);
+	return false;
+}
 
-		if (!data->enabled)
-			continue;
+/*
+ * Send the question of a cached entry to the best upstream server
+ * without any client waiting for it. The reply only updates the cache.
+ */
+static void cache_prefetch(struct cache_entry *entry, uint16_t type)
+{
+	struct request_data *req;
+	struct domain_hdr *hdr;
+	struct domain_question *q;
+	unsigned char *buf;
+	int len, qlen;
 
-		if (!data->channel && data->protocol == IPPROTO_UDP) {
-			if (server_create_socket(data) < 0) {
-				DBG("socket creation failed while resolving");
-				continue;
-			}
-		}
+	qlen = strlen(entry->key) + 1;
+	len = sizeof(struct domain_hdr) + qlen + sizeof(struct domain_question);
 
-		if (ns_resolv(data, req, request, name) > 0)
-			return true;
+	req = g_try_new0(struct request_data, 1);
+	if (!req)
+		return;
+
+	req->request = buf = g_try_malloc0(len);
+	if (!buf) {
+		g_free(req);
+		return;
 	}
 
-	return false;
+	req->protocol = IPPROTO_UDP;
+	req->prefetch = true;
+	request_set_ids(req);
+	req->request_len = len;
+
+	buf[0] = req->dstid & 0xff;
+	buf[1] = req->dstid >> 8;
+
+	hdr = (void *) buf;
+	hdr->rd = 1;
+	hdr->qdcount = htons(1);
+
+	memcpy(buf + sizeof(struct domain_hdr), entry->key, qlen);
+
+	q = (void *) (buf + sizeof(struct domain_hdr) + qlen);
+	q->type = htons(type);
+	q->class = htons(ns_c_in);
+
+	if (!request_send(req, buf, NULL)) {
+		destroy_request_data(req);
+		return;
+	}
+
+	DBG("prefetch id 0x%04x type %d hits %d", req->dstid, type,
+								entry->hits);
+
+	cache_stats.prefetches++;
+
+	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
+	request_add(req);
 }
 
 static void update_domain(int index, const char *domain, bool append)
@@ -2704,21 +4571,22 @@ static void remove_domain(int index, const char *domain)
 
 static void flush_requests(struct server_data *server)
 {
-	GSList *list;
+	GList *list;
 
-	list = request_list;
+	list = request_queue.head;
 	while (list) {
 		struct request_data *req = list->data;
 
 		list = list->next;
 
+		if (req->prefetch)
+			continue;
+
 		if (ns_resolv(server, req, req->request, req->name)) {
 			/*
 			 * A cached result was sent,
 			 * so the request can be released
 			 */
-			request_list =
-				g_slist_remove(request_list, req);
 			destroy_request_data(req);
 			continue;
 		}
@@ -2728,81 +4596,416 @@ static void flush_requests(struct server_data *server)
 
 		req->timeout = g_timeout_add_seconds(5, request_timeout, req);
 	}
-}
+}
+
+int __connman_dnsproxy_append(int index, const char *domain,
+							const char *server)
+{
+	struct server_data *data;
+
+	DBG("index %d server %s", index, server);
+
+	if (!server && !domain)
+		return -EINVAL;
+
+	if (!server) {
+		append_domain(index, domain);
+
+		return 0;
+	}
+
+	if (g_str_equal(server, "127.0.0.1"))
+		return -ENODEV;
+
+	if (g_str_equal(server, "::1"))
+		return -ENODEV;
+
+	data = find_server(index, server, IPPROTO_UDP);
+	if (data) {
+		append_domain(index, domain);
+		return 0;
+	}
+
+	data = create_server(index, domain, server, IPPROTO_UDP);
+	if (!data)
+		return -EIO;
+
+	flush_requests(data);
+
+	return 0;
+}
+
+static void remove_server(int index, const char *domain,
+			const char *server, int protocol)
+{
+	struct server_data *data;
+
+	data = find_server(index, server, protocol);
+	if (!data)
+		return;
+
+	destroy_server(data);
+}
+
+int __connman_dnsproxy_remove(int index, const char *domain,
+							const char *server)
+{
+	DBG("index %d server %s", index, server);
+
+	if (!server && !domain)
+		return -EINVAL;
+
+	if (!server) {
+		remove_domain(index, domain);
+
+		return 0;
+	}
+
+	if (g_str_equal(server, "127.0.0.1"))
+		return -ENODEV;
+
+	if (g_str_equal(server, "::1"))
+		return -ENODEV;
+
+	remove_server(index, domain, server, IPPROTO_UDP);
+	remove_server(index, domain, server, IPPROTO_TCP);
+
+	return 0;
+}
+
+void __connman_dnsproxy_append_server_stats(DBusMessageIter *iter)
+{
+	time_t current_time = time(NULL);
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+		DBusMessageIter entry, dict;
+		dbus_bool_t enabled, healthy;
+		unsigned int rtt, rttvar;
+
+		if (data->protocol != IPPROTO_UDP)
+			continue;
+
+		enabled = data->enabled;
+		healthy = server_is_healthy(data, current_time);
+		rtt = data->srtt / 1000;
+		rttvar = data->rttvar / 1000;
+
+		dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT,
+							NULL, &entry);
+
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+							&data->server);
+
+		connman_dbus_dict_open(&entry, &dict);
+
+		connman_dbus_dict_append_basic(&dict, "Index",
+					DBUS_TYPE_INT32, &data->index);
+		connman_dbus_dict_append_basic(&dict, "Enabled",
+					DBUS_TYPE_BOOLEAN, &enabled);
+		connman_dbus_dict_append_basic(&dict, "Healthy",
+					DBUS_TYPE_BOOLEAN, &healthy);
+		connman_dbus_dict_append_basic(&dict, "Queries",
+					DBUS_TYPE_UINT32, &data->queries);
+		connman_dbus_dict_append_basic(&dict, "Answers",
+					DBUS_TYPE_UINT32, &data->answers);
+		connman_dbus_dict_append_basic(&dict, "Timeouts",
+					DBUS_TYPE_UINT32, &data->timeouts);
+		connman_dbus_dict_append_basic(&dict, "Failures",
+					DBUS_TYPE_UINT32, &data->failures);
+		connman_dbus_dict_append_basic(&dict, "RoundTripTime",
+					DBUS_TYPE_UINT32, &rtt);
+		connman_dbus_dict_append_basic(&dict, "RoundTripTimeVariance",
+					DBUS_TYPE_UINT32, &rttvar);
+
+		connman_dbus_dict_close(&entry, &dict);
+
+		dbus_message_iter_close_container(iter, &entry);
+	}
+}
+
+static uint32_t cache_snapshot_checksum(const unsigned char *buf,
+						size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= buf[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static void cache_snapshot_append(GString *str, struct cache_entry *entry,
+					struct cache_data *data)
+{
+	struct cache_snapshot_record record;
+
+	if (!data || !data->data)
+		return;
+
+	memset(&record, 0, sizeof(record));
+	record.inserted = data->inserted;
+	record.valid_until = data->valid_until;
+	record.cache_until = data->cache_until;
+	record.timeout = data->timeout;
+	record.type = data->type;
+	record.answers = data->answers;
+	record.key_len = strlen(entry->key);
+	record.negative = data->negative;
+	record.data_len = data->data_len;
+
+	g_string_append_len(str, (gchar *) &record, sizeof(record));
+	g_string_append_len(str, entry->key, record.key_len);
+	g_string_append_len(str, (gchar *) data->data, data->data_len);
+}
+
+static void cache_snapshot_save(void)
+{
+	struct cache_snapshot_header header;
+	GError *error = NULL;
+	GString *str;
+	GList *list;
+
+	/*
+	 * Without a default service the cache is of no use, and the
+	 * saved cache of the last default service is kept instead.
+	 */
+	if (!cache_snapshot_enabled || !cache_dirty || !cache ||
+							!default_ident)
+		return;
+
+	memset(&header, 0, sizeof(header));
+	header.ident_len = strlen(default_ident);
+
+	str = g_string_sized_new(sizeof(header) + header.ident_len +
+								cache_bytes);
+	g_string_append_len(str, (gchar *) &header, sizeof(header));
+
+	g_string_append_len(str, default_ident, header.ident_len);
+
+	for (list = g_queue_peek_tail_link(cache_lru); list;
+						list = list->prev) {
+		struct cache_entry *entry = list->data;
+
+		cache_snapshot_append(str, entry, entry->ipv4);
+		cache_snapshot_append(str, entry, entry->ipv6);
+	}
+
+	header.magic = CACHE_SNAPSHOT_MAGIC;
+	header.version = CACHE_SNAPSHOT_VERSION;
+	header.length = str->len - sizeof(header);
+	header.checksum = cache_snapshot_checksum(
+			(unsigned char *) str->str + sizeof(header),
+			header.length);
+	memcpy(str->str, &header, sizeof(header));
+
+	if (!g_file_set_contents(CACHE_SNAPSHOT_FILE, str->str, str->len,
+								&error)) {
+		DBG("Failed to save the DNS cache: %s", error->message);
+		g_error_free(error);
+	} else {
+		DBG("saved %u entries %zu bytes", g_hash_table_size(cache),
+								str->len);
+		cache_dirty = false;
+	}
+
+	g_string_free(str, TRUE);
+}
+
+static bool cache_snapshot_insert(struct cache_snapshot_record *record,
+				const char *key, const unsigned char *buf,
+				time_t current_time)
+{
+	struct cache_entry *entry;
+	struct cache_data *data, **slot;
+	struct dns_name_view key_view, packet_view;
+	bool new_entry = false;
+	char *question;
+	size_t size;
+
+	if (record->type != 1 && record->type != 28)
+		return false;
+
+	if (memchr(key, 0, record->key_len))
+		return false;
+
+	if (record->data_len < 2 + 12 + record->key_len + 1 + 4 ||
+			(buf[0] << 8 | buf[1]) != (int) record->data_len - 2)
+		return false;
+
+	question = g_strndup(key, record->key_len);
+
+	/*
+	 * The cached packet has the TCP length prefix and carries the
+	 * same question as the key, maybe spelled in another case.
+	 */
+	cache_key_view(question, &key_view);
+	packet_view.msg = buf + 2;
+	packet_view.end = buf + record->data_len;
+	packet_view.name = packet_view.msg + 12;
+
+	if (!dns_name_equal(&key_view, &packet_view))
+		goto out;
+
+	size = sizeof(*entry) + record->key_len + 1 + sizeof(*data) +
+							record->data_len;
+
+	if (record->negative && !cache_make_negative_room(size))
+		goto out;
+
+	if (!cache_make_room(size, current_time))
+		goto out;
+
+	entry = g_hash_table_lookup(cache, question);
+	if (!entry) {
+		entry = cache_entry_new(question);
+		if (!entry) {
+			g_free(question);
+			return false;
+		}
+
+		new_entry = true;
+	}
 
-int __connman_dnsproxy_append(int index, const char *domain,
-							const char *server)
-{
-	struct server_data *data;
+	g_free(question);
 
-	DBG("index %d server %s", index, server);
+	slot = record->type == 1 ? &entry->ipv4 : &entry->ipv6;
+	if (*slot)
+		return false;
 
-	if (!server && !domain)
-		return -EINVAL;
+	data = g_try_new(struct cache_data, 1);
+	if (!data)
+		goto fail;
 
-	if (!server) {
-		append_domain(index, domain);
+	data->data = g_try_malloc(record->data_len);
+	if (!data->data) {
+		g_free(data);
+		goto fail;
+	}
 
-		return 0;
+	memcpy(data->data, buf, record->data_len);
+	data->data_len = record->data_len;
+	data->inserted = record->inserted;
+	data->valid_until = record->valid_until;
+	data->cache_until = record->cache_until;
+	data->timeout = record->timeout;
+	data->type = record->type;
+	data->answers = record->answers;
+	data->negative = record->negative;
+
+	*slot = data;
+
+	if (new_entry) {
+		g_hash_table_replace(cache, entry->key, entry);
+		g_queue_push_head(cache_lru, entry);
+		entry->lru_link = g_queue_peek_head_link(cache_lru);
 	}
 
-	if (g_str_equal(server, "127.0.0.1"))
-		return -ENODEV;
+	cache_entry_resize(entry);
 
-	if (g_str_equal(server, "::1"))
-		return -ENODEV;
+	return true;
 
-	data = find_server(index, server, IPPROTO_UDP);
-	if (data) {
-		append_domain(index, domain);
-		return 0;
+fail:
+	if (new_entry) {
+		g_free(entry->key);
+		g_free(entry);
 	}
 
-	data = create_server(index, domain, server, IPPROTO_UDP);
-	if (!data)
-		return -EIO;
+	return false;
 
-	flush_requests(data);
+out:
+	g_free(question);
 
-	return 0;
+	return false;
 }
 
-static void remove_server(int index, const char *domain,
-			const char *server, int protocol)
+static void cache_snapshot_load(void)
 {
-	struct server_data *data;
+	struct cache_snapshot_header header;
+	time_t current_time = time(NULL);
+	unsigned int loaded = 0, expired = 0;
+	unsigned char *ptr, *end;
+	gchar *contents = NULL;
+	gsize length = 0;
 
-	data = find_server(index, server, protocol);
-	if (!data)
+	if (!g_file_get_contents(CACHE_SNAPSHOT_FILE, &contents, &length,
+									NULL))
 		return;
 
-	destroy_server(data);
-}
+	if (length < sizeof(header))
+		goto out;
 
-int __connman_dnsproxy_remove(int index, const char *domain,
-							const char *server)
-{
-	DBG("index %d server %s", index, server);
+	memcpy(&header, contents, sizeof(header));
+
+	if (header.magic != CACHE_SNAPSHOT_MAGIC ||
+			header.version != CACHE_SNAPSHOT_VERSION ||
+			header.length != length - sizeof(header) ||
+			header.ident_len > header.length ||
+			header.checksum != cache_snapshot_checksum(
+				(unsigned char *) contents + sizeof(header),
+				header.length)) {
+		connman_warn("Invalid DNS cache snapshot %s",
+						CACHE_SNAPSHOT_FILE);
+		goto out;
+	}
 
-	if (!server && !domain)
-		return -EINVAL;
+	ptr = (unsigned char *) contents + sizeof(header);
+	end = (unsigned char *) contents + length;
 
-	if (!server) {
-		remove_domain(index, domain);
+	if (!header.ident_len)
+		goto out;
 
-		return 0;
+	g_free(cache_snapshot_ident);
+	cache_snapshot_ident = g_strndup((char *) ptr, header.ident_len);
+	ptr += header.ident_len;
+
+	if (!cache)
+		create_cache();
+
+	while (ptr + sizeof(struct cache_snapshot_record) <= end) {
+		struct cache_snapshot_record record;
+		const char *key;
+		unsigned char *buf;
+
+		memcpy(&record, ptr, sizeof(record));
+		ptr += sizeof(record);
+
+		if (ptr + record.key_len + record.data_len > end)
+			break;
+
+		key = (char *) ptr;
+		buf = ptr + record.key_len;
+		ptr += record.key_len + record.data_len;
+
+		if (record.cache_until + (time_t) cache_stale_time <
+							current_time) {
+			expired++;
+			continue;
+		}
+
+		if (cache_snapshot_insert(&record, key, buf, current_time))
+			loaded++;
 	}
 
-	if (g_str_equal(server, "127.0.0.1"))
-		return -ENODEV;
+	/* the cache matches the file now */
+	cache_dirty = false;
 
-	if (g_str_equal(server, "::1"))
-		return -ENODEV;
+	DBG("loaded %u entries, %u expired, for %s", loaded, expired,
+						cache_snapshot_ident);
 
-	remove_server(index, domain, server, IPPROTO_UDP);
-	remove_server(index, domain, server, IPPROTO_TCP);
+out:
+	g_free(contents);
+}
 
-	return 0;
+static gboolean cache_snapshot_timeout(gpointer user_data)
+{
+	cache_snapshot_save();
+
+	return TRUE;
 }
 
 static void dnsproxy_offline_mode(bool enabled)
@@ -2834,8 +5037,30 @@ static void dnsproxy_default_changed(struct connman_service *service)
 
 	DBG("service %p", service);
 
-	/* DNS has changed, invalidate the cache */
-	cache_invalidate();
+	/* save the cache of the old default service before it is gone */
+	cache_snapshot_save();
+
+	g_free(default_ident);
+	default_ident = NULL;
+
+	if (service)
+		default_ident =
+			g_strdup(__connman_service_get_ident(service));
+
+	/*
+	 * DNS has changed, invalidate the cache. The cache loaded from
+	 * the snapshot is kept if it was filled for this service.
+	 */
+	if (!cache_snapshot_ident ||
+			g_strcmp0(cache_snapshot_ident, default_ident) != 0)
+		cache_invalidate();
+	else
+		DBG("keeping the cache of %s", cache_snapshot_ident);
+
+	if (service) {
+		g_free(cache_snapshot_ident);
+		cache_snapshot_ident = NULL;
+	}
 
 	if (!service) {
 		/* When no services are active, then disable DNS proxying */
@@ -2868,10 +5093,9 @@ static struct connman_notifier dnsproxy_notifier = {
 	.offline_mode		= dnsproxy_offline_mode,
 };
 
-static unsigned char opt_edns0_type[2] = { 0x00, 0x29 };
-
 static int parse_request(unsigned char *buf, int len,
-					char *name, unsigned int size)
+					char *name, unsigned int size,
+					uint16_t *udp_size)
 {
 	struct domain_hdr *hdr = (void *) buf;
 	uint16_t qdcount = ntohs(hdr->qdcount);
@@ -2903,37 +5127,54 @@ static int parse_request(unsigned char *buf, int len,
 			break;
 		}
 
-		if (used + label_len + 1 > size)
+		if (used + label_len + 1 >= size || label_len + 1u > remain)
 			return -ENOBUFS;
 
-		strncat(name, (char *) (ptr + 1), label_len);
-		strcat(name, ".");
+		memcpy(name + used, ptr + 1, label_len);
+		name[used + label_len] = '.';
 
 		used += label_len + 1;
+		name[used] = '\0';
 
 		ptr += label_len + 1;
 		remain -= label_len + 1;
 	}
 
-	if (last_label && arcount && remain >= 9 && last_label[4] == 0 &&
-				!memcmp(last_label + 5, opt_edns0_type, 2)) {
-		uint16_t edns0_bufsize;
+	*udp_size = 0;
+
+	/*
+	 * Remember the payload size the client advertises in its OPT
+	 * record, and advertise our own size to the upstream servers.
+	 */
+	if (last_label && arcount) {
+		unsigned char *rr = (unsigned char *) last_label + 4;
+		unsigned char *end = buf + len;
+		int count = ntohs(hdr->ancount) + ntohs(hdr->nscount) +
+								arcount;
+
+		while (count-- > 0) {
+			int name_len = skip_name(rr, end);
+			uint16_t type, rdlen;
 
-		edns0_bufsize = last_label[7] << 8 | last_label[8];
+			if (name_len < 0 || rr + name_len + 10 > end)
+				break;
 
-		DBG("EDNS0 buffer size %u", edns0_bufsize);
+			type = rr[name_len] << 8 | rr[name_len + 1];
+			if (type == ns_t_opt && name_len == 1) {
+				unsigned char *class = rr + name_len + 2;
 
-		/* This is an evil hack until full TCP support has been
-		 * implemented.
-		 *
-		 * Somtimes the EDNS0 request gets send with a too-small
-		 * buffer size. Since glibc doesn't seem to crash when it
-		 * gets a response biffer then it requested, just bump
-		 * the buffer size up to 4KiB.
-		 */
-		if (edns0_bufsize < 0x1000) {
-			last_label[7] = 0x10;
-			last_label[8] = 0x00;
+				*udp_size = MAX(class[0] << 8 | class[1],
+							DNS_UDP_SIZE);
+
+				DBG("EDNS0 buffer size %u", *udp_size);
+
+				class[0] = edns0_size >> 8;
+				class[1] = edns0_size & 0xff;
+				break;
+			}
+
+			rdlen = rr[name_len + 8] << 8 | rr[name_len + 9];
+			rr += name_len + 10 + rdlen;
 		}
 	}
 
@@ -2942,6 +5183,31 @@ static int parse_request(unsigned char *buf, int len,
 	return 0;
 }
 
+/*
+ * Append an OPT record advertising our payload size to a query that
+ * has none, so that the upstream servers do not truncate the answers
+ * to 512 bytes. Returns the new length of the query.
+ */
+static int append_opt(unsigned char *buf, int len, int size)
+{
+	struct domain_hdr *hdr = (void *) buf;
+	unsigned char *rr = buf + len;
+
+	if (edns0_size <= DNS_UDP_SIZE || len + EDNS0_OPT_SIZE > size)
+		return len;
+
+	/* root name, type, payload size, extended rcode and flags, rdlen */
+	memset(rr, 0, EDNS0_OPT_SIZE);
+	rr[1] = ns_t_opt >> 8;
+	rr[2] = ns_t_opt & 0xff;
+	rr[3] = edns0_size >> 8;
+	rr[4] = edns0_size & 0xff;
+
+	hdr->arcount = htons(ntohs(hdr->arcount) + 1);
+
+	return len + EDNS0_OPT_SIZE;
+}
+
 static void client_reset(struct tcp_partial_client_data *client)
 {
 	if (!client)
@@ -2988,6 +5254,7 @@ static bool read_tcp_data(struct tcp_partial_client_data *client,
 	bool waiting_for_connect = false;
 	int qtype = 0;
 	struct cache_entry *entry;
+	uint16_t udp_size;
 
 	client_sk = g_io_channel_unix_get_fd(client->channel);
 
@@ -3028,7 +5295,7 @@ read_another:
 	DBG("client %d all data %d received", client_sk, msg_len);
 
 	err = parse_request(client->buf + 2, msg_len,
-			query, sizeof(query));
+			query, sizeof(query), &udp_size);
 	if (err < 0 || (g_slist_length(server_list) == 0)) {
 		send_response(client_sk, client->buf, msg_len + 2,
 			NULL, 0, IPPROTO_TCP);
@@ -3046,8 +5313,7 @@ read_another:
 	req->family = client->family;
 
 	req->srcid = client->buf[2] | (client->buf[3] << 8);
-	req->dstid = get_id();
-	req->altid = get_id();
+	request_set_ids(req);
 	req->request_len = msg_len + 2;
 
 	client->buf[2] = req->dstid & 0xff;
@@ -3074,11 +5340,13 @@ read_another:
 
 		if (data) {
 			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+			cache_hit(entry, qtype);
 
 			send_cached_response(client_sk, data->data,
 					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+					req->srcid, data->answers, ttl_left,
+					(char *) client->buf + 2 +
+					sizeof(struct domain_hdr), 0);
 
 			g_free(req);
 			goto out;
@@ -3086,32 +5354,10 @@ read_another:
 			DBG("data missing, ignoring cache for this query");
 	}
 
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
-
-		if (data->protocol != IPPROTO_UDP || !data->enabled)
-			continue;
-
-		if (!create_server(data->index, NULL, data->server,
-					IPPROTO_TCP))
-			continue;
-
-		waiting_for_connect = true;
-	}
-
-	if (!waiting_for_connect) {
-		/* No server is waiting for connect */
-		send_response(client_sk, client->buf,
-			req->request_len, NULL, 0, IPPROTO_TCP);
-		g_free(req);
-		return true;
-	}
-
 	/*
-	 * The server is not connected yet.
-	 * Copy the relevant buffers.
-	 * The request will actually be sent once we're
-	 * properly connected over TCP to the nameserver.
+	 * Copy the relevant buffers. The request is sent right away
+	 * on the connections that are already up, and by
+	 * tcp_server_event() once the others have connected.
 	 */
 	req->request = g_try_malloc0(req->request_len);
 	if (!req->request) {
@@ -3132,9 +5378,46 @@ read_another:
 	}
 	memcpy(req->name, query, sizeof(query));
 
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data, *server;
+
+		if (data->protocol != IPPROTO_UDP || !data->enabled)
+			continue;
+
+		server = tcp_server_get(data);
+		if (!server)
+			continue;
+
+		if (!server->connected) {
+			waiting_for_connect = true;
+			continue;
+		}
+
+		if (ns_send(server, req, req->request, req->name) < 0)
+			continue;
+
+		waiting_for_connect = true;
+		tcp_server_idle(server);
+	}
+
+	if (!waiting_for_connect) {
+		/* No server is connected or waiting for connect */
+		send_response(client_sk, client->buf,
+			req->request_len, NULL, 0, IPPROTO_TCP);
+		request_servers_free(req);
+		g_free(req->name);
+		g_free(req->request);
+		g_free(req);
+		return true;
+	}
+
 	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
 
-	request_list = g_slist_append(request_list, req);
+	request_add(req);
+
+	if (cache_get_stale(req))
+		req->stale_timeout = g_timeout_add(STALE_CLIENT_TIMEOUT,
+							stale_timeout, req);
 
 out:
 	if (client->buf_end > (msg_len + 2)) {
@@ -3412,84 +5695,134 @@ static gboolean tcp6_listener_event(GIOChannel *channel, GIOCondition condition,
 				&ifdata->tcp6_listener_watch);
 }
 
-static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
-				struct listener_data *ifdata, int family,
-				guint *listener_watch)
+static void udp_listener_request(int sk, struct listener_data *ifdata,
+				int family, unsigned char *buf, int len,
+				struct sockaddr *client_addr,
+				socklen_t client_addr_len)
 {
-	unsigned char buf[768];
 	char query[512];
 	struct request_data *req;
-	struct sockaddr_in6 client_addr6;
-	socklen_t client_addr6_len = sizeof(client_addr6);
-	struct sockaddr_in client_addr4;
-	socklen_t client_addr4_len = sizeof(client_addr4);
-	void *client_addr;
-	socklen_t *client_addr_len;
-	int sk, err, len;
-
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		*listener_watch = 0;
-		return false;
-	}
-
-	sk = g_io_channel_unix_get_fd(channel);
-
-	if (family == AF_INET) {
-		client_addr = &client_addr4;
-		client_addr_len = &client_addr4_len;
-	} else {
-		client_addr = &client_addr6;
-		client_addr_len = &client_addr6_len;
-	}
+	uint16_t udp_size;
+	int err;
 
-	memset(client_addr, 0, *client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, client_addr, client_addr_len);
 	if (len < 2)
-		return true;
+		return;
 
 	DBG("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
-	err = parse_request(buf, len, query, sizeof(query));
+	err = parse_request(buf, len, query, sizeof(query), &udp_size);
 	if (err < 0 || (g_slist_length(server_list) == 0)) {
 		send_response(sk, buf, len, client_addr,
-				*client_addr_len, IPPROTO_UDP);
-		return true;
+				client_addr_len, IPPROTO_UDP);
+		return;
 	}
 
+	if (udp_size == 0)
+		len = append_opt(buf, len, UDP_QUERY_BUF_SIZE);
+
 	req = g_try_new0(struct request_data, 1);
 	if (!req)
-		return true;
+		return;
 
-	memcpy(&req->sa, client_addr, *client_addr_len);
-	req->sa_len = *client_addr_len;
+	memcpy(&req->sa, client_addr, client_addr_len);
+	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
 	req->family = family;
 
 	req->srcid = buf[0] | (buf[1] << 8);
-	req->dstid = get_id();
-	req->altid = get_id();
 	req->request_len = len;
-
-	buf[0] = req->dstid & 0xff;
-	buf[1] = req->dstid >> 8;
+	req->udp_size = udp_size;
 
 	req->numserv = 0;
 	req->ifdata = ifdata;
 	req->append_domain = false;
 
+	/*
+	 * The client retransmitted a query that we are still resolving,
+	 * it gets the answer when the upstream server replies.
+	 */
+	if (g_hash_table_lookup(client_table, req)) {
+		DBG("id 0x%04x already pending", req->srcid);
+		g_free(req);
+		return;
+	}
+
+	if (request_join(req, buf))
+		return;
+
+	request_set_ids(req);
+
+	buf[0] = req->dstid & 0xff;
+	buf[1] = req->dstid >> 8;
+
 	if (resolv(req, buf, query)) {
 		/* a cached result was sent, so the request can be released */
 	        g_free(req);
-		return true;
+		return;
 	}
 
 	req->name = g_strdup(query);
 	req->request = g_malloc(len);
 	memcpy(req->request, buf, len);
 	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
-	request_list = g_slist_append(request_list, req);
+	request_add(req);
+
+	if (cache_get_stale(req))
+		req->stale_timeout = g_timeout_add(STALE_CLIENT_TIMEOUT,
+							stale_timeout, req);
+
+}
+
+static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
+				struct listener_data *ifdata, int family,
+				guint *listener_watch)
+{
+	static unsigned char bufs[UDP_BATCH_SIZE][UDP_QUERY_BUF_SIZE];
+	static struct sockaddr_in6 addrs[UDP_BATCH_SIZE];
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	socklen_t addr_len;
+	int sk, count, i;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		*listener_watch = 0;
+		return false;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	if (family == AF_INET)
+		addr_len = sizeof(struct sockaddr_in);
+	else
+		addr_len = sizeof(struct sockaddr_in6);
+
+	memset(msgs, 0, sizeof(msgs));
+	memset(addrs, 0, sizeof(addrs));
+
+	for (i = 0; i < UDP_BATCH_SIZE; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = sizeof(bufs[i]);
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = addr_len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	count = recvmmsg(sk, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (count <= 0)
+		return true;
+
+	udp_batch_begin();
+
+	for (i = 0; i < count; i++)
+		udp_listener_request(sk, ifdata, family, bufs[i],
+					msgs[i].msg_len,
+					(struct sockaddr *) &addrs[i],
+					msgs[i].msg_hdr.msg_namelen);
+
+	udp_batch_end();
 
 	return true;
 }
@@ -3570,7 +5903,7 @@ static GIOChannel *get_listener(int family, int protocol, int index)
 	if (family == AF_INET6) {
 		memset(&s.sin6, 0, sizeof(s.sin6));
 		s.sin6.sin6_family = AF_INET6;
-		s.sin6.sin6_port = htons(53);
+		s.sin6.sin6_port = htons(dns_listener_port);
 		slen = sizeof(s.sin6);
 
 		if (__connman_inet_get_interface_address(index,
@@ -3587,7 +5920,7 @@ static GIOChannel *get_listener(int family, int protocol, int index)
 	} else if (family == AF_INET) {
 		memset(&s.sin, 0, sizeof(s.sin));
 		s.sin.sin_family = AF_INET;
-		s.sin.sin_port = htons(53);
+		s.sin.sin_port = htons(dns_listener_port);
 		slen = sizeof(s.sin);
 
 		if (__connman_inet_get_interface_address(index,
@@ -3748,8 +6081,8 @@ static int create_listener(struct listener_data *ifdata)
 
 static void destroy_listener(struct listener_data *ifdata)
 {
+	struct request_data *req;
 	int index;
-	GSList *list;
 
 	index = connman_inet_ifindex("lo");
 	if (ifdata->index == index) {
@@ -3757,18 +6090,12 @@ static void destroy_listener(struct listener_data *ifdata)
 		__connman_resolvfile_remove(index, NULL, "::1");
 	}
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
-
+	while ((req = g_queue_peek_head(&request_queue))) {
 		DBG("Dropping request (id 0x%04x -> 0x%04x)",
 						req->srcid, req->dstid);
 		destroy_request_data(req);
-		list->data = NULL;
 	}
 
-	g_slist_free(request_list);
-	request_list = NULL;
-
 	destroy_tcp_listener(ifdata);
 	destroy_udp_listener(ifdata);
 }
@@ -3851,12 +6178,38 @@ static void free_partial_reqs(gpointer value)
 	g_free(data);
 }
 
+/*
+ * The ports can only be changed before __connman_dnsproxy_init().
+ * connmand always uses the standard port, the benchmark tool runs
+ * the proxy and its upstream stub on unprivileged ports instead.
+ */
+void __connman_dnsproxy_set_listen_port(unsigned int port)
+{
+	dns_listener_port = port;
+}
+
+void __connman_dnsproxy_set_server_port(unsigned int port)
+{
+	dns_server_port = port;
+}
+
 int __connman_dnsproxy_init(void)
 {
 	int err, index;
 
 	DBG("");
 
+	cache_max_bytes = connman_setting_get_uint("DNSProxyCacheSize");
+	cache_negative_max_bytes =
+		connman_setting_get_uint("DNSProxyNegativeCacheSize");
+	edns0_size = connman_setting_get_uint("DNSProxyEDNSBufferSize");
+	edns0_size = CLAMP(edns0_size, DNS_UDP_SIZE, EDNS0_MAX_SIZE);
+	cache_stale_time = connman_setting_get_uint("DNSProxyServeStale");
+	cache_prefetch_threshold =
+		connman_setting_get_uint("DNSProxyPrefetchThreshold");
+	cache_snapshot_enabled =
+		connman_setting_get_bool("DNSProxyCacheSnapshot");
+
 	listener_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, g_free);
 
@@ -3865,6 +6218,10 @@ int __connman_dnsproxy_init(void)
 							NULL,
 							free_partial_reqs);
 
+	request_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	client_table = g_hash_table_new(client_hash, client_equal);
+	question_table = g_hash_table_new(question_hash, question_equal);
+
 	index = connman_inet_ifindex("lo");
 	err = __connman_dnsproxy_add_listener(index);
 	if (err < 0)
@@ -3874,12 +6231,22 @@ int __connman_dnsproxy_init(void)
 	if (err < 0)
 		goto destroy;
 
+	if (cache_snapshot_enabled) {
+		cache_snapshot_load();
+		cache_snapshot_timer = g_timeout_add_seconds(
+						CACHE_SNAPSHOT_INTERVAL,
+						cache_snapshot_timeout, NULL);
+	}
+
 	return 0;
 
 destroy:
 	__connman_dnsproxy_remove_listener(index);
 	g_hash_table_destroy(listener_table);
 	g_hash_table_destroy(partial_tcp_req_table);
+	g_hash_table_destroy(request_table);
+	g_hash_table_destroy(client_table);
+	g_hash_table_destroy(question_table);
 
 	return err;
 }
@@ -3893,11 +6260,19 @@ void __connman_dnsproxy_cleanup(void)
 		cache_timer = 0;
 	}
 
-	if (cache) {
-		g_hash_table_destroy(cache);
-		cache = NULL;
+	if (cache_snapshot_timer) {
+		g_source_remove(cache_snapshot_timer);
+		cache_snapshot_timer = 0;
 	}
 
+	if (cache)
+		destroy_cache();
+
+	g_free(cache_snapshot_ident);
+	cache_snapshot_ident = NULL;
+	g_free(default_ident);
+	default_ident = NULL;
+
 	connman_notifier_unregister(&dnsproxy_notifier);
 
 	g_hash_table_foreach(listener_table, remove_listener, NULL);
@@ -3905,4 +6280,8 @@ void __connman_dnsproxy_cleanup(void)
 	g_hash_table_destroy(listener_table);
 
 	g_hash_table_destroy(partial_tcp_req_table);
+
+	g_hash_table_destroy(request_table);
+	g_hash_table_destroy(client_table);
+	g_hash_table_destroy(question_table);
 }
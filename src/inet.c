@@ -75,6 +75,405 @@ int __connman_inet_rtnl_addattr_l(struct nlmsghdr *n, size_t max_length,
 	return 0;
 }
 
+/*
+ * Route changes that nobody waits for go through one persistent
+ * netlink socket. The requests queued during one main loop iteration
+ * are sent together with a single sendmsg() and the acknowledgements
+ * are matched to the requests by their sequence number.
+ */
+#define RTNL_QUEUE_BATCH	64
+#define RTNL_QUEUE_RCVBUF	(256 * 1024)
+
+struct rtnl_queue_request {
+	guint32 seq;
+	int ignore_error;
+	connman_inet_route_cb_t callback;
+	void *user_data;
+	struct nlmsghdr *msg;
+};
+
+static int rtnl_queue_fd = -1;
+static guint rtnl_queue_watch;
+static guint rtnl_queue_idle;
+static guint32 rtnl_queue_seq;
+static GSList *rtnl_queue_pending;
+static GHashTable *rtnl_queue_sent;
+
+static void rtnl_queue_complete(struct rtnl_queue_request *req, int error)
+{
+	if (error == -req->ignore_error)
+		error = 0;
+
+	if (error < 0)
+		DBG("seq %u error %s", req->seq, strerror(-error));
+
+	if (req->callback)
+		req->callback(error, req->user_data);
+	else if (error < 0)
+		connman_error("Route change failed (%s)", strerror(-error));
+
+	g_free(req->msg);
+	g_free(req);
+}
+
+static void rtnl_queue_fail_sent(int error)
+{
+	GHashTableIter iter;
+	gpointer value;
+	GSList *list = NULL, *l;
+
+	g_hash_table_iter_init(&iter, rtnl_queue_sent);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		list = g_slist_prepend(list, value);
+		g_hash_table_iter_steal(&iter);
+	}
+
+	for (l = list; l; l = l->next)
+		rtnl_queue_complete(l->data, error);
+
+	g_slist_free(list);
+}
+
+static gboolean rtnl_queue_event(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	unsigned char buf[8192];
+	struct sockaddr_nl nladdr;
+	socklen_t addr_len;
+	ssize_t len;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR)) {
+		rtnl_queue_watch = 0;
+		rtnl_queue_fd = -1;
+		rtnl_queue_fail_sent(-EIO);
+		return FALSE;
+	}
+
+	while (1) {
+		struct nlmsghdr *hdr;
+
+		addr_len = sizeof(nladdr);
+		len = recvfrom(rtnl_queue_fd, buf, sizeof(buf), MSG_DONTWAIT,
+				(struct sockaddr *) &nladdr, &addr_len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* The acknowledgements are lost */
+			if (errno == ENOBUFS) {
+				connman_warn("Route change results lost");
+				rtnl_queue_fail_sent(-ENOBUFS);
+				continue;
+			}
+
+			break;
+		}
+
+		if (nladdr.nl_pid != 0)
+			continue;
+
+		for (hdr = (struct nlmsghdr *) buf; NLMSG_OK(hdr, len);
+					hdr = NLMSG_NEXT(hdr, len)) {
+			struct rtnl_queue_request *req;
+			struct nlmsgerr *err;
+
+			if (hdr->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			req = g_hash_table_lookup(rtnl_queue_sent,
+					GUINT_TO_POINTER(hdr->nlmsg_seq));
+			if (!req)
+				continue;
+
+			g_hash_table_steal(rtnl_queue_sent,
+					GUINT_TO_POINTER(hdr->nlmsg_seq));
+
+			err = NLMSG_DATA(hdr);
+			rtnl_queue_complete(req, err->error);
+		}
+	}
+
+	return TRUE;
+}
+
+static int rtnl_queue_open(void)
+{
+	struct sockaddr_nl addr;
+	GIOChannel *channel;
+	int fd, rcvbuf = RTNL_QUEUE_RCVBUF, one = 1;
+
+	if (rtnl_queue_fd >= 0)
+		return 0;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -errno;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef NETLINK_CAP_ACK
+	/* The acknowledgements do not need to carry the request */
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#endif
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		int err = -errno;
+
+		close(fd);
+		return err;
+	}
+
+	if (!rtnl_queue_sent)
+		rtnl_queue_sent = g_hash_table_new(g_direct_hash,
+							g_direct_equal);
+
+	channel = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	g_io_channel_set_encoding(channel, NULL, NULL);
+	g_io_channel_set_buffered(channel, FALSE);
+
+	rtnl_queue_watch = g_io_add_watch(channel,
+				G_IO_IN | G_IO_NVAL | G_IO_HUP | G_IO_ERR,
+				rtnl_queue_event, NULL);
+	g_io_channel_unref(channel);
+
+	rtnl_queue_fd = fd;
+	rtnl_queue_seq = time(NULL);
+
+	return 0;
+}
+
+/*
+ * Send everything that is queued. The kernel has applied the changes
+ * when this returns, so the synchronous route and address functions
+ * call it first to keep the order in which changes were made.
+ */
+static void rtnl_queue_flush(void)
+{
+	struct sockaddr_nl nladdr;
+
+	if (rtnl_queue_idle > 0) {
+		g_source_remove(rtnl_queue_idle);
+		rtnl_queue_idle = 0;
+	}
+
+	rtnl_queue_pending = g_slist_reverse(rtnl_queue_pending);
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	while (rtnl_queue_pending) {
+		struct rtnl_queue_request *batch[RTNL_QUEUE_BATCH];
+		struct iovec iov[RTNL_QUEUE_BATCH];
+		struct msghdr msg;
+		int i, count = 0, err = 0;
+
+		while (rtnl_queue_pending && count < RTNL_QUEUE_BATCH) {
+			struct rtnl_queue_request *req;
+
+			req = rtnl_queue_pending->data;
+			rtnl_queue_pending = g_slist_delete_link(
+					rtnl_queue_pending, rtnl_queue_pending);
+
+			iov[count].iov_base = req->msg;
+			iov[count].iov_len = req->msg->nlmsg_len;
+			batch[count++] = req;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &nladdr;
+		msg.msg_namelen = sizeof(nladdr);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		if (rtnl_queue_fd < 0)
+			err = -ENOTCONN;
+		else if (sendmsg(rtnl_queue_fd, &msg, 0) < 0)
+			err = -errno;
+
+		DBG("sent %d requests err %d", count, err);
+
+		for (i = 0; i < count; i++) {
+			if (err < 0) {
+				rtnl_queue_complete(batch[i], err);
+				continue;
+			}
+
+			g_hash_table_replace(rtnl_queue_sent,
+					GUINT_TO_POINTER(batch[i]->seq),
+					batch[i]);
+		}
+	}
+}
+
+static gboolean rtnl_queue_idle_cb(gpointer user_data)
+{
+	rtnl_queue_idle = 0;
+
+	rtnl_queue_flush();
+
+	return FALSE;
+}
+
+static int rtnl_queue_add(struct nlmsghdr *n, int ignore_error,
+				connman_inet_route_cb_t callback,
+				void *user_data)
+{
+	struct rtnl_queue_request *req;
+	int err;
+
+	err = rtnl_queue_open();
+	if (err < 0)
+		return err;
+
+	req = g_try_new0(struct rtnl_queue_request, 1);
+	if (!req)
+		return -ENOMEM;
+
+	req->msg = g_try_malloc(n->nlmsg_len);
+	if (!req->msg) {
+		g_free(req);
+		return -ENOMEM;
+	}
+
+	memcpy(req->msg, n, n->nlmsg_len);
+	req->msg->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+	req->msg->nlmsg_seq = req->seq = ++rtnl_queue_seq;
+	req->ignore_error = ignore_error;
+	req->callback = callback;
+	req->user_data = user_data;
+
+	rtnl_queue_pending = g_slist_prepend(rtnl_queue_pending, req);
+
+	if (rtnl_queue_idle == 0)
+		rtnl_queue_idle = g_idle_add(rtnl_queue_idle_cb, NULL);
+
+	return 0;
+}
+
+static int rtnl_queue_route(int cmd, int flags, int family, int index,
+				const char *host, const char *gateway,
+				unsigned char prefixlen, int ignore_error,
+				connman_inet_route_cb_t callback,
+				void *user_data)
+{
+	struct {
+		struct nlmsghdr n;
+		struct rtmsg rt;
+		char buf[128];
+	} req;
+	struct in6_addr addr;
+	size_t addr_len;
+	int err;
+
+	DBG("cmd %d family %d index %d host %s gateway %s prefixlen %u",
+		cmd, family, index, host, gateway, prefixlen);
+
+	if (!host || (family != AF_INET && family != AF_INET6))
+		return -EINVAL;
+
+	addr_len = family == AF_INET ? sizeof(struct in_addr) :
+						sizeof(struct in6_addr);
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.n.nlmsg_type = cmd;
+	req.n.nlmsg_flags = NLM_F_REQUEST | flags;
+	req.rt.rtm_family = family;
+	req.rt.rtm_dst_len = prefixlen;
+	req.rt.rtm_table = RT_TABLE_MAIN;
+	req.rt.rtm_protocol = RTPROT_BOOT;
+	req.rt.rtm_type = RTN_UNICAST;
+
+	if (cmd == RTM_DELROUTE)
+		req.rt.rtm_scope = RT_SCOPE_NOWHERE;
+	else if (gateway)
+		req.rt.rtm_scope = RT_SCOPE_UNIVERSE;
+	else
+		req.rt.rtm_scope = RT_SCOPE_LINK;
+
+	if (inet_pton(family, host, &addr) != 1)
+		return -EINVAL;
+
+	err = __connman_inet_rtnl_addattr_l(&req.n, sizeof(req), RTA_DST,
+							&addr, addr_len);
+	if (err < 0)
+		return err;
+
+	if (gateway) {
+		if (inet_pton(family, gateway, &addr) != 1)
+			return -EINVAL;
+
+		err = __connman_inet_rtnl_addattr_l(&req.n, sizeof(req),
+						RTA_GATEWAY, &addr, addr_len);
+		if (err < 0)
+			return err;
+	}
+
+	err = __connman_inet_rtnl_addattr32(&req.n, sizeof(req), RTA_OIF,
+								index);
+	if (err < 0)
+		return err;
+
+	/* Same metric as the routes added with the ioctl */
+	if (family == AF_INET6) {
+		err = __connman_inet_rtnl_addattr32(&req.n, sizeof(req),
+							RTA_PRIORITY, 1);
+		if (err < 0)
+			return err;
+	}
+
+	return rtnl_queue_add(&req.n, ignore_error, callback, user_data);
+}
+
+/**
+ * connman_inet_add_route_async:
+ * @family: AF_INET or AF_INET6
+ * @index: network device index
+ * @host: destination network
+ * @gateway: gateway or %NULL for a route on the link
+ * @prefixlen: prefix length of the destination
+ * @callback: result callback or %NULL to only log errors
+ * @user_data: callback data
+ *
+ * Queue adding a route. An existing route counts as success.
+ *
+ * Returns: %0 if the request was queued
+ */
+int connman_inet_add_route_async(int family, int index, const char *host,
+				const char *gateway, unsigned char prefixlen,
+				connman_inet_route_cb_t callback,
+				void *user_data)
+{
+	return rtnl_queue_route(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL,
+				family, index, host, gateway, prefixlen,
+				EEXIST, callback, user_data);
+}
+
+/**
+ * connman_inet_del_route_async:
+ * @family: AF_INET or AF_INET6
+ * @index: network device index
+ * @host: destination network
+ * @prefixlen: prefix length of the destination
+ * @callback: result callback or %NULL to only log errors
+ * @user_data: callback data
+ *
+ * Queue removing a route. A missing route counts as success.
+ *
+ * Returns: %0 if the request was queued
+ */
+int connman_inet_del_route_async(int family, int index, const char *host,
+				unsigned char prefixlen,
+				connman_inet_route_cb_t callback,
+				void *user_data)
+{
+	return rtnl_queue_route(RTM_DELROUTE, 0, family, index, host, NULL,
+				prefixlen, ESRCH, callback, user_data);
+}
+
 int __connman_inet_modify_address(int cmd, int flags,
 				int index, int family,
 				const char *address,
@@ -94,6 +493,8 @@ int __connman_inet_modify_address(int cmd, int flags,
 	struct in_addr ipv4_addr, ipv4_dest, ipv4_bcast;
 	int sk, err;
 
+	rtnl_queue_flush();
+
 	DBG("cmd %#x flags %#x index %d family %d address %s peer %s "
 		"prefixlen %hhu broadcast %s", cmd, flags, index, family,
 		address, peer, prefixlen, broadcast);
@@ -456,6 +857,8 @@ int connman_inet_add_network_route(int index, const char *host,
 	struct sockaddr_in addr;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d host %s gateway %s netmask %s", index,
 		host, gateway, netmask);
 
@@ -527,6 +930,8 @@ int connman_inet_del_network_route(int index, const char *host)
 	struct sockaddr_in addr;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d host %s", index, host);
 
 	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
@@ -575,6 +980,8 @@ int connman_inet_del_ipv6_network_route(int index, const char *host,
 	struct in6_rtmsg rt;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d host %s", index, host);
 
 	if (!host)
@@ -625,6 +1032,8 @@ int connman_inet_add_ipv6_network_route(int index, const char *host,
 	struct in6_rtmsg rt;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d host %s gateway %s", index, host, gateway);
 
 	if (!host)
@@ -679,6 +1088,8 @@ int connman_inet_clear_ipv6_gateway_address(int index, const char *gateway)
 	struct in6_rtmsg rt;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d gateway %s", index, gateway);
 
 	if (!gateway)
@@ -722,6 +1133,8 @@ int connman_inet_set_gateway_interface(int index)
 	struct sockaddr_in addr;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d", index);
 
 	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
@@ -775,6 +1188,8 @@ int connman_inet_set_ipv6_gateway_interface(int index)
 	const struct in6_addr any = IN6ADDR_ANY_INIT;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d", index);
 
 	sk = socket(PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
@@ -827,6 +1242,8 @@ int connman_inet_clear_gateway_address(int index, const char *gateway)
 	struct sockaddr_in addr;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d gateway %s", index, gateway);
 
 	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
@@ -884,6 +1301,8 @@ int connman_inet_clear_gateway_interface(int index)
 	struct sockaddr_in addr;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d", index);
 
 	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
@@ -937,6 +1356,8 @@ int connman_inet_clear_ipv6_gateway_interface(int index)
 	const struct in6_addr any = IN6ADDR_ANY_INIT;
 	int sk, err = 0;
 
+	rtnl_queue_flush();
+
 	DBG("index %d", index);
 
 	sk = socket(PF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
@@ -447,6 +447,45 @@ static void update_stats(struct connman_ipdevice *ipdevice,
 				ipdevice->rx_dropped, ipdevice->tx_dropped);
 }
 
+void __connman_ipconfig_update_stats(int index,
+					struct rtnl_link_stats *stats)
+{
+	struct connman_ipdevice *ipdevice;
+	char *ifname;
+
+	ipdevice = g_hash_table_lookup(ipdevice_hash, GINT_TO_POINTER(index));
+	if (!ipdevice)
+		return;
+
+	ifname = connman_inet_ifname(index);
+	update_stats(ipdevice, ifname, stats);
+	g_free(ifname);
+}
+
+/* Return the indexes of the interfaces whose counters go to a service */
+GSList *__connman_ipconfig_get_stats_indexes(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *list = NULL;
+
+	g_hash_table_iter_init(&iter, ipdevice_hash);
+
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct connman_ipdevice *ipdevice = value;
+
+		if (!ipdevice->config_ipv4 && !ipdevice->config_ipv6)
+			continue;
+
+		if (!__connman_service_lookup_from_index(ipdevice->index))
+			continue;
+
+		list = g_slist_prepend(list, key);
+	}
+
+	return list;
+}
+
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
@@ -584,7 +623,7 @@ void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
 		if (index != ipconfig->index)
 			continue;
 
-		ipconfig->index = -1;
+		__connman_ipconfig_set_index(ipconfig, -1);
 
 		if (!ipconfig->ops)
 			continue;
@@ -971,7 +1010,15 @@ const char *__connman_ipconfig_get_gateway_from_index(int index,
 
 void __connman_ipconfig_set_index(struct connman_ipconfig *ipconfig, int index)
 {
+	int old_index = ipconfig->index;
+
+	if (old_index == index)
+		return;
+
 	ipconfig->index = index;
+
+	if (ipconfig->ops && ipconfig->ops->index_changed)
+		ipconfig->ops->index_changed(ipconfig, old_index);
 }
 
 const char *__connman_ipconfig_get_local(struct connman_ipconfig *ipconfig)
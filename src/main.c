@@ -41,6 +41,11 @@
 
 #define DEFAULT_INPUT_REQUEST_TIMEOUT (120 * 1000)
 #define DEFAULT_BROWSER_LAUNCH_TIMEOUT (300 * 1000)
+#define DEFAULT_DNSPROXY_CACHE_SIZE (128 * 1024)
+#define DEFAULT_DNSPROXY_PREFETCH_THRESHOLD 10
+#define DEFAULT_DNSPROXY_NEGATIVE_CACHE_SIZE (16 * 1024)
+#define DEFAULT_DNSPROXY_EDNS_SIZE 1232
+#define DEFAULT_NETLINK_RCVBUF (1024 * 1024)
 
 #define MAINFILE "main.conf"
 #define CONFIGMAINFILE CONFIGDIR "/" MAINFILE
@@ -74,6 +79,14 @@ static struct {
 	char **tethering_technologies;
 	bool persistent_tethering_mode;
 	bool enable_6to4;
+	unsigned int dnsproxy_cache_size;
+	unsigned int dnsproxy_serve_stale;
+	unsigned int dnsproxy_prefetch_threshold;
+	unsigned int dnsproxy_negative_cache_size;
+	bool dnsproxy_cache_snapshot;
+	unsigned int dnsproxy_edns_size;
+	unsigned int stats_flush_interval;
+	unsigned int netlink_rcvbuf;
 } connman_settings  = {
 	.bg_scan = true,
 	.pref_timeservers = NULL,
@@ -88,6 +101,14 @@ static struct {
 	.tethering_technologies = NULL,
 	.persistent_tethering_mode = false,
 	.enable_6to4 = false,
+	.dnsproxy_cache_size = DEFAULT_DNSPROXY_CACHE_SIZE,
+	.dnsproxy_serve_stale = 0,
+	.dnsproxy_prefetch_threshold = DEFAULT_DNSPROXY_PREFETCH_THRESHOLD,
+	.dnsproxy_negative_cache_size = DEFAULT_DNSPROXY_NEGATIVE_CACHE_SIZE,
+	.dnsproxy_cache_snapshot = false,
+	.dnsproxy_edns_size = DEFAULT_DNSPROXY_EDNS_SIZE,
+	.stats_flush_interval = 0,
+	.netlink_rcvbuf = DEFAULT_NETLINK_RCVBUF,
 };
 
 #define CONF_BG_SCAN                    "BackgroundScanning"
@@ -103,6 +124,14 @@ static struct {
 #define CONF_TETHERING_TECHNOLOGIES      "TetheringTechnologies"
 #define CONF_PERSISTENT_TETHERING_MODE  "PersistentTetheringMode"
 #define CONF_ENABLE_6TO4                "Enable6to4"
+#define CONF_DNSPROXY_CACHE_SIZE        "DNSProxyCacheSize"
+#define CONF_DNSPROXY_SERVE_STALE       "DNSProxyServeStale"
+#define CONF_DNSPROXY_PREFETCH          "DNSProxyPrefetchThreshold"
+#define CONF_DNSPROXY_NEGATIVE_CACHE    "DNSProxyNegativeCacheSize"
+#define CONF_DNSPROXY_CACHE_SNAPSHOT    "DNSProxyCacheSnapshot"
+#define CONF_DNSPROXY_EDNS_SIZE         "DNSProxyEDNSBufferSize"
+#define CONF_STATS_FLUSH_INTERVAL       "StatisticsFlushInterval"
+#define CONF_NETLINK_RCVBUF             "NetlinkReceiveBuffer"
 
 static const char *supported_options[] = {
 	CONF_BG_SCAN,
@@ -118,6 +147,14 @@ static const char *supported_options[] = {
 	CONF_TETHERING_TECHNOLOGIES,
 	CONF_PERSISTENT_TETHERING_MODE,
 	CONF_ENABLE_6TO4,
+	CONF_DNSPROXY_CACHE_SIZE,
+	CONF_DNSPROXY_SERVE_STALE,
+	CONF_DNSPROXY_PREFETCH,
+	CONF_DNSPROXY_NEGATIVE_CACHE,
+	CONF_DNSPROXY_CACHE_SNAPSHOT,
+	CONF_DNSPROXY_EDNS_SIZE,
+	CONF_STATS_FLUSH_INTERVAL,
+	CONF_NETLINK_RCVBUF,
 	NULL
 };
 
@@ -242,6 +279,7 @@ static void parse_config(GKeyFile *config)
 	char **tethering;
 	gsize len;
 	int timeout;
+	int size;
 
 	if (!config) {
 		connman_settings.auto_connect =
@@ -365,6 +403,62 @@ static void parse_config(GKeyFile *config)
 		connman_settings.enable_6to4 = boolean;
 
 	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_CACHE_SIZE, &error);
+	if (!error && size >= 0)
+		connman_settings.dnsproxy_cache_size = size;
+
+	g_clear_error(&error);
+
+	timeout = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_SERVE_STALE, &error);
+	if (!error && timeout >= 0)
+		connman_settings.dnsproxy_serve_stale = timeout;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_PREFETCH, &error);
+	if (!error && size >= 0 && size <= 100)
+		connman_settings.dnsproxy_prefetch_threshold = size;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_NEGATIVE_CACHE, &error);
+	if (!error && size >= 0)
+		connman_settings.dnsproxy_negative_cache_size = size;
+
+	g_clear_error(&error);
+
+	boolean = __connman_config_get_bool(config, "General",
+					CONF_DNSPROXY_CACHE_SNAPSHOT, &error);
+	if (!error)
+		connman_settings.dnsproxy_cache_snapshot = boolean;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_DNSPROXY_EDNS_SIZE, &error);
+	if (!error && size >= 512 && size <= 4096)
+		connman_settings.dnsproxy_edns_size = size;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_STATS_FLUSH_INTERVAL, &error);
+	if (!error && size >= 0)
+		connman_settings.stats_flush_interval = size;
+
+	g_clear_error(&error);
+
+	size = g_key_file_get_integer(config, "General",
+			CONF_NETLINK_RCVBUF, &error);
+	if (!error && size >= 0)
+		connman_settings.netlink_rcvbuf = size;
+
+	g_clear_error(&error);
 }
 
 static int config_init(const char *file)
@@ -542,6 +636,9 @@ bool connman_setting_get_bool(const char *key)
 	if (g_str_equal(key, CONF_ENABLE_6TO4))
 		return connman_settings.enable_6to4;
 
+	if (g_str_equal(key, CONF_DNSPROXY_CACHE_SNAPSHOT))
+		return connman_settings.dnsproxy_cache_snapshot;
+
 	return false;
 }
 
@@ -562,6 +659,32 @@ char **connman_setting_get_string_list(const char *key)
 	return NULL;
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, CONF_DNSPROXY_CACHE_SIZE))
+		return connman_settings.dnsproxy_cache_size;
+
+	if (g_str_equal(key, CONF_DNSPROXY_SERVE_STALE))
+		return connman_settings.dnsproxy_serve_stale;
+
+	if (g_str_equal(key, CONF_DNSPROXY_PREFETCH))
+		return connman_settings.dnsproxy_prefetch_threshold;
+
+	if (g_str_equal(key, CONF_DNSPROXY_NEGATIVE_CACHE))
+		return connman_settings.dnsproxy_negative_cache_size;
+
+	if (g_str_equal(key, CONF_DNSPROXY_EDNS_SIZE))
+		return connman_settings.dnsproxy_edns_size;
+
+	if (g_str_equal(key, CONF_STATS_FLUSH_INTERVAL))
+		return connman_settings.stats_flush_interval;
+
+	if (g_str_equal(key, CONF_NETLINK_RCVBUF))
+		return connman_settings.netlink_rcvbuf;
+
+	return 0;
+}
+
 unsigned int *connman_setting_get_uint_list(const char *key)
 {
 	if (g_str_equal(key, CONF_AUTO_CONNECT))
@@ -655,6 +778,7 @@ int main(int argc, char *argv[])
 
 	__connman_util_init();
 	__connman_inotify_init();
+	__connman_trace_init();
 	__connman_technology_init();
 	__connman_notifier_init();
 	__connman_agent_init();
@@ -742,6 +866,7 @@ int main(int argc, char *argv[])
 	__connman_ipconfig_cleanup();
 	__connman_notifier_cleanup();
 	__connman_technology_cleanup();
+	__connman_trace_cleanup();
 	__connman_inotify_cleanup();
 
 	__connman_util_cleanup();
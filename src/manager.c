@@ -24,6 +24,7 @@
 #endif
 
 #include <errno.h>
+#include <unistd.h>
 
 #include <gdbus.h>
 
@@ -195,6 +196,62 @@ static DBusMessage *get_services(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *get_nameserver_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	__connman_dnsproxy_append_server_stats(&array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
+static DBusMessage *get_connect_trace(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	__connman_trace_append(&array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
 static void append_peer_structs(DBusMessageIter *iter, void *user_data)
 {
 	__connman_peer_list_struct(iter);
@@ -313,6 +370,50 @@ static DBusMessage *unregister_counter(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static DBusMessage *open_counter_memory(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	const char *sender;
+	unsigned int period;
+	int fd;
+
+	DBG("conn %p", conn);
+
+	sender = dbus_message_get_sender(msg);
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT32, &period,
+							DBUS_TYPE_INVALID))
+		return __connman_error_invalid_arguments(msg);
+
+	fd = __connman_counter_memory_open(sender, period);
+	if (fd < 0)
+		return __connman_error_failed(msg, -fd);
+
+	reply = g_dbus_create_reply(msg, DBUS_TYPE_UNIX_FD, &fd,
+							DBUS_TYPE_INVALID);
+	close(fd);
+
+	return reply;
+}
+
+static DBusMessage *close_counter_memory(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *sender;
+	int err;
+
+	DBG("conn %p", conn);
+
+	sender = dbus_message_get_sender(msg);
+
+	err = __connman_counter_memory_close(sender);
+	if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
 static DBusMessage *create_session(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -519,6 +620,12 @@ static const GDBusMethodTable manager_methods[] = {
 	{ GDBUS_METHOD("GetPeers",
 			NULL, GDBUS_ARGS({ "peers", "a(oa{sv})" }),
 			get_peers) },
+	{ GDBUS_EXPERIMENTAL_METHOD("GetNameserverStatistics",
+			NULL, GDBUS_ARGS({ "nameservers", "a(sa{sv})" }),
+			get_nameserver_statistics) },
+	{ GDBUS_EXPERIMENTAL_METHOD("GetConnectTrace",
+			NULL, GDBUS_ARGS({ "trace", "a(sa{sv})" }),
+			get_connect_trace) },
 	{ GDBUS_DEPRECATED_ASYNC_METHOD("ConnectProvider",
 			      GDBUS_ARGS({ "provider", "a{sv}" }),
 			      GDBUS_ARGS({ "path", "o" }),
@@ -536,6 +643,12 @@ static const GDBusMethodTable manager_methods[] = {
 	{ GDBUS_METHOD("UnregisterCounter",
 			GDBUS_ARGS({ "path", "o" }), NULL,
 			unregister_counter) },
+	{ GDBUS_EXPERIMENTAL_METHOD("OpenCounterMemory",
+			GDBUS_ARGS({ "period", "u" }),
+			GDBUS_ARGS({ "memory", "h" }),
+			open_counter_memory) },
+	{ GDBUS_EXPERIMENTAL_METHOD("CloseCounterMemory", NULL, NULL,
+			close_counter_memory) },
 	{ GDBUS_ASYNC_METHOD("CreateSession",
 			GDBUS_ARGS({ "settings", "a{sv}" },
 						{ "notifier", "o" }),
@@ -23,6 +23,7 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -36,6 +37,7 @@
 #include <linux/if.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/if_link.h>
 #include <linux/wireless.h>
 
 #include <glib.h>
@@ -46,6 +48,10 @@
 #define ARPHDR_PHONET_PIPE (821)
 #endif
 
+#define RTNL_BATCH_SIZE		8
+#define RTNL_BUFFER_SIZE	8192
+#define RTNL_MAX_BATCHES	8
+
 #define print(arg...) do { if (0) connman_info(arg); } while (0)
 //#define print(arg...) connman_info(arg)
 
@@ -56,22 +62,56 @@ struct watch_data {
 	void *user_data;
 };
 
-static GSList *watch_list = NULL;
+/* Lists of watches keyed by the interface index */
+static GHashTable *watch_table = NULL;
 static unsigned int watch_id = 0;
 
+struct update_data {
+	unsigned int id;
+	unsigned int interval;
+	gint64 deadline;
+	__connman_rtnl_update_cb_t callback;
+	void *user_data;
+};
+
 static GSList *update_list = NULL;
-static guint update_interval = G_MAXUINT;
+static unsigned int update_id = 0;
 static guint update_timeout = 0;
+static bool getstats_supported = true;
 
 struct interface_data {
 	int index;
 	char *ident;
 	enum connman_service_type service_type;
 	enum connman_device_type device_type;
+
+	/* link attributes of the last RTM_NEWLINK */
+	bool link_valid;
+	unsigned short type;
+	unsigned int flags;
+	unsigned int mtu;
+	unsigned char operstate;
+	struct ether_addr address;
+	char ifname[IFNAMSIZ];
 };
 
 static GHashTable *interface_list = NULL;
 
+static void free_watch(gpointer data)
+{
+	struct watch_data *watch = data;
+
+	DBG("removing watch %d", watch->id);
+
+	g_free(watch);
+}
+
+static void free_watch_list(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	g_slist_free_full(value, free_watch);
+}
+
 static void free_interface(gpointer data)
 {
 	struct interface_data *interface = data;
@@ -223,6 +263,7 @@ unsigned int connman_rtnl_add_newlink_watch(int index,
 			connman_rtnl_link_cb_t callback, void *user_data)
 {
 	struct watch_data *watch;
+	GSList *list;
 
 	watch = g_try_new0(struct watch_data, 1);
 	if (!watch)
@@ -234,7 +275,9 @@ unsigned int connman_rtnl_add_newlink_watch(int index,
 	watch->newlink = callback;
 	watch->user_data = user_data;
 
-	watch_list = g_slist_prepend(watch_list, watch);
+	list = g_hash_table_lookup(watch_table, GINT_TO_POINTER(index));
+	list = g_slist_prepend(list, watch);
+	g_hash_table_replace(watch_table, GINT_TO_POINTER(index), list);
 
 	DBG("id %d", watch->id);
 
@@ -256,6 +299,8 @@ unsigned int connman_rtnl_add_newlink_watch(int index,
  */
 void connman_rtnl_remove_watch(unsigned int id)
 {
+	GHashTableIter iter;
+	gpointer key, value;
 	GSList *list;
 
 	DBG("id %d", id);
@@ -263,13 +308,24 @@ void connman_rtnl_remove_watch(unsigned int id)
 	if (id == 0)
 		return;
 
-	for (list = watch_list; list; list = list->next) {
-		struct watch_data *watch = list->data;
+	g_hash_table_iter_init(&iter, watch_table);
+
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		for (list = value; list; list = list->next) {
+			struct watch_data *watch = list->data;
 
-		if (watch->id  == id) {
-			watch_list = g_slist_remove(watch_list, watch);
+			if (watch->id != id)
+				continue;
+
+			value = g_slist_remove(value, watch);
 			g_free(watch);
-			break;
+
+			if (value)
+				g_hash_table_iter_replace(&iter, value);
+			else
+				g_hash_table_iter_remove(&iter);
+
+			return;
 		}
 	}
 }
@@ -401,6 +457,30 @@ static bool extract_link(struct ifinfomsg *msg, int bytes,
 	return true;
 }
 
+/*
+ * The kernel sends RTM_NEWLINK for many reasons, such as statistics
+ * dumps, without anything relevant having changed.
+ */
+static bool link_unchanged(struct interface_data *interface,
+				unsigned short type, unsigned flags,
+				unsigned change, struct ether_addr *address,
+				const char *ifname, unsigned int mtu,
+				unsigned char operstate)
+{
+	if (!interface->link_valid || change != 0)
+		return false;
+
+	if (interface->type != type || interface->flags != flags ||
+			interface->mtu != mtu ||
+			interface->operstate != operstate)
+		return false;
+
+	if (memcmp(&interface->address, address, sizeof(*address)) != 0)
+		return false;
+
+	return g_strcmp0(interface->ifname, ifname ? ifname : "") == 0;
+}
+
 static void process_newlink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
@@ -411,12 +491,21 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 	const char *ifname = NULL;
 	unsigned int mtu = 0;
 	char ident[13], str[18];
+	bool added = false;
 	GSList *list;
 
 	memset(&stats, 0, sizeof(stats));
 	if (!extract_link(msg, bytes, &address, &ifname, &mtu, &operstate, &stats))
 		return;
 
+	interface = g_hash_table_lookup(interface_list, GINT_TO_POINTER(index));
+	if (interface && link_unchanged(interface, type, flags, change,
+					&address, ifname, mtu, operstate)) {
+		/* Only the counters can be new */
+		__connman_ipconfig_update_stats(index, &stats);
+		return;
+	}
+
 	snprintf(ident, 13, "%02x%02x%02x%02x%02x%02x",
 						address.ether_addr_octet[0],
 						address.ether_addr_octet[1],
@@ -458,7 +547,6 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 						ifname, index, operstate,
 						operstate2str(operstate));
 
-	interface = g_hash_table_lookup(interface_list, GINT_TO_POINTER(index));
 	if (!interface) {
 		interface = g_new0(struct interface_data, 1);
 		interface->index = index;
@@ -469,8 +557,18 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 
 		if (type == ARPHRD_ETHER)
 			read_uevent(interface);
-	} else
-		interface = NULL;
+
+		added = true;
+	}
+
+	interface->link_valid = true;
+	interface->type = type;
+	interface->flags = flags;
+	interface->mtu = mtu;
+	interface->operstate = operstate;
+	memcpy(&interface->address, &address, sizeof(address));
+	g_strlcpy(interface->ifname, ifname ? ifname : "",
+					sizeof(interface->ifname));
 
 	for (list = rtnl_list; list; list = list->next) {
 		struct connman_rtnl *rtnl = list->data;
@@ -485,15 +583,16 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 	 * __connman_technology_add_interface() expects the
 	 * technology to be there already.
 	 */
-	if (interface)
+	if (added)
 		__connman_technology_add_interface(interface->service_type,
 			interface->index, interface->ident);
 
-	for (list = watch_list; list; list = list->next) {
+	list = g_hash_table_lookup(watch_table, GINT_TO_POINTER(index));
+	while (list) {
 		struct watch_data *watch = list->data;
 
-		if (watch->index != index)
-			continue;
+		/* The callback might remove its own watch */
+		list = list->next;
 
 		if (watch->newlink)
 			watch->newlink(flags, change, watch->user_data);
@@ -1260,6 +1359,45 @@ static void rtnl_newnduseropt(struct nlmsghdr *hdr)
 	g_free(domains);
 }
 
+static void rtnl_newstats(struct nlmsghdr *hdr)
+{
+	struct if_stats_msg *msg = NLMSG_DATA(hdr);
+	struct rtnl_link_stats64 stats64;
+	struct rtnl_link_stats stats;
+	struct rtattr *attr;
+	bool found = false;
+	int bytes;
+
+	bytes = hdr->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+
+	for (attr = (struct rtattr *) ((char *) msg +
+					NLMSG_ALIGN(sizeof(*msg)));
+			RTA_OK(attr, bytes); attr = RTA_NEXT(attr, bytes)) {
+		if (attr->rta_type != IFLA_STATS_LINK_64 ||
+				RTA_PAYLOAD(attr) < sizeof(stats64))
+			continue;
+
+		/* the attribute is only 4 byte aligned */
+		memcpy(&stats64, RTA_DATA(attr), sizeof(stats64));
+		found = true;
+	}
+
+	if (!found)
+		return;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.rx_packets = stats64.rx_packets;
+	stats.tx_packets = stats64.tx_packets;
+	stats.rx_bytes = stats64.rx_bytes;
+	stats.tx_bytes = stats64.tx_bytes;
+	stats.rx_errors = stats64.rx_errors;
+	stats.tx_errors = stats64.tx_errors;
+	stats.rx_dropped = stats64.rx_dropped;
+	stats.tx_dropped = stats64.tx_dropped;
+
+	__connman_ipconfig_update_stats(msg->ifindex, &stats);
+}
+
 static const char *type2string(uint16_t type)
 {
 	switch (type) {
@@ -1291,6 +1429,10 @@ static const char *type2string(uint16_t type)
 		return "DELROUTE";
 	case RTM_NEWNDUSEROPT:
 		return "NEWNDUSEROPT";
+	case RTM_NEWSTATS:
+		return "NEWSTATS";
+	case RTM_GETSTATS:
+		return "GETSTATS";
 	default:
 		return "UNKNOWN";
 	}
@@ -1301,9 +1443,13 @@ static guint channel_watch = 0;
 
 struct rtnl_request {
 	struct nlmsghdr hdr;
-	struct rtgenmsg msg;
+	union {
+		struct rtgenmsg msg;
+		struct if_stats_msg stats;
+	};
 };
 #define RTNL_REQUEST_SIZE  (sizeof(struct nlmsghdr) + sizeof(struct rtgenmsg))
+#define RTNL_STATS_REQUEST_SIZE  NLMSG_LENGTH(sizeof(struct if_stats_msg))
 
 static GSList *request_list = NULL;
 static guint32 request_seq = 0;
@@ -1351,6 +1497,24 @@ static int queue_request(struct rtnl_request *req)
 	return send_request(req);
 }
 
+static struct rtnl_request *find_stats_request(int index)
+{
+	GSList *list;
+
+	for (list = request_list; list; list = list->next) {
+		struct rtnl_request *req = list->data;
+
+		if (req->hdr.nlmsg_type == RTM_GETSTATS &&
+				req->stats.ifindex == (guint32) index)
+			return req;
+	}
+
+	return NULL;
+}
+
+static int send_getlink(void);
+static void rtnl_resync(void);
+
 static int process_response(guint32 seq)
 {
 	struct rtnl_request *req;
@@ -1370,6 +1534,52 @@ static int process_response(guint32 seq)
 	return send_request(req);
 }
 
+static void drop_stats_requests(struct rtnl_request *keep)
+{
+	GSList *list = request_list;
+
+	while (list) {
+		struct rtnl_request *req = list->data;
+
+		list = list->next;
+
+		if (req == keep || req->hdr.nlmsg_type != RTM_GETSTATS)
+			continue;
+
+		request_list = g_slist_remove(request_list, req);
+		g_free(req);
+	}
+}
+
+/*
+ * Requests without NLM_F_DUMP are completed by an error message, which
+ * is an acknowledgement if the error is 0.
+ */
+static void process_error(guint32 seq, int error)
+{
+	struct rtnl_request *req;
+	bool fallback = false;
+
+	req = find_request(seq);
+	if (!req)
+		return;
+
+	if (getstats_supported && req->hdr.nlmsg_type == RTM_GETSTATS &&
+			(error == -EOPNOTSUPP || error == -EINVAL)) {
+		DBG("RTM_GETSTATS not supported, using RTM_GETLINK");
+		getstats_supported = false;
+		fallback = true;
+
+		/* One link dump covers the other queued interfaces too */
+		drop_stats_requests(req);
+	}
+
+	process_response(seq);
+
+	if (fallback)
+		send_getlink();
+}
+
 static void rtnl_message(void *buf, size_t len)
 {
 	DBG("buf %p len %zd", buf, len);
@@ -1389,7 +1599,9 @@ static void rtnl_message(void *buf, size_t len)
 
 		switch (hdr->nlmsg_type) {
 		case NLMSG_NOOP:
+			return;
 		case NLMSG_OVERRUN:
+			rtnl_resync();
 			return;
 		case NLMSG_DONE:
 			process_response(hdr->nlmsg_seq);
@@ -1398,6 +1610,7 @@ static void rtnl_message(void *buf, size_t len)
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+			process_error(hdr->nlmsg_seq, err->error);
 			return;
 		case RTM_NEWLINK:
 			rtnl_newlink(hdr);
@@ -1420,6 +1633,9 @@ static void rtnl_message(void *buf, size_t len)
 		case RTM_NEWNDUSEROPT:
 			rtnl_newnduseropt(hdr);
 			break;
+		case RTM_NEWSTATS:
+			rtnl_newstats(hdr);
+			break;
 		}
 
 		len -= hdr->nlmsg_len;
@@ -1427,40 +1643,82 @@ static void rtnl_message(void *buf, size_t len)
 	}
 }
 
+/*
+ * Drain the socket in batches of datagrams, but give the main loop a
+ * chance after RTNL_MAX_BATCHES of them. Lost messages are made up for
+ * by dumping the links, addresses and routes again.
+ */
 static gboolean netlink_event(GIOChannel *chan, GIOCondition cond, gpointer data)
 {
-	unsigned char buf[4096];
-	struct sockaddr_nl nladdr;
-	socklen_t addr_len = sizeof(nladdr);
-	ssize_t status;
-	int fd;
+	static unsigned char buf[RTNL_BATCH_SIZE][RTNL_BUFFER_SIZE];
+	struct sockaddr_nl nladdr[RTNL_BATCH_SIZE];
+	struct mmsghdr msgs[RTNL_BATCH_SIZE];
+	struct iovec iov[RTNL_BATCH_SIZE];
+	int fd, i, n, batches = 0;
 
 	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
 		return FALSE;
 
-	memset(buf, 0, sizeof(buf));
-	memset(&nladdr, 0, sizeof(nladdr));
-
 	fd = g_io_channel_unix_get_fd(chan);
 
-	status = recvfrom(fd, buf, sizeof(buf), 0,
-                       (struct sockaddr *) &nladdr, &addr_len);
-	if (status < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			return TRUE;
+	while (batches < RTNL_MAX_BATCHES) {
+		memset(msgs, 0, sizeof(msgs));
+		memset(nladdr, 0, sizeof(nladdr));
+
+		for (i = 0; i < RTNL_BATCH_SIZE; i++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len = RTNL_BUFFER_SIZE;
+			msgs[i].msg_hdr.msg_name = &nladdr[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(nladdr[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-		return FALSE;
-	}
+		n = recvmmsg(fd, msgs, RTNL_BATCH_SIZE, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 
-	if (status == 0)
-		return FALSE;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 
-	if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
-		DBG("Received msg from %u, ignoring it", nladdr.nl_pid);
-		return TRUE;
-	}
+			if (errno == ENOBUFS) {
+				connman_warn("netlink receive buffer overrun");
+				rtnl_resync();
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		if (n == 0)
+			return FALSE;
 
-	rtnl_message(buf, status);
+		for (i = 0; i < n; i++) {
+			if (msgs[i].msg_len == 0)
+				return FALSE;
+
+			/* not sent by kernel, ignore */
+			if (nladdr[i].nl_pid != 0) {
+				DBG("Received msg from %u, ignoring it",
+							nladdr[i].nl_pid);
+				continue;
+			}
+
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				connman_warn("netlink message truncated");
+				rtnl_resync();
+				continue;
+			}
+
+			rtnl_message(buf[i], msgs[i].msg_len);
+		}
+
+		if (n < RTNL_BATCH_SIZE)
+			break;
+
+		batches++;
+	}
 
 	return TRUE;
 }
@@ -1525,85 +1783,240 @@ static int send_getroute(void)
 	return queue_request(req);
 }
 
-static gboolean update_timeout_cb(gpointer user_data)
+static bool dump_pending(uint16_t type)
 {
-	__connman_rtnl_request_update();
+	GSList *list;
 
-	return TRUE;
+	for (list = request_list; list; list = list->next) {
+		struct rtnl_request *req = list->data;
+
+		if (req->hdr.nlmsg_type == type &&
+				req->hdr.nlmsg_flags & NLM_F_DUMP)
+			return true;
+	}
+
+	return false;
 }
 
-static void update_interval_callback(guint min)
+/*
+ * The request queue sends one request at a time, so the links are
+ * known again before the addresses and the routes are dumped.
+ */
+static void rtnl_resync(void)
 {
-	if (update_timeout > 0)
-		g_source_remove(update_timeout);
+	DBG("");
 
-	if (min < G_MAXUINT) {
-		update_interval = min;
-		update_timeout = g_timeout_add_seconds(update_interval,
-						update_timeout_cb, NULL);
-	} else {
+	if (!dump_pending(RTM_GETLINK))
+		send_getlink();
+
+	if (!dump_pending(RTM_GETADDR))
+		send_getaddr();
+
+	if (!dump_pending(RTM_GETROUTE))
+		send_getroute();
+}
+
+static int send_getstats(int index)
+{
+	struct rtnl_request *req;
+
+	DBG("index %d", index);
+
+	req = g_try_malloc0(sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+
+	req->hdr.nlmsg_len = RTNL_STATS_REQUEST_SIZE;
+	req->hdr.nlmsg_type = RTM_GETSTATS;
+	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req->hdr.nlmsg_pid = 0;
+	req->hdr.nlmsg_seq = request_seq++;
+	req->stats.family = AF_UNSPEC;
+	req->stats.ifindex = index;
+	req->stats.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+
+	return queue_request(req);
+}
+
+static gint64 monotonic_seconds(void)
+{
+	return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+/*
+ * Deadlines are multiples of the interval, so that the updates of
+ * different intervals fall on the same second whenever possible. The
+ * updates without an interval are kept at the end of the list.
+ */
+static gint compare_deadline(gconstpointer a, gconstpointer b)
+{
+	const struct update_data *update_a = a;
+	const struct update_data *update_b = b;
+
+	if (update_a->interval == 0 || update_b->interval == 0)
+		return (update_a->interval == 0) - (update_b->interval == 0);
+
+	if (update_a->deadline < update_b->deadline)
+		return -1;
+
+	return update_a->deadline > update_b->deadline;
+}
+
+static gint64 next_deadline(unsigned int interval, gint64 now)
+{
+	return (now / interval + 1) * interval;
+}
+
+static gboolean update_timeout_cb(gpointer user_data);
+
+static void schedule_update(void)
+{
+	struct update_data *update;
+	gint64 now;
+
+	if (update_timeout > 0) {
+		g_source_remove(update_timeout);
 		update_timeout = 0;
-		update_interval = G_MAXUINT;
 	}
+
+	update = g_slist_nth_data(update_list, 0);
+	if (!update || update->interval == 0)
+		return;
+
+	now = monotonic_seconds();
+
+	update_timeout = g_timeout_add_seconds(update->deadline > now ?
+						update->deadline - now : 0,
+						update_timeout_cb, NULL);
 }
 
-static gint compare_interval(gconstpointer a, gconstpointer b)
+/*
+ * All updates whose deadline has passed are handled by one request for
+ * the statistics. The ones without an interval get every update.
+ */
+static gboolean update_timeout_cb(gpointer user_data)
 {
-	guint val_a = GPOINTER_TO_UINT(a);
-	guint val_b = GPOINTER_TO_UINT(b);
+	gint64 now = monotonic_seconds();
+	GSList *list;
 
-	return val_a - val_b;
+	update_timeout = 0;
+
+	for (list = update_list; list; list = list->next) {
+		struct update_data *update = list->data;
+
+		if (update->interval > 0) {
+			if (update->deadline > now)
+				continue;
+
+			update->deadline = next_deadline(update->interval,
+									now);
+		}
+
+		update->callback(update->user_data);
+	}
+
+	update_list = g_slist_sort(update_list, compare_deadline);
+
+	__connman_rtnl_request_update();
+
+	schedule_update();
+
+	return FALSE;
 }
 
-unsigned int __connman_rtnl_update_interval_add(unsigned int interval)
+unsigned int __connman_rtnl_update_add(unsigned int interval,
+					__connman_rtnl_update_cb_t callback,
+					void *user_data)
 {
-	guint min;
+	struct update_data *update;
 
-	if (interval == 0)
+	DBG("interval %u", interval);
+
+	update = g_try_new0(struct update_data, 1);
+	if (!update)
 		return 0;
 
-	update_list = g_slist_insert_sorted(update_list,
-			GUINT_TO_POINTER(interval), compare_interval);
+	update->id = ++update_id;
+	update->interval = interval;
+	update->callback = callback;
+	update->user_data = user_data;
 
-	min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
-	if (min < update_interval) {
-		update_interval_callback(min);
-		__connman_rtnl_request_update();
-	}
+	if (interval > 0)
+		update->deadline = next_deadline(interval,
+						monotonic_seconds());
+
+	update_list = g_slist_insert_sorted(update_list, update,
+							compare_deadline);
 
-	return update_interval;
+	schedule_update();
+
+	/* Start with the current values */
+	update->callback(update->user_data);
+	__connman_rtnl_request_update();
+
+	return update->id;
 }
 
-unsigned int __connman_rtnl_update_interval_remove(unsigned int interval)
+void __connman_rtnl_update_remove(unsigned int id)
 {
-	guint min = G_MAXUINT;
+	GSList *list;
 
-	if (interval == 0)
-		return 0;
+	DBG("id %u", id);
 
-	update_list = g_slist_remove(update_list, GINT_TO_POINTER(interval));
+	for (list = update_list; list; list = list->next) {
+		struct update_data *update = list->data;
 
-	if (update_list)
-		min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
+		if (update->id != id)
+			continue;
 
-	if (min > update_interval)
-		update_interval_callback(min);
+		update_list = g_slist_delete_link(update_list, list);
+		g_free(update);
+		break;
+	}
 
-	return min;
+	schedule_update();
 }
 
+/*
+ * Only the interfaces whose counters end up in a service are polled, and
+ * only for their statistics. Kernels without RTM_GETSTATS get a dump of
+ * all links instead.
+ */
 int __connman_rtnl_request_update(void)
 {
-	return send_getlink();
+	GSList *indexes, *list;
+	int err = 0;
+
+	if (!getstats_supported)
+		return send_getlink();
+
+	indexes = __connman_ipconfig_get_stats_indexes();
+
+	for (list = indexes; list; list = list->next) {
+		int index = GPOINTER_TO_INT(list->data);
+
+		/* The previous poll has not been answered yet */
+		if (find_stats_request(index))
+			continue;
+
+		err = send_getstats(index);
+		if (err < 0)
+			break;
+	}
+
+	g_slist_free(indexes);
+
+	return err < 0 ? err : 0;
 }
 
 int __connman_rtnl_init(void)
 {
 	struct sockaddr_nl addr;
-	int sk;
+	int sk, rcvbuf;
 
 	DBG("");
 
+	watch_table = g_hash_table_new(g_direct_hash, g_direct_equal);
 	interface_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_interface);
 
@@ -1622,6 +2035,14 @@ int __connman_rtnl_init(void)
 		return -1;
 	}
 
+	rcvbuf = connman_setting_get_uint("NetlinkReceiveBuffer");
+	if (rcvbuf > 0 && setsockopt(sk, SOL_SOCKET, SO_RCVBUFFORCE,
+					&rcvbuf, sizeof(rcvbuf)) < 0 &&
+			setsockopt(sk, SOL_SOCKET, SO_RCVBUF,
+					&rcvbuf, sizeof(rcvbuf)) < 0)
+		connman_warn("Failed to set netlink receive buffer: %s",
+							strerror(errno));
+
 	channel = g_io_channel_unix_new(sk);
 	g_io_channel_set_close_on_unref(channel, TRUE);
 
@@ -1650,19 +2071,16 @@ void __connman_rtnl_cleanup(void)
 
 	DBG("");
 
-	for (list = watch_list; list; list = list->next) {
-		struct watch_data *watch = list->data;
-
-		DBG("removing watch %d", watch->id);
+	g_hash_table_foreach(watch_table, free_watch_list, NULL);
+	g_hash_table_destroy(watch_table);
+	watch_table = NULL;
 
-		g_free(watch);
-		list->data = NULL;
+	if (update_timeout > 0) {
+		g_source_remove(update_timeout);
+		update_timeout = 0;
 	}
 
-	g_slist_free(watch_list);
-	watch_list = NULL;
-
-	g_slist_free(update_list);
+	g_slist_free_full(update_list, g_free);
 	update_list = NULL;
 
 	for (list = request_list; list; list = list->next) {
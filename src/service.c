@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <gdbus.h>
@@ -43,11 +44,44 @@ static DBusConnection *connection = NULL;
 
 static GList *service_list = NULL;
 static GHashTable *service_hash = NULL;
+static GHashTable *path_hash = NULL;
+static GHashTable *network_hash = NULL;
+static GHashTable *index_hash = NULL;
 static GSList *counter_list = NULL;
 static unsigned int autoconnect_timeout = 0;
 static unsigned int vpn_autoconnect_timeout = 0;
 static struct connman_service *current_default = NULL;
 static bool services_dirty = false;
+static GSList *dirty_services = NULL;
+static guint properties_flush_id = 0;
+
+#define STRENGTH_STEP		5
+
+/*
+ * Property changes are collected per service and sent once per main
+ * loop iteration, so a burst of updates only results in one signal
+ * with the latest value for each property.
+ */
+enum service_property {
+	SERVICE_PROPERTY_STRENGTH = 0,
+	SERVICE_PROPERTY_FAVORITE,
+	SERVICE_PROPERTY_IMMUTABLE,
+	SERVICE_PROPERTY_ROAMING,
+	SERVICE_PROPERTY_AUTOCONNECT,
+	SERVICE_PROPERTY_IPV4,
+	SERVICE_PROPERTY_IPV6,
+	SERVICE_PROPERTY_IPV4_CONFIG,
+	SERVICE_PROPERTY_IPV6_CONFIG,
+	SERVICE_PROPERTY_NAMESERVERS,
+	SERVICE_PROPERTY_NAMESERVERS_CONFIG,
+	SERVICE_PROPERTY_DOMAINS,
+	SERVICE_PROPERTY_DOMAINS_CONFIG,
+	SERVICE_PROPERTY_PROXY,
+	SERVICE_PROPERTY_PROXY_CONFIG,
+	SERVICE_PROPERTY_TIMESERVERS_CONFIG,
+	SERVICE_PROPERTY_ETHERNET,
+	SERVICE_PROPERTY_MAX,
+};
 
 struct connman_stats {
 	bool valid;
@@ -59,6 +93,7 @@ struct connman_stats {
 
 struct connman_stats_counter {
 	bool append_all;
+	bool due;
 	struct connman_stats stats;
 	struct connman_stats stats_roaming;
 };
@@ -125,41 +160,122 @@ struct connman_service {
 	bool hidden_service;
 	char *config_file;
 	char *config_entry;
+	unsigned int dirty_properties;
+	uint8_t strength_sent;
 };
 
 static bool allow_property_changed(struct connman_service *service);
+static void properties_flush(struct connman_service *service);
 
 static struct connman_ipconfig *create_ip4config(struct connman_service *service,
 		int index, enum connman_ipconfig_method method);
 static struct connman_ipconfig *create_ip6config(struct connman_service *service,
 		int index);
 
-struct find_data {
-	const char *path;
+static struct connman_service *find_service(const char *path)
+{
+	DBG("path %s", path);
+
+	return g_hash_table_lookup(path_hash, path);
+}
+
+/*
+ * The index table maps an interface index to the list of services
+ * having an ipconfig with that index. A service is listed once and
+ * counts how many of its ipconfigs use the index. The entries are
+ * only updated when an ipconfig is created, replaced or changes its
+ * index.
+ */
+struct index_entry {
 	struct connman_service *service;
+	unsigned int refs;
 };
 
-static void compare_path(gpointer value, gpointer user_data)
+static void free_index_list(gpointer data)
 {
-	struct connman_service *service = value;
-	struct find_data *data = user_data;
+	g_list_free_full(data, g_free);
+}
+
+static GList *index_list_find(GList *list, struct connman_service *service)
+{
+	for (; list; list = list->next) {
+		struct index_entry *entry = list->data;
+
+		if (entry->service == service)
+			return list;
+	}
+
+	return NULL;
+}
 
-	if (data->service)
+static void index_hash_add(int index, struct connman_service *service)
+{
+	gpointer key = GINT_TO_POINTER(index);
+	struct index_entry *entry;
+	GList *list, *link;
+
+	if (index < 0)
+		return;
+
+	list = g_hash_table_lookup(index_hash, key);
+
+	link = index_list_find(list, service);
+	if (link) {
+		entry = link->data;
+		entry->refs++;
 		return;
+	}
+
+	entry = g_new0(struct index_entry, 1);
+	entry->service = service;
+	entry->refs = 1;
 
-	if (g_strcmp0(service->path, data->path) == 0)
-		data->service = service;
+	g_hash_table_steal(index_hash, key);
+	g_hash_table_insert(index_hash, key, g_list_prepend(list, entry));
 }
 
-static struct connman_service *find_service(const char *path)
+static void index_hash_remove(int index, struct connman_service *service)
 {
-	struct find_data data = { .path = path, .service = NULL };
+	gpointer key = GINT_TO_POINTER(index);
+	struct index_entry *entry;
+	GList *list, *link;
 
-	DBG("path %s", path);
+	if (index < 0)
+		return;
+
+	list = g_hash_table_lookup(index_hash, key);
+
+	link = index_list_find(list, service);
+	if (!link)
+		return;
+
+	entry = link->data;
+	if (--entry->refs > 0)
+		return;
+
+	g_hash_table_steal(index_hash, key);
+
+	list = g_list_delete_link(list, link);
+	g_free(entry);
+
+	if (list)
+		g_hash_table_insert(index_hash, key, list);
+}
+
+static void service_set_network(struct connman_service *service,
+				struct connman_network *network)
+{
+	if (service->network) {
+		g_hash_table_remove(network_hash, service->network);
+		connman_network_unref(service->network);
+	}
 
-	g_list_foreach(service_list, compare_path, &data);
+	service->network = NULL;
 
-	return data.service;
+	if (network) {
+		service->network = connman_network_ref(network);
+		g_hash_table_replace(network_hash, network, service);
+	}
 }
 
 static const char *reason2string(enum connman_service_connect_reason reason)
@@ -1220,26 +1336,44 @@ void __connman_service_nameserver_clear(struct connman_service *service)
 	nameserver_add_all(service, CONNMAN_IPCONFIG_TYPE_ALL);
 }
 
+struct nameserver_route {
+	int family;
+	int index;
+	char *nameserver;
+};
+
+static void nameserver_route_added(int error, void *user_data)
+{
+	struct nameserver_route *route = user_data;
+
+	/* For P-t-P link the route via the gateway fails */
+	if (error < 0)
+		connman_inet_add_route_async(route->family, route->index,
+				route->nameserver, NULL,
+				route->family == AF_INET ? 32 : 128,
+				NULL, NULL);
+
+	g_free(route->nameserver);
+	g_free(route);
+}
+
 static void add_nameserver_route(int family, int index, char *nameserver,
 				const char *gw)
 {
-	switch (family) {
-	case AF_INET:
-		if (connman_inet_compare_subnet(index, nameserver))
-			break;
+	struct nameserver_route *route;
 
-		if (connman_inet_add_host_route(index, nameserver, gw) < 0)
-			/* For P-t-P link the above route add will fail */
-			connman_inet_add_host_route(index, nameserver, NULL);
-		break;
+	if (family == AF_INET && connman_inet_compare_subnet(index, nameserver))
+		return;
 
-	case AF_INET6:
-		if (connman_inet_add_ipv6_host_route(index, nameserver,
-								gw) < 0)
-			connman_inet_add_ipv6_host_route(index, nameserver,
-							NULL);
-		break;
-	}
+	route = g_new0(struct nameserver_route, 1);
+	route->family = family;
+	route->index = index;
+	route->nameserver = g_strdup(nameserver);
+
+	if (connman_inet_add_route_async(family, index, nameserver, gw,
+					family == AF_INET ? 32 : 128,
+					nameserver_route_added, route) < 0)
+		nameserver_route_added(-EIO, route);
 }
 
 static void nameserver_add_routes(int index, char **nameservers,
@@ -1273,13 +1407,15 @@ static void nameserver_del_routes(int index, char **nameservers,
 		switch (family) {
 		case AF_INET:
 			if (type != CONNMAN_IPCONFIG_TYPE_IPV6)
-				connman_inet_del_host_route(index,
-							nameservers[i]);
+				connman_inet_del_route_async(AF_INET, index,
+						nameservers[i], 32,
+						NULL, NULL);
 			break;
 		case AF_INET6:
 			if (type != CONNMAN_IPCONFIG_TYPE_IPV4)
-				connman_inet_del_ipv6_host_route(index,
-							nameservers[i]);
+				connman_inet_del_route_async(AF_INET6, index,
+						nameservers[i], 128,
+						NULL, NULL);
 			break;
 		}
 	}
@@ -1485,49 +1621,84 @@ static void state_changed(struct connman_service *service)
 	if (!allow_property_changed(service))
 		return;
 
+	/* Clients expect the settings to be current when the state is */
+	properties_flush(service);
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "State",
 						DBUS_TYPE_STRING, &str);
 }
 
-static void strength_changed(struct connman_service *service)
+static gboolean properties_flush_all(gpointer user_data)
 {
-	if (service->strength == 0)
+	properties_flush_id = 0;
+
+	while (dirty_services) {
+		struct connman_service *service = dirty_services->data;
+
+		properties_flush(service);
+	}
+
+	return FALSE;
+}
+
+static void property_changed(struct connman_service *service,
+				enum service_property property)
+{
+	if (!service->path)
 		return;
 
 	if (!allow_property_changed(service))
 		return;
 
+	if (service->dirty_properties == 0)
+		dirty_services = g_slist_prepend(dirty_services, service);
+
+	service->dirty_properties |= 1 << property;
+
+	if (properties_flush_id == 0)
+		properties_flush_id = g_idle_add(properties_flush_all, NULL);
+}
+
+static void send_strength(struct connman_service *service)
+{
+	service->strength_sent = service->strength;
+
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Strength",
 					DBUS_TYPE_BYTE, &service->strength);
 }
 
-static void favorite_changed(struct connman_service *service)
+static void strength_changed(struct connman_service *service)
 {
-	dbus_bool_t favorite;
-
-	if (!service->path)
+	if (service->strength == 0)
 		return;
 
-	if (!allow_property_changed(service))
+	/* Small fluctuations of the signal are not worth a signal */
+	if (abs(service->strength - service->strength_sent) < STRENGTH_STEP)
 		return;
 
+	property_changed(service, SERVICE_PROPERTY_STRENGTH);
+}
+
+static void send_favorite(struct connman_service *service)
+{
+	dbus_bool_t favorite;
+
 	favorite = service->favorite;
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Favorite",
 					DBUS_TYPE_BOOLEAN, &favorite);
 }
 
-static void immutable_changed(struct connman_service *service)
+static void favorite_changed(struct connman_service *service)
 {
-	dbus_bool_t immutable;
-
-	if (!service->path)
-		return;
+	property_changed(service, SERVICE_PROPERTY_FAVORITE);
+}
 
-	if (!allow_property_changed(service))
-		return;
+static void send_immutable(struct connman_service *service)
+{
+	dbus_bool_t immutable;
 
 	immutable = service->immutable;
 	connman_dbus_property_changed_basic(service->path,
@@ -1535,15 +1706,14 @@ static void immutable_changed(struct connman_service *service)
 					DBUS_TYPE_BOOLEAN, &immutable);
 }
 
-static void roaming_changed(struct connman_service *service)
+static void immutable_changed(struct connman_service *service)
 {
-	dbus_bool_t roaming;
-
-	if (!service->path)
-		return;
+	property_changed(service, SERVICE_PROPERTY_IMMUTABLE);
+}
 
-	if (!allow_property_changed(service))
-		return;
+static void send_roaming(struct connman_service *service)
+{
+	dbus_bool_t roaming;
 
 	roaming = service->roaming;
 	connman_dbus_property_changed_basic(service->path,
@@ -1551,15 +1721,14 @@ static void roaming_changed(struct connman_service *service)
 					DBUS_TYPE_BOOLEAN, &roaming);
 }
 
-static void autoconnect_changed(struct connman_service *service)
+static void roaming_changed(struct connman_service *service)
 {
-	dbus_bool_t autoconnect;
-
-	if (!service->path)
-		return;
+	property_changed(service, SERVICE_PROPERTY_ROAMING);
+}
 
-	if (!allow_property_changed(service))
-		return;
+static void send_autoconnect(struct connman_service *service)
+{
+	dbus_bool_t autoconnect;
 
 	autoconnect = service->autoconnect;
 	connman_dbus_property_changed_basic(service->path,
@@ -1567,6 +1736,11 @@ static void autoconnect_changed(struct connman_service *service)
 				DBUS_TYPE_BOOLEAN, &autoconnect);
 }
 
+static void autoconnect_changed(struct connman_service *service)
+{
+	property_changed(service, SERVICE_PROPERTY_AUTOCONNECT);
+}
+
 static void append_security(DBusMessageIter *iter, void *user_data)
 {
 	struct connman_service *service = user_data;
@@ -1901,6 +2075,20 @@ static void append_provider(DBusMessageIter *iter, void *user_data)
 }
 
 
+static void send_ipv4(struct connman_service *service)
+{
+	connman_dbus_property_changed_dict(service->path,
+					CONNMAN_SERVICE_INTERFACE, "IPv4",
+					append_ipv4, service);
+}
+
+static void send_ipv6(struct connman_service *service)
+{
+	connman_dbus_property_changed_dict(service->path,
+					CONNMAN_SERVICE_INTERFACE, "IPv6",
+					append_ipv6, service);
+}
+
 static void settings_changed(struct connman_service *service,
 				struct connman_ipconfig *ipconfig)
 {
@@ -1912,22 +2100,15 @@ static void settings_changed(struct connman_service *service,
 	type = __connman_ipconfig_get_config_type(ipconfig);
 
 	if (type == CONNMAN_IPCONFIG_TYPE_IPV4)
-		connman_dbus_property_changed_dict(service->path,
-					CONNMAN_SERVICE_INTERFACE, "IPv4",
-					append_ipv4, service);
+		property_changed(service, SERVICE_PROPERTY_IPV4);
 	else if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
-		connman_dbus_property_changed_dict(service->path,
-					CONNMAN_SERVICE_INTERFACE, "IPv6",
-					append_ipv6, service);
+		property_changed(service, SERVICE_PROPERTY_IPV6);
 
 	__connman_notifier_ipconfig_changed(service, ipconfig);
 }
 
-static void ipv4_configuration_changed(struct connman_service *service)
+static void send_ipv4_configuration(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
-
 	connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE,
 							"IPv4.Configuration",
@@ -1935,11 +2116,13 @@ static void ipv4_configuration_changed(struct connman_service *service)
 							service);
 }
 
-static void ipv6_configuration_changed(struct connman_service *service)
+static void ipv4_configuration_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	property_changed(service, SERVICE_PROPERTY_IPV4_CONFIG);
+}
 
+static void send_ipv6_configuration(struct connman_service *service)
+{
 	connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE,
 							"IPv6.Configuration",
@@ -1947,77 +2130,91 @@ static void ipv6_configuration_changed(struct connman_service *service)
 							service);
 }
 
-static void dns_changed(struct connman_service *service)
+static void ipv6_configuration_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	property_changed(service, SERVICE_PROPERTY_IPV6_CONFIG);
+}
 
+static void send_dns(struct connman_service *service)
+{
 	connman_dbus_property_changed_array(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Nameservers",
 					DBUS_TYPE_STRING, append_dns, service);
 }
 
-static void dns_configuration_changed(struct connman_service *service)
+static void dns_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	property_changed(service, SERVICE_PROPERTY_NAMESERVERS);
+}
 
+static void send_dns_configuration(struct connman_service *service)
+{
 	connman_dbus_property_changed_array(service->path,
 				CONNMAN_SERVICE_INTERFACE,
 				"Nameservers.Configuration",
 				DBUS_TYPE_STRING, append_dnsconfig, service);
+}
+
+static void dns_configuration_changed(struct connman_service *service)
+{
+	property_changed(service, SERVICE_PROPERTY_NAMESERVERS_CONFIG);
 
 	dns_changed(service);
 }
 
-static void domain_changed(struct connman_service *service)
+static void send_domain(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
-
 	connman_dbus_property_changed_array(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Domains",
 				DBUS_TYPE_STRING, append_domain, service);
 }
 
-static void domain_configuration_changed(struct connman_service *service)
+static void domain_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	property_changed(service, SERVICE_PROPERTY_DOMAINS);
+}
 
+static void send_domain_configuration(struct connman_service *service)
+{
 	connman_dbus_property_changed_array(service->path,
 				CONNMAN_SERVICE_INTERFACE,
 				"Domains.Configuration",
 				DBUS_TYPE_STRING, append_domainconfig, service);
 }
 
-static void proxy_changed(struct connman_service *service)
+static void domain_configuration_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	property_changed(service, SERVICE_PROPERTY_DOMAINS_CONFIG);
+}
 
+static void send_proxy(struct connman_service *service)
+{
 	connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE, "Proxy",
 							append_proxy, service);
 }
 
-static void proxy_configuration_changed(struct connman_service *service)
+static void proxy_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	property_changed(service, SERVICE_PROPERTY_PROXY);
+}
 
+static void send_proxy_configuration(struct connman_service *service)
+{
 	connman_dbus_property_changed_dict(service->path,
 			CONNMAN_SERVICE_INTERFACE, "Proxy.Configuration",
 						append_proxyconfig, service);
+}
+
+static void proxy_configuration_changed(struct connman_service *service)
+{
+	property_changed(service, SERVICE_PROPERTY_PROXY_CONFIG);
 
 	proxy_changed(service);
 }
 
-static void timeservers_configuration_changed(struct connman_service *service)
+static void send_timeservers_configuration(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
-
 	connman_dbus_property_changed_array(service->path,
 			CONNMAN_SERVICE_INTERFACE,
 			"Timeservers.Configuration",
@@ -2025,16 +2222,64 @@ static void timeservers_configuration_changed(struct connman_service *service)
 			append_tsconfig, service);
 }
 
-static void link_changed(struct connman_service *service)
+static void timeservers_configuration_changed(struct connman_service *service)
 {
-	if (!allow_property_changed(service))
-		return;
+	property_changed(service, SERVICE_PROPERTY_TIMESERVERS_CONFIG);
+}
 
+static void send_link(struct connman_service *service)
+{
 	connman_dbus_property_changed_dict(service->path,
 					CONNMAN_SERVICE_INTERFACE, "Ethernet",
 						append_ethernet, service);
 }
 
+static void link_changed(struct connman_service *service)
+{
+	property_changed(service, SERVICE_PROPERTY_ETHERNET);
+}
+
+static void (*const property_send[SERVICE_PROPERTY_MAX])
+					(struct connman_service *service) = {
+	[SERVICE_PROPERTY_STRENGTH]		= send_strength,
+	[SERVICE_PROPERTY_FAVORITE]		= send_favorite,
+	[SERVICE_PROPERTY_IMMUTABLE]		= send_immutable,
+	[SERVICE_PROPERTY_ROAMING]		= send_roaming,
+	[SERVICE_PROPERTY_AUTOCONNECT]		= send_autoconnect,
+	[SERVICE_PROPERTY_IPV4]			= send_ipv4,
+	[SERVICE_PROPERTY_IPV6]			= send_ipv6,
+	[SERVICE_PROPERTY_IPV4_CONFIG]		= send_ipv4_configuration,
+	[SERVICE_PROPERTY_IPV6_CONFIG]		= send_ipv6_configuration,
+	[SERVICE_PROPERTY_NAMESERVERS]		= send_dns,
+	[SERVICE_PROPERTY_NAMESERVERS_CONFIG]	= send_dns_configuration,
+	[SERVICE_PROPERTY_DOMAINS]		= send_domain,
+	[SERVICE_PROPERTY_DOMAINS_CONFIG]	= send_domain_configuration,
+	[SERVICE_PROPERTY_PROXY]		= send_proxy,
+	[SERVICE_PROPERTY_PROXY_CONFIG]		= send_proxy_configuration,
+	[SERVICE_PROPERTY_TIMESERVERS_CONFIG]	= send_timeservers_configuration,
+	[SERVICE_PROPERTY_ETHERNET]		= send_link,
+};
+
+static void properties_flush(struct connman_service *service)
+{
+	unsigned int dirty = service->dirty_properties;
+	int i;
+
+	if (dirty == 0)
+		return;
+
+	service->dirty_properties = 0;
+	dirty_services = g_slist_remove(dirty_services, service);
+
+	if (!service->path || !allow_property_changed(service))
+		return;
+
+	for (i = 0; i < SERVICE_PROPERTY_MAX; i++) {
+		if (dirty & (1 << i))
+			property_send[i](service);
+	}
+}
+
 static void stats_append_counters(DBusMessageIter *dict,
 			struct connman_stats_data *stats,
 			struct connman_stats_data *counters,
@@ -2211,13 +2456,22 @@ void __connman_service_notify(struct connman_service *service,
 		connman_error("Failed to store statistics for %s",
 				service->identifier);
 
+	__connman_counter_memory_update(service->identifier, service->roaming,
+					&service->stats.data,
+					&service->stats_roaming.data);
+
 	g_hash_table_iter_init(&iter, service->counter_table);
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
 		counter = key;
 		counters = value;
 
+		/* Each counter is only told at its own interval */
+		if (!counters->due && !counters->append_all)
+			continue;
+
 		stats_append(service, counter, counters, counters->append_all);
 		counters->append_all = false;
+		counters->due = false;
 	}
 }
 
@@ -2263,6 +2517,20 @@ void __connman_service_counter_unregister(const char *counter)
 	counter_list = g_slist_remove(counter_list, counter);
 }
 
+void __connman_service_counter_due(const char *counter)
+{
+	struct connman_stats_counter *counters;
+	GList *list;
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *service = list->data;
+
+		counters = g_hash_table_lookup(service->counter_table, counter);
+		if (counters)
+			counters->due = true;
+	}
+}
+
 int __connman_service_iterate_services(service_iterate_cb cb, void *user_data)
 {
 	GList *list;
@@ -3172,6 +3440,7 @@ int __connman_service_reset_ipconfig(struct connman_service *service,
 	if (array) {
 		err = __connman_ipconfig_set_config(new_ipconfig, array);
 		if (err < 0) {
+			index_hash_remove(index, service);
 			__connman_ipconfig_unref(new_ipconfig);
 			return err;
 		}
@@ -3190,6 +3459,8 @@ int __connman_service_reset_ipconfig(struct connman_service *service,
 	else if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
 		service->ipconfig_ipv6 = new_ipconfig;
 
+	index_hash_remove(index, service);
+
 	if (is_connecting_state(service, state) ||
 					is_connected_state(service, state))
 		__connman_ipconfig_enable(new_ipconfig);
@@ -4334,9 +4605,75 @@ static DBusMessage *reset_counters(DBusConnection *conn,
 
 	reset_stats(service);
 
+	__connman_counter_memory_update(service->identifier, service->roaming,
+					&service->stats.data,
+					&service->stats_roaming.data);
+
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static void append_usage(time_t start, struct connman_stats_data *usage,
+							void *user_data)
+{
+	DBusMessageIter *array = user_data;
+	struct connman_stats_data counters = { 0 };
+	dbus_uint64_t ts = start;
+	DBusMessageIter dict;
+
+	connman_dbus_dict_open(array, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Start",
+					DBUS_TYPE_UINT64, &ts);
+	stats_append_counters(&dict, usage, &counters, true);
+
+	connman_dbus_dict_close(array, &dict);
+}
+
+static DBusMessage *get_usage(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct connman_service *service = user_data;
+	dbus_uint64_t start, end;
+	dbus_uint32_t interval;
+	dbus_bool_t roaming;
+	DBusMessageIter iter, array;
+	DBusMessage *reply;
+	int err;
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT64, &start,
+					DBUS_TYPE_UINT64, &end,
+					DBUS_TYPE_UINT32, &interval,
+					DBUS_TYPE_BOOLEAN, &roaming,
+					DBUS_TYPE_INVALID))
+		return __connman_error_invalid_arguments(msg);
+
+	if (end < start)
+		return __connman_error_invalid_arguments(msg);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
+
+	err = __connman_stats_get_range(service, roaming, start, end,
+					interval, append_usage, &array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (err < 0) {
+		dbus_message_unref(reply);
+		return __connman_error_failed(msg, -err);
+	}
+
+	return reply;
+}
+
 static struct _services_notify {
 	int id;
 	GHashTable *add;
@@ -4478,6 +4815,11 @@ static const GDBusMethodTable service_methods[] = {
 			GDBUS_ARGS({ "service", "o" }), NULL,
 			move_after) },
 	{ GDBUS_METHOD("ResetCounters", NULL, NULL, reset_counters) },
+	{ GDBUS_EXPERIMENTAL_METHOD("GetUsage",
+			GDBUS_ARGS({ "start", "t" }, { "end", "t" },
+				{ "interval", "u" }, { "roaming", "b" }),
+			GDBUS_ARGS({ "usage", "aa{sv}" }),
+			get_usage) },
 	{ },
 };
 
@@ -4499,12 +4841,20 @@ static void service_free(gpointer user_data)
 	__connman_notifier_service_remove(service);
 	service_schedule_removed(service);
 
+	if (service->dirty_properties) {
+		service->dirty_properties = 0;
+		dirty_services = g_slist_remove(dirty_services, service);
+	}
+
 	__connman_wispr_stop(service);
 	stats_stop(service);
+	__connman_counter_memory_remove(service->identifier);
 
 	service->path = NULL;
 
 	if (path) {
+		g_hash_table_remove(path_hash, path);
+
 		__connman_connection_update_gateway();
 
 		g_dbus_unregister_interface(connection, path,
@@ -4516,8 +4866,7 @@ static void service_free(gpointer user_data)
 
 	if (service->network) {
 		__connman_network_disconnect(service->network);
-		connman_network_unref(service->network);
-		service->network = NULL;
+		service_set_network(service, NULL);
 	}
 
 	if (service->provider)
@@ -4700,6 +5049,10 @@ void connman_service_unref_debug(struct connman_service *service,
 		return;
 
 	service_list = g_list_remove(service_list, service);
+	index_hash_remove(__connman_ipconfig_get_index(service->ipconfig_ipv4),
+								service);
+	index_hash_remove(__connman_ipconfig_get_index(service->ipconfig_ipv6),
+								service);
 
 	__connman_service_disconnect(service);
 
@@ -4794,12 +5147,53 @@ static gint service_compare(gconstpointer a, gconstpointer b)
 	return g_strcmp0(service_a->name, service_b->name);
 }
 
-static void service_list_sort(void)
+static bool service_list_is_sorted(void)
 {
-	if (service_list && service_list->next) {
-		service_list = g_list_sort(service_list, service_compare);
-		service_schedule_changed();
+	GList *list;
+
+	for (list = service_list; list && list->next; list = list->next) {
+		if (service_compare(list->data, list->next->data) > 0)
+			return false;
 	}
+
+	return true;
+}
+
+static void service_list_sort(void)
+{
+	if (!service_list || !service_list->next)
+		return;
+
+	if (service_list_is_sorted())
+		return;
+
+	service_list = g_list_sort(service_list, service_compare);
+	service_schedule_changed();
+}
+
+/*
+ * Only the sort key of this service changed, so it is enough to move
+ * it to its new place. Nothing is done if it is still in order with
+ * its neighbours.
+ */
+static void service_list_reposition(struct connman_service *service)
+{
+	GList *link;
+
+	link = g_list_find(service_list, service);
+	if (!link)
+		return;
+
+	if ((!link->prev ||
+			service_compare(link->prev->data, service) <= 0) &&
+			(!link->next ||
+			service_compare(service, link->next->data) <= 0))
+		return;
+
+	service_list = g_list_delete_link(service_list, link);
+	service_list = g_list_insert_sorted(service_list, service,
+						service_compare);
+	service_schedule_changed();
 }
 
 int __connman_service_compare(const struct connman_service *a,
@@ -4964,7 +5358,7 @@ int __connman_service_set_favorite_delayed(struct connman_service *service,
 
 	if (!delay_ordering) {
 
-		service_list_sort();
+		service_list_reposition(service);
 
 		__connman_connection_update_gateway();
 	}
@@ -5301,6 +5695,30 @@ static const char *get_dbus_sender(struct connman_service *service)
 	return dbus_message_get_sender(service->pending);
 }
 
+static void trace_state(struct connman_service *service,
+				enum connman_service_state old_state,
+				enum connman_service_state new_state)
+{
+	__connman_trace_end(service, state2string(old_state));
+
+	switch (new_state) {
+	case CONNMAN_SERVICE_STATE_ASSOCIATION:
+	case CONNMAN_SERVICE_STATE_CONFIGURATION:
+	case CONNMAN_SERVICE_STATE_READY:
+		__connman_trace_begin(service, state2string(new_state));
+		break;
+	case CONNMAN_SERVICE_STATE_ONLINE:
+		__connman_trace_end(service, "connect");
+		break;
+	case CONNMAN_SERVICE_STATE_UNKNOWN:
+	case CONNMAN_SERVICE_STATE_IDLE:
+	case CONNMAN_SERVICE_STATE_DISCONNECT:
+	case CONNMAN_SERVICE_STATE_FAILURE:
+		__connman_trace_abort(service, state2string(new_state));
+		break;
+	}
+}
+
 static int service_indicate_state(struct connman_service *service)
 {
 	enum connman_service_state old_state, new_state;
@@ -5342,6 +5760,7 @@ static int service_indicate_state(struct connman_service *service)
 
 	service->state = new_state;
 	state_changed(service);
+	trace_state(service, old_state, new_state);
 
 	if (!is_connected_state(service, old_state) &&
 			is_connected_state(service, new_state))
@@ -5720,6 +6139,14 @@ int __connman_service_online_check_failed(struct connman_service *service,
 	return EAGAIN;
 }
 
+static const char *ipconfig_span(enum connman_ipconfig_type type)
+{
+	if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
+		return "ipv6-configuration";
+
+	return "ipv4-configuration";
+}
+
 int __connman_service_ipconfig_indicate_state(struct connman_service *service,
 					enum connman_service_state new_state,
 					enum connman_ipconfig_type type)
@@ -5782,11 +6209,15 @@ int __connman_service_ipconfig_indicate_state(struct connman_service *service,
 		new_state, state2string(new_state),
 		type, __connman_ipconfig_type2string(type));
 
+	if (old_state == CONNMAN_SERVICE_STATE_CONFIGURATION)
+		__connman_trace_end(service, ipconfig_span(type));
+
 	switch (new_state) {
 	case CONNMAN_SERVICE_STATE_UNKNOWN:
 	case CONNMAN_SERVICE_STATE_ASSOCIATION:
 		break;
 	case CONNMAN_SERVICE_STATE_CONFIGURATION:
+		__connman_trace_begin(service, ipconfig_span(type));
 		break;
 	case CONNMAN_SERVICE_STATE_READY:
 		if (type == CONNMAN_IPCONFIG_TYPE_IPV4) {
@@ -6055,6 +6486,8 @@ int __connman_service_connect(struct connman_service *service,
 
 	__connman_service_clear_error(service);
 
+	__connman_trace_begin(service, "connect");
+
 	err = service_connect(service);
 
 	service->connect_reason = reason;
@@ -6291,6 +6724,7 @@ static int service_register(struct connman_service *service)
 
 	service->path = g_strdup_printf("%s/service/%s", CONNMAN_PATH,
 						service->identifier);
+	g_hash_table_replace(path_hash, service->path, service);
 
 	DBG("path %s", service->path);
 
@@ -6302,7 +6736,7 @@ static int service_register(struct connman_service *service)
 					service_methods, service_signals,
 							NULL, service, NULL);
 
-	service_list_sort();
+	service_list_reposition(service);
 
 	__connman_connection_update_gateway();
 
@@ -6413,6 +6847,23 @@ static void service_route_changed(struct connman_ipconfig *ipconfig,
 	settings_changed(service, ipconfig);
 }
 
+static void service_index_changed(struct connman_ipconfig *ipconfig,
+							int old_index)
+{
+	struct connman_service *service = __connman_ipconfig_get_data(ipconfig);
+
+	if (!service)
+		return;
+
+	/* A replaced ipconfig may still be around */
+	if (ipconfig != service->ipconfig_ipv4 &&
+			ipconfig != service->ipconfig_ipv6)
+		return;
+
+	index_hash_remove(old_index, service);
+	index_hash_add(__connman_ipconfig_get_index(ipconfig), service);
+}
+
 static const struct connman_ipconfig_ops service_ops = {
 	.up		= service_up,
 	.down		= service_down,
@@ -6422,6 +6873,7 @@ static const struct connman_ipconfig_ops service_ops = {
 	.ip_release	= service_ip_release,
 	.route_set	= service_route_changed,
 	.route_unset	= service_route_changed,
+	.index_changed	= service_index_changed,
 };
 
 static struct connman_ipconfig *create_ip4config(struct connman_service *service,
@@ -6440,6 +6892,8 @@ static struct connman_ipconfig *create_ip4config(struct connman_service *service
 
 	__connman_ipconfig_set_ops(ipconfig_ipv4, &service_ops);
 
+	index_hash_add(index, service);
+
 	return ipconfig_ipv4;
 }
 
@@ -6457,6 +6911,8 @@ static struct connman_ipconfig *create_ip6config(struct connman_service *service
 
 	__connman_ipconfig_set_ops(ipconfig_ipv6, &service_ops);
 
+	index_hash_add(index, service);
+
 	return ipconfig_ipv6;
 }
 
@@ -6535,6 +6991,10 @@ struct connman_service *connman_service_lookup_from_network(struct connman_netwo
 	if (!network)
 		return NULL;
 
+	service = g_hash_table_lookup(network_hash, network);
+	if (service)
+		return service;
+
 	ident = __connman_network_get_ident(network);
 	if (!ident)
 		return NULL;
@@ -6551,24 +7011,28 @@ struct connman_service *connman_service_lookup_from_network(struct connman_netwo
 	return service;
 }
 
+/*
+ * Several services can share an interface, the one that sorts first
+ * in the service list wins.
+ */
 struct connman_service *__connman_service_lookup_from_index(int index)
 {
-	struct connman_service *service;
+	struct connman_service *service = NULL;
 	GList *list;
 
-	for (list = service_list; list; list = list->next) {
-		service = list->data;
+	if (!index_hash)
+		return NULL;
 
-		if (__connman_ipconfig_get_index(service->ipconfig_ipv4)
-							== index)
-			return service;
+	list = g_hash_table_lookup(index_hash, GINT_TO_POINTER(index));
 
-		if (__connman_ipconfig_get_index(service->ipconfig_ipv6)
-							== index)
-			return service;
+	for (; list; list = list->next) {
+		struct index_entry *entry = list->data;
+
+		if (!service || service_compare(entry->service, service) < 0)
+			service = entry->service;
 	}
 
-	return NULL;
+	return service;
 }
 
 struct connman_service *__connman_service_lookup_from_ident(const char *identifier)
@@ -6710,16 +7174,15 @@ static void update_from_network(struct connman_service *service,
 		service->wps = connman_network_get_bool(network, "WiFi.WPS");
 
 	if (service->strength > strength && service->network) {
-		connman_network_unref(service->network);
-		service->network = connman_network_ref(network);
+		service_set_network(service, network);
 
 		strength_changed(service);
 	}
 
 	if (!service->network)
-		service->network = connman_network_ref(network);
+		service_set_network(service, network);
 
-	service_list_sort();
+	service_list_reposition(service);
 }
 
 /**
@@ -6905,7 +7368,7 @@ roaming:
 
 sorting:
 	if (need_sort) {
-		service_list_sort();
+		service_list_reposition(service);
 	}
 }
 
@@ -7102,6 +7565,10 @@ int __connman_service_init(void)
 
 	service_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 							NULL, service_free);
+	path_hash = g_hash_table_new(g_str_hash, g_str_equal);
+	network_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+	index_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, free_index_list);
 
 	services_notify = g_new0(struct _services_notify, 1);
 	services_notify->remove = g_hash_table_new_full(g_str_hash,
@@ -7127,6 +7594,11 @@ void __connman_service_cleanup(void)
 		autoconnect_timeout = 0;
 	}
 
+	if (properties_flush_id != 0) {
+		g_source_remove(properties_flush_id);
+		properties_flush_id = 0;
+	}
+
 	connman_agent_driver_unregister(&agent_driver);
 
 	g_list_free(service_list);
@@ -7135,9 +7607,21 @@ void __connman_service_cleanup(void)
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
 
+	g_hash_table_destroy(path_hash);
+	path_hash = NULL;
+
+	g_hash_table_destroy(network_hash);
+	network_hash = NULL;
+
+	g_hash_table_destroy(index_hash);
+	index_hash = NULL;
+
 	g_slist_free(counter_list);
 	counter_list = NULL;
 
+	g_slist_free(dirty_services);
+	dirty_services = NULL;
+
 	if (services_notify->id != 0) {
 		g_source_remove(services_notify->id);
 		service_send_changed(NULL);
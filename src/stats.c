@@ -47,6 +47,7 @@
 #endif
 
 #define MAGIC 0xFA00B916
+#define ROLLUP_MAGIC 0xFA01B916
 
 /*
  * Statistics counters are stored into a ring buffer which is stored
@@ -79,10 +80,30 @@
  *   'first' points to the first entry in the ring buffer
  *   'last' points to the last entry in the ring buffer
  *
+ * Flushing:
+ *   With a StatisticsFlushInterval set, the updates are kept in memory
+ *   and only the latest home and roaming values are appended once per
+ *   interval. The new records are synced to the disk before the header
+ *   is changed to point at them, so that after a power loss the header
+ *   never refers to a record which has not been written. The home and
+ *   roaming offsets are recovered from the records when the file is
+ *   opened. The file grows by half its size at a time up to the
+ *   maximum size.
+ *
  * History file:
  *   Same format as the ring buffer file
  *   For a period of at least 2 months dayly records are keept
  *   If older, then only a monthly record is keept
+ *
+ * Rollup file:
+ *   Has a fixed size and is created next to the ring buffer file
+ *   It has one section per tier (minutes, hours and days)
+ *   Each section is a ring of records with the usage within one
+ *   interval of the tier, the newest record is the current interval
+ *   Each update adds the usage since the previous update, which is
+ *   the difference to the counters stored in the header, to the
+ *   current record of every tier
+ *   Reading long periods only needs a few records of a coarse tier
  */
 
 
@@ -100,6 +121,44 @@ struct stats_record {
 	struct connman_stats_data data;
 };
 
+#define ROLLUP_TIERS 3
+
+struct stats_rollup_tier {
+	unsigned int period;	/* seconds covered by one record */
+	unsigned int slots;
+	unsigned int offset;	/* of the first record in the file */
+	unsigned int newest;
+	unsigned int count;
+};
+
+struct stats_rollup_header {
+	unsigned int magic;
+	unsigned int valid;	/* bit 0 home, bit 1 roaming */
+	struct connman_stats_data last[2];
+	struct stats_rollup_tier tier[ROLLUP_TIERS];
+};
+
+struct stats_rollup_record {
+	time_t ts;		/* start of the interval */
+	struct connman_stats_data usage[2];	/* home, roaming */
+};
+
+struct stats_rollup {
+	int fd;
+	char *name;
+	char *addr;
+	size_t len;
+};
+
+static const struct {
+	unsigned int period;
+	unsigned int slots;
+} rollup_tiers[ROLLUP_TIERS] = {
+	{ 60, 24 * 60 },	/* minutes of the last day */
+	{ 60 * 60, 31 * 24 },	/* hours of the last month */
+	{ 24 * 60 * 60, 3 * 366 },	/* days of the last three years */
+};
+
 struct stats_file {
 	int fd;
 	char *name;
@@ -116,6 +175,11 @@ struct stats_file {
 	/* history */
 	char *history_name;
 	int account_period_offset;
+
+	struct stats_rollup *rollup;
+
+	/* updates not written yet, ts is 0 if there is none */
+	struct stats_record pending[2];
 };
 
 struct stats_iter {
@@ -126,6 +190,8 @@ struct stats_iter {
 };
 
 static GHashTable *stats_hash = NULL;
+static unsigned int flush_interval;
+static guint flush_timeout;
 
 static struct stats_file_header *get_hdr(struct stats_file *file)
 {
@@ -215,6 +281,25 @@ static struct stats_record *get_iterator_end(struct stats_file *file)
 	return get_next(file, get_end(file));
 }
 
+static void stats_rollup_free(struct stats_rollup *rollup)
+{
+	if (!rollup)
+		return;
+
+	if (rollup->addr) {
+		msync(rollup->addr, rollup->len, MS_SYNC);
+		munmap(rollup->addr, rollup->len);
+	}
+
+	if (rollup->fd >= 0)
+		TFR(close(rollup->fd));
+
+	g_free(rollup->name);
+	g_free(rollup);
+}
+
+static int stats_file_flush(struct stats_file *file);
+
 static void stats_free(gpointer user_data)
 {
 	struct stats_file *file = user_data;
@@ -222,6 +307,11 @@ static void stats_free(gpointer user_data)
 	if (!file)
 		return;
 
+	stats_file_flush(file);
+
+	stats_rollup_free(file->rollup);
+	file->rollup = NULL;
+
 	msync(file->addr, file->len, MS_SYNC);
 
 	munmap(file->addr, file->len);
@@ -328,6 +418,19 @@ static int stats_file_remap(struct stats_file *file, size_t size)
 	return 0;
 }
 
+static size_t stats_file_grow_size(struct stats_file *file)
+{
+	size_t size = file->len + file->len / 2;
+
+	if (file->max_len > 0 && size > file->max_len)
+		size = file->max_len;
+
+	if (size <= file->len)
+		size = file->len + sysconf(_SC_PAGESIZE);
+
+	return size;
+}
+
 static int stats_open(struct stats_file *file,
 			const char *name)
 {
@@ -363,6 +466,47 @@ static int stats_open_temp(struct stats_file *file)
 	return 0;
 }
 
+static bool record_aligned(unsigned int off)
+{
+	return (off - sizeof(struct stats_file_header)) %
+			sizeof(struct stats_record) == 0;
+}
+
+/*
+ * The home and roaming offsets might have been written without the end
+ * offset or the other way around when power was lost, so look up the
+ * newest home and roaming records again.
+ */
+static void stats_file_recover_hdr(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_record *home = NULL, *roaming = NULL;
+	struct stats_record *it, *begin;
+
+	begin = get_begin(file);
+
+	for (it = get_end(file); it != begin && (!home || !roaming);) {
+		if (!it->roaming && !home)
+			home = it;
+		else if (it->roaming && !roaming)
+			roaming = it;
+
+		if (it == file->first)
+			it = file->last;
+		else
+			it--;
+	}
+
+	hdr->home = home ? (unsigned int)((char *)home - file->addr) :
+								UINT_MAX;
+	hdr->roaming = roaming ?
+			(unsigned int)((char *)roaming - file->addr) :
+								UINT_MAX;
+
+	update_home(file);
+	update_roaming(file);
+}
+
 static int stats_file_setup(struct stats_file *file)
 {
 	struct stats_file_header *hdr;
@@ -407,7 +551,9 @@ static int stats_file_setup(struct stats_file *file)
 			hdr->home < sizeof(struct stats_file_header) ||
 			hdr->roaming < sizeof(struct stats_file_header) ||
 			hdr->begin > file->len ||
-			hdr->end > file->len) {
+			hdr->end > file->len ||
+			!record_aligned(hdr->begin) ||
+			!record_aligned(hdr->end)) {
 		hdr->magic = MAGIC;
 		hdr->begin = sizeof(struct stats_file_header);
 		hdr->end = sizeof(struct stats_file_header);
@@ -415,6 +561,8 @@ static int stats_file_setup(struct stats_file *file)
 		hdr->roaming = UINT_MAX;
 
 		stats_file_update_cache(file);
+	} else {
+		stats_file_recover_hdr(file);
 	}
 
 	return 0;
@@ -442,8 +590,7 @@ static int append_record(struct stats_file *file,
 	int err;
 
 	if (file->last == get_end(file)) {
-		err = stats_file_remap(file, file->len +
-					sysconf(_SC_PAGESIZE));
+		err = stats_file_remap(file, stats_file_grow_size(file));
 		if (err < 0)
 			return err;
 
@@ -623,11 +770,12 @@ static int stats_file_close_swap(struct stats_file *history_file,
 
 	TFR(close(temp_file->fd));
 
-	unlink(history_file->name);
-
-	err = link(temp_file->name, history_file->name);
-
-	unlink(temp_file->name);
+	/* rename() replaces the history file in one step */
+	err = rename(temp_file->name, history_file->name);
+	if (err < 0) {
+		err = -errno;
+		unlink(temp_file->name);
+	}
 
 	TFR(close(history_file->fd));
 
@@ -668,6 +816,285 @@ static int stats_file_history_update(struct stats_file *data_file)
 	return err;
 }
 
+static struct stats_rollup_header *get_rollup_hdr(struct stats_rollup *rollup)
+{
+	return (struct stats_rollup_header *)rollup->addr;
+}
+
+static struct stats_rollup_record *get_rollup_record(
+					struct stats_rollup *rollup,
+					struct stats_rollup_tier *tier,
+					unsigned int index)
+{
+	return (struct stats_rollup_record *)(rollup->addr + tier->offset) +
+		index % tier->slots;
+}
+
+static size_t rollup_size(void)
+{
+	size_t size = sizeof(struct stats_rollup_header);
+	int i;
+
+	for (i = 0; i < ROLLUP_TIERS; i++)
+		size += rollup_tiers[i].slots *
+				sizeof(struct stats_rollup_record);
+
+	return size;
+}
+
+static bool rollup_hdr_valid(struct stats_rollup_header *hdr)
+{
+	unsigned int offset = sizeof(*hdr);
+	int i;
+
+	if (hdr->magic != ROLLUP_MAGIC)
+		return false;
+
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		struct stats_rollup_tier *tier = &hdr->tier[i];
+
+		if (tier->period != rollup_tiers[i].period ||
+				tier->slots != rollup_tiers[i].slots ||
+				tier->offset != offset ||
+				tier->count > tier->slots ||
+				tier->newest >= tier->slots)
+			return false;
+
+		offset += tier->slots * sizeof(struct stats_rollup_record);
+	}
+
+	return true;
+}
+
+static void rollup_hdr_init(struct stats_rollup_header *hdr)
+{
+	unsigned int offset = sizeof(*hdr);
+	int i;
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	hdr->magic = ROLLUP_MAGIC;
+
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		hdr->tier[i].period = rollup_tiers[i].period;
+		hdr->tier[i].slots = rollup_tiers[i].slots;
+		hdr->tier[i].offset = offset;
+
+		offset += hdr->tier[i].slots *
+				sizeof(struct stats_rollup_record);
+	}
+}
+
+static struct stats_rollup *stats_rollup_open(const char *name)
+{
+	struct stats_rollup *rollup;
+	void *addr;
+
+	rollup = g_try_new0(struct stats_rollup, 1);
+	if (!rollup)
+		return NULL;
+
+	rollup->name = g_strdup(name);
+	rollup->len = rollup_size();
+
+	rollup->fd = TFR(open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+	if (rollup->fd < 0) {
+		connman_error("open error %s for %s",
+				strerror(errno), name);
+		goto err;
+	}
+
+	if (ftruncate(rollup->fd, rollup->len) < 0) {
+		connman_error("ftrunctate error %s for %s",
+				strerror(errno), name);
+		goto err;
+	}
+
+	addr = mmap(NULL, rollup->len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, rollup->fd, 0);
+	if (addr == MAP_FAILED) {
+		connman_error("mmap error %s for %s",
+				strerror(errno), name);
+		goto err;
+	}
+
+	rollup->addr = addr;
+
+	if (!rollup_hdr_valid(get_rollup_hdr(rollup))) {
+		memset(rollup->addr, 0, rollup->len);
+		rollup_hdr_init(get_rollup_hdr(rollup));
+	}
+
+	return rollup;
+
+err:
+	stats_rollup_free(rollup);
+	return NULL;
+}
+
+/*
+ * The counters only grow, unless they were reset in between, in which
+ * case everything counted since then is new.
+ */
+static unsigned int counter_delta(unsigned int cur, unsigned int last)
+{
+	return cur >= last ? cur - last : cur;
+}
+
+static void stats_data_add_delta(struct connman_stats_data *usage,
+				struct connman_stats_data *cur,
+				struct connman_stats_data *last)
+{
+	usage->rx_packets += counter_delta(cur->rx_packets, last->rx_packets);
+	usage->tx_packets += counter_delta(cur->tx_packets, last->tx_packets);
+	usage->rx_bytes += counter_delta(cur->rx_bytes, last->rx_bytes);
+	usage->tx_bytes += counter_delta(cur->tx_bytes, last->tx_bytes);
+	usage->rx_errors += counter_delta(cur->rx_errors, last->rx_errors);
+	usage->tx_errors += counter_delta(cur->tx_errors, last->tx_errors);
+	usage->rx_dropped += counter_delta(cur->rx_dropped,
+						last->rx_dropped);
+	usage->tx_dropped += counter_delta(cur->tx_dropped,
+						last->tx_dropped);
+	usage->time += counter_delta(cur->time, last->time);
+}
+
+static void stats_rollup_update(struct stats_rollup *rollup, time_t ts,
+				bool roaming, struct connman_stats_data *data)
+{
+	struct stats_rollup_header *hdr = get_rollup_hdr(rollup);
+	unsigned int type = roaming ? 1 : 0;
+	int i;
+
+	/* The first update only sets the base line */
+	if (!(hdr->valid & (1 << type))) {
+		memcpy(&hdr->last[type], data, sizeof(*data));
+		hdr->valid |= 1 << type;
+		return;
+	}
+
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		struct stats_rollup_tier *tier = &hdr->tier[i];
+		struct stats_rollup_record *rec = NULL;
+		time_t start = ts - ts % tier->period;
+
+		if (tier->count > 0)
+			rec = get_rollup_record(rollup, tier, tier->newest);
+
+		if (!rec || rec->ts < start) {
+			if (tier->count > 0)
+				tier->newest = (tier->newest + 1) %
+							tier->slots;
+			if (tier->count < tier->slots)
+				tier->count++;
+
+			rec = get_rollup_record(rollup, tier, tier->newest);
+			memset(rec, 0, sizeof(*rec));
+			rec->ts = start;
+		}
+
+		stats_data_add_delta(&rec->usage[type], data,
+							&hdr->last[type]);
+	}
+
+	memcpy(&hdr->last[type], data, sizeof(*data));
+}
+
+/*
+ * Return the index, counted from the oldest record, of the first record
+ * of the tier that starts at or after ts.
+ */
+static unsigned int rollup_search(struct stats_rollup *rollup,
+				struct stats_rollup_tier *tier, time_t ts)
+{
+	unsigned int oldest = tier->newest + tier->slots - tier->count + 1;
+	unsigned int low = 0, high = tier->count;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+
+		if (get_rollup_record(rollup, tier, oldest + mid)->ts < ts)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Return the coarsest tier whose intervals line up with start, end and
+ * interval and whose records reach back to start, or NULL if the range
+ * has to be taken from the raw records.
+ */
+static struct stats_rollup_tier *rollup_find_tier(struct stats_rollup *rollup,
+					time_t start, time_t end,
+					unsigned int interval)
+{
+	struct stats_rollup_header *hdr = get_rollup_hdr(rollup);
+	bool open_end = end >= time(NULL);
+	int i;
+
+	for (i = ROLLUP_TIERS - 1; i >= 0; i--) {
+		struct stats_rollup_tier *tier = &hdr->tier[i];
+		unsigned int oldest;
+
+		if (tier->count == 0)
+			continue;
+
+		/* An end in the future includes the current interval */
+		if (start % tier->period || interval % tier->period ||
+				(!open_end && end % tier->period))
+			continue;
+
+		oldest = tier->newest + tier->slots - tier->count + 1;
+		if (get_rollup_record(rollup, tier, oldest)->ts > start)
+			continue;
+
+		return tier;
+	}
+
+	return NULL;
+}
+
+static void stats_rollup_range(struct stats_rollup *rollup,
+				struct stats_rollup_tier *tier, bool roaming,
+				time_t start, time_t end, unsigned int interval,
+				connman_stats_range_cb_t func, void *user_data)
+{
+	unsigned int oldest = tier->newest + tier->slots - tier->count + 1;
+	struct connman_stats_data usage, zero;
+	time_t bucket = start;
+	bool used = false;
+	unsigned int i;
+
+	memset(&usage, 0, sizeof(usage));
+	memset(&zero, 0, sizeof(zero));
+
+	for (i = rollup_search(rollup, tier, start); i < tier->count; i++) {
+		struct stats_rollup_record *rec;
+
+		rec = get_rollup_record(rollup, tier, oldest + i);
+		if (rec->ts >= end)
+			break;
+
+		if (interval > 0 && rec->ts >= bucket + (time_t)interval) {
+			if (used)
+				func(bucket, &usage, user_data);
+
+			bucket = rec->ts - (rec->ts - start) % interval;
+			memset(&usage, 0, sizeof(usage));
+			used = false;
+		}
+
+		stats_data_add_delta(&usage, &rec->usage[roaming ? 1 : 0],
+									&zero);
+		used = true;
+	}
+
+	if (used || interval == 0)
+		func(bucket, &usage, user_data);
+}
+
 int __connman_stats_service_register(struct connman_service *service)
 {
 	struct stats_file *file;
@@ -721,6 +1148,13 @@ int __connman_stats_service_register(struct connman_service *service)
 	if (err < 0)
 		goto err;
 
+	name = g_strdup_printf("%s/%s/rollup", STORAGEDIR,
+				__connman_service_get_ident(service));
+	file->rollup = stats_rollup_open(name);
+	if (!file->rollup)
+		connman_warn("rollup file %s not available", name);
+	g_free(name);
+
 	return 0;
 
 err:
@@ -736,23 +1170,29 @@ void __connman_stats_service_unregister(struct connman_service *service)
 	g_hash_table_remove(stats_hash, service);
 }
 
-int  __connman_stats_update(struct connman_service *service,
-				bool roaming,
-				struct connman_stats_data *data)
+static void stats_file_sync(struct stats_file *file, void *start,
+								size_t len)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t off = (char *)start - file->addr;
+	size_t page = off & ~(page_size - 1);
+
+	if (msync(file->addr + page, off + len - page, MS_SYNC) < 0)
+		connman_warn("msync error %s for %s", strerror(errno),
+				file->name);
+}
+
+static int stats_file_write(struct stats_file *file,
+				struct stats_record *rec)
 {
-	struct stats_file *file;
 	struct stats_record *next;
 	int err;
 
-	file = g_hash_table_lookup(stats_hash, service);
-	if (!file)
-		return -EEXIST;
-
 	if (file->len < file->max_len &&
 			file->last == get_end(file)) {
 		DBG("grow file %s", file->name);
 
-		err = stats_file_remap(file, file->len + sysconf(_SC_PAGESIZE));
+		err = stats_file_remap(file, stats_file_grow_size(file));
 		if (err < 0)
 			return err;
 	}
@@ -768,20 +1208,97 @@ int  __connman_stats_update(struct connman_service *service,
 		}
 	}
 
-	next->ts = time(NULL);
-	next->roaming = roaming;
-	memcpy(&next->data, data, sizeof(struct connman_stats_data));
+	memcpy(next, rec, sizeof(struct stats_record));
+
+	if (file->rollup)
+		stats_rollup_update(file->rollup, next->ts, next->roaming,
+								&next->data);
 
-	if (!roaming)
+	/* The record has to be on the disk before the header refers to it */
+	if (flush_interval > 0)
+		stats_file_sync(file, next, sizeof(struct stats_record));
+
+	if (!next->roaming) {
 		set_home(file, next);
-	else
+		update_home(file);
+	} else {
 		set_roaming(file, next);
+		update_roaming(file);
+	}
 
 	set_end(file, next);
 
+	if (flush_interval > 0)
+		stats_file_sync(file, get_hdr(file),
+				sizeof(struct stats_file_header));
+
 	return 0;
 }
 
+static int stats_file_flush(struct stats_file *file)
+{
+	struct stats_record *home = &file->pending[0];
+	struct stats_record *roaming = &file->pending[1];
+	struct stats_record *first = home, *second = roaming;
+	int err = 0;
+
+	if (home->ts > roaming->ts) {
+		first = roaming;
+		second = home;
+	}
+
+	if (first->ts > 0)
+		err = stats_file_write(file, first);
+
+	if (second->ts > 0 && err == 0)
+		err = stats_file_write(file, second);
+
+	if (err < 0)
+		return err;
+
+	memset(file->pending, 0, sizeof(file->pending));
+
+	return 0;
+}
+
+static void flush_file(gpointer key, gpointer value, gpointer user_data)
+{
+	struct stats_file *file = value;
+
+	if (stats_file_flush(file) < 0)
+		connman_warn("stats flush failed for %s", file->name);
+}
+
+static gboolean flush_all(gpointer user_data)
+{
+	g_hash_table_foreach(stats_hash, flush_file, NULL);
+
+	return TRUE;
+}
+
+int  __connman_stats_update(struct connman_service *service,
+				bool roaming,
+				struct connman_stats_data *data)
+{
+	struct stats_file *file;
+	struct stats_record rec;
+
+	file = g_hash_table_lookup(stats_hash, service);
+	if (!file)
+		return -EEXIST;
+
+	rec.ts = time(NULL);
+	rec.roaming = roaming;
+	memcpy(&rec.data, data, sizeof(struct connman_stats_data));
+
+	if (flush_interval > 0) {
+		memcpy(&file->pending[roaming ? 1 : 0], &rec, sizeof(rec));
+		return 0;
+	}
+
+	return stats_file_write(file, &rec);
+}
+
 int __connman_stats_get(struct connman_service *service,
 				bool roaming,
 				struct connman_stats_data *data)
@@ -793,7 +1310,9 @@ int __connman_stats_get(struct connman_service *service,
 	if (!file)
 		return -EEXIST;
 
-	if (!roaming)
+	if (file->pending[roaming ? 1 : 0].ts > 0)
+		rec = &file->pending[roaming ? 1 : 0];
+	else if (!roaming)
 		rec = file->home;
 	else
 		rec = file->roaming;
@@ -806,6 +1325,133 @@ int __connman_stats_get(struct connman_service *service,
 	return 0;
 }
 
+static unsigned int get_nr_records(struct stats_file *file)
+{
+	unsigned int begin = get_begin(file) - file->first;
+	unsigned int end = get_end(file) - file->first;
+	unsigned int slots = file->last - file->first + 1;
+
+	return (end + slots - begin) % slots;
+}
+
+/* Records are numbered from 0 for the oldest one in the ring buffer */
+static struct stats_record *get_record(struct stats_file *file,
+					unsigned int index)
+{
+	unsigned int begin = get_begin(file) - file->first;
+	unsigned int slots = file->last - file->first + 1;
+
+	return file->first + (begin + 1 + index) % slots;
+}
+
+/* Return the number of the first record written at or after ts */
+static unsigned int stats_search(struct stats_file *file, time_t ts)
+{
+	unsigned int low = 0, high = get_nr_records(file);
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+
+		if (get_record(file, mid)->ts < ts)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Hand the usage between start and end to func, either as one sum or,
+ * if interval is not 0, split into intervals of that many seconds
+ * counted from start. Intervals without usage are left out.
+ *
+ * Ranges which line up with a tier of the rollup file are added up
+ * from its records. Otherwise the usage of a record is its difference
+ * to the previous record of the same kind, so the search for the first
+ * record is followed by a walk back to the last record before start.
+ * Only records still in the ring buffer are taken into account.
+ */
+int __connman_stats_get_range(struct connman_service *service,
+				bool roaming, time_t start, time_t end,
+				unsigned int interval,
+				connman_stats_range_cb_t func,
+				void *user_data)
+{
+	struct connman_stats_data usage;
+	struct stats_rollup_tier *tier;
+	struct stats_record *prev = NULL;
+	struct stats_file *file;
+	unsigned int i, nr, first;
+	time_t bucket = start;
+	bool used = false;
+
+	file = g_hash_table_lookup(stats_hash, service);
+	if (!file)
+		return -EEXIST;
+
+	if (end < start || !func)
+		return -EINVAL;
+
+	if (file->rollup) {
+		tier = rollup_find_tier(file->rollup, start, end, interval);
+		if (tier) {
+			stats_rollup_range(file->rollup, tier, roaming,
+						start, end, interval,
+						func, user_data);
+			return 0;
+		}
+	}
+
+	nr = get_nr_records(file);
+	first = stats_search(file, start);
+
+	for (i = first; i > 0; i--) {
+		struct stats_record *rec = get_record(file, i - 1);
+
+		if (!rec->roaming == !roaming) {
+			prev = rec;
+			break;
+		}
+	}
+
+	memset(&usage, 0, sizeof(usage));
+
+	for (i = first; i < nr; i++) {
+		struct stats_record *rec = get_record(file, i);
+
+		if (rec->ts >= end)
+			break;
+
+		if (!rec->roaming != !roaming)
+			continue;
+
+		/* Nothing is known about the usage before the first record */
+		if (!prev) {
+			prev = rec;
+			continue;
+		}
+
+		if (interval > 0 && rec->ts >= bucket + (time_t)interval) {
+			if (used)
+				func(bucket, &usage, user_data);
+
+			bucket = rec->ts - (rec->ts - start) % interval;
+			memset(&usage, 0, sizeof(usage));
+			used = false;
+		}
+
+		stats_data_add_delta(&usage, &rec->data, &prev->data);
+		used = true;
+		prev = rec;
+	}
+
+	if (used || interval == 0)
+		func(bucket, &usage, user_data);
+
+	return 0;
+}
+
 int __connman_stats_init(void)
 {
 	DBG("");
@@ -813,6 +1459,11 @@ int __connman_stats_init(void)
 	stats_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, stats_free);
 
+	flush_interval = connman_setting_get_uint("StatisticsFlushInterval");
+	if (flush_interval > 0)
+		flush_timeout = g_timeout_add_seconds(flush_interval,
+							flush_all, NULL);
+
 	return 0;
 }
 
@@ -820,6 +1471,11 @@ void __connman_stats_cleanup(void)
 {
 	DBG("");
 
+	if (flush_timeout > 0) {
+		g_source_remove(flush_timeout);
+		flush_timeout = 0;
+	}
+
 	g_hash_table_destroy(stats_hash);
 	stats_hash = NULL;
 }
@@ -341,6 +341,10 @@ bool __connman_storage_remove_service(const char *service_id)
 	if (!removed)
 		return false;
 
+	removed = remove_file(service_id, "rollup");
+	if (!removed)
+		return false;
+
 	removed = remove_dir(service_id);
 	if (!removed)
 		return false;
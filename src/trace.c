@@ -0,0 +1,296 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2007-2014  Intel Corporation. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gdbus.h>
+
+#include "connman.h"
+
+#define TRACE_RING_SIZE 256
+
+/*
+ * The connection setup of the services is traced as spans, each with
+ * a start time and a duration in microseconds of the monotonic clock.
+ * Finished spans and single events are kept in a ring buffer where
+ * the oldest records are overwritten. The span and event names are
+ * static strings.
+ */
+enum trace_type {
+	TRACE_TYPE_SPAN    = 0,
+	TRACE_TYPE_EVENT   = 1,
+	TRACE_TYPE_ABORTED = 2,
+};
+
+struct trace_record {
+	char *ident;
+	const char *name;
+	enum trace_type type;
+	gint64 start;
+	gint64 duration;
+};
+
+struct trace_span {
+	char *ident;
+	const char *name;
+	gint64 start;
+};
+
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static unsigned int trace_next;
+static unsigned int trace_count;
+
+static GHashTable *span_table;
+
+static const char *type2string(enum trace_type type)
+{
+	switch (type) {
+	case TRACE_TYPE_SPAN:
+		return "span";
+	case TRACE_TYPE_EVENT:
+		return "event";
+	case TRACE_TYPE_ABORTED:
+		return "aborted";
+	}
+
+	return NULL;
+}
+
+static void trace_record(const char *ident, const char *name,
+				enum trace_type type, gint64 start,
+				gint64 duration)
+{
+	struct trace_record *record = &trace_ring[trace_next];
+
+	DBG("%s %s %s %" G_GINT64_FORMAT " us", ident, name,
+					type2string(type), duration);
+
+	g_free(record->ident);
+	record->ident = g_strdup(ident);
+	record->name = name;
+	record->type = type;
+	record->start = start;
+	record->duration = duration;
+
+	trace_next = (trace_next + 1) % TRACE_RING_SIZE;
+	if (trace_count < TRACE_RING_SIZE)
+		trace_count++;
+}
+
+static char *span_key(const char *ident, const char *name)
+{
+	return g_strdup_printf("%s/%s", ident, name);
+}
+
+static void free_span(gpointer data)
+{
+	struct trace_span *span = data;
+
+	g_free(span->ident);
+	g_free(span);
+}
+
+static const char *trace_ident(struct connman_service *service,
+				const char *name)
+{
+	if (!span_table || !service || !name)
+		return NULL;
+
+	return __connman_service_get_ident(service);
+}
+
+void __connman_trace_begin(struct connman_service *service,
+				const char *name)
+{
+	struct trace_span *span;
+	const char *ident;
+
+	ident = trace_ident(service, name);
+	if (!ident)
+		return;
+
+	span = g_try_new0(struct trace_span, 1);
+	if (!span)
+		return;
+
+	span->ident = g_strdup(ident);
+	span->name = name;
+	span->start = g_get_monotonic_time();
+
+	g_hash_table_replace(span_table, span_key(ident, name), span);
+}
+
+void __connman_trace_end(struct connman_service *service, const char *name)
+{
+	struct trace_span *span;
+	const char *ident;
+	char *key;
+
+	ident = trace_ident(service, name);
+	if (!ident)
+		return;
+
+	key = span_key(ident, name);
+
+	span = g_hash_table_lookup(span_table, key);
+	if (span) {
+		trace_record(span->ident, span->name, TRACE_TYPE_SPAN,
+				span->start,
+				g_get_monotonic_time() - span->start);
+		g_hash_table_remove(span_table, key);
+	}
+
+	g_free(key);
+}
+
+void __connman_trace_event(struct connman_service *service,
+				const char *name)
+{
+	const char *ident;
+
+	ident = trace_ident(service, name);
+	if (!ident)
+		return;
+
+	trace_record(ident, name, TRACE_TYPE_EVENT,
+					g_get_monotonic_time(), 0);
+}
+
+static gboolean abort_span(gpointer key, gpointer value, gpointer user_data)
+{
+	struct trace_span *span = value;
+	const char *ident = user_data;
+
+	if (g_strcmp0(span->ident, ident) != 0)
+		return FALSE;
+
+	trace_record(span->ident, span->name, TRACE_TYPE_ABORTED,
+			span->start, g_get_monotonic_time() - span->start);
+
+	return TRUE;
+}
+
+void __connman_trace_abort(struct connman_service *service,
+				const char *name)
+{
+	const char *ident;
+
+	ident = trace_ident(service, name);
+	if (!ident)
+		return;
+
+	g_hash_table_foreach_remove(span_table, abort_span, (gpointer) ident);
+
+	trace_record(ident, name, TRACE_TYPE_EVENT,
+					g_get_monotonic_time(), 0);
+}
+
+static void append_record(DBusMessageIter *iter, const char *ident,
+				const char *name, const char *type,
+				gint64 start, gint64 duration)
+{
+	DBusMessageIter entry, dict;
+	dbus_uint64_t value;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT,
+							NULL, &entry);
+
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &ident);
+
+	connman_dbus_dict_open(&entry, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Name",
+					DBUS_TYPE_STRING, &name);
+	connman_dbus_dict_append_basic(&dict, "Type",
+					DBUS_TYPE_STRING, &type);
+	value = start;
+	connman_dbus_dict_append_basic(&dict, "Start",
+					DBUS_TYPE_UINT64, &value);
+	value = duration;
+	connman_dbus_dict_append_basic(&dict, "Duration",
+					DBUS_TYPE_UINT64, &value);
+
+	connman_dbus_dict_close(&entry, &dict);
+
+	dbus_message_iter_close_container(iter, &entry);
+}
+
+void __connman_trace_append(DBusMessageIter *iter)
+{
+	gint64 now = g_get_monotonic_time();
+	GHashTableIter hash_iter;
+	gpointer key, value;
+	unsigned int i, pos;
+
+	pos = (trace_next + TRACE_RING_SIZE - trace_count) % TRACE_RING_SIZE;
+
+	for (i = 0; i < trace_count; i++) {
+		struct trace_record *record = &trace_ring[pos];
+
+		append_record(iter, record->ident, record->name,
+				type2string(record->type), record->start,
+				record->duration);
+
+		pos = (pos + 1) % TRACE_RING_SIZE;
+	}
+
+	if (!span_table)
+		return;
+
+	g_hash_table_iter_init(&hash_iter, span_table);
+
+	while (g_hash_table_iter_next(&hash_iter, &key, &value)) {
+		struct trace_span *span = value;
+
+		append_record(iter, span->ident, span->name, "running",
+				span->start, now - span->start);
+	}
+}
+
+int __connman_trace_init(void)
+{
+	DBG("");
+
+	span_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, free_span);
+
+	return 0;
+}
+
+void __connman_trace_cleanup(void)
+{
+	unsigned int i;
+
+	DBG("");
+
+	g_hash_table_destroy(span_table);
+	span_table = NULL;
+
+	for (i = 0; i < TRACE_RING_SIZE; i++) {
+		g_free(trace_ring[i].ident);
+		trace_ring[i].ident = NULL;
+	}
+
+	trace_next = 0;
+	trace_count = 0;
+}
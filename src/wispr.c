@@ -417,10 +417,22 @@ static void web_debug(const char *str, void *data)
 	connman_info("%s: %s\n", (const char *) data, str);
 }
 
+static const char *online_check_span(enum connman_ipconfig_type type)
+{
+	if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
+		return "ipv6-online-check";
+
+	return "ipv4-online-check";
+}
+
 static void wispr_portal_error(struct connman_wispr_portal_context *wp_context)
 {
 	DBG("Failed to proceed wispr/portal web request");
 
+	__connman_trace_end(wp_context->service,
+				online_check_span(wp_context->type));
+	__connman_trace_event(wp_context->service, "online-check-failed");
+
 	wp_context->wispr_result = CONNMAN_WISPR_RESULT_FAILED;
 }
 
@@ -452,6 +464,8 @@ static void portal_manage_status(GWebResult *result,
 
 	free_connman_wispr_portal_context(wp_context);
 
+	__connman_trace_end(service, online_check_span(type));
+
 	__connman_service_ipconfig_indicate_state(service,
 					CONNMAN_SERVICE_STATE_ONLINE, type);
 }
@@ -968,6 +982,8 @@ int __connman_wispr_start(struct connman_service *service,
 	else
 		wispr_portal->ipv6_context = wp_context;
 
+	__connman_trace_begin(service, online_check_span(type));
+
 	return wispr_portal_detect(wp_context);
 }
 
@@ -0,0 +1,1004 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Load generator for the DNS proxy. The proxy code from src/dnsproxy.c
+ * is linked into this program and runs in the same main loop as a
+ * stub upstream server and the clients, all on the loopback interface:
+ *
+ *   clients -> 127.0.0.1:port (dnsproxy) -> 127.0.0.2:port+1 (stub)
+ *
+ * The stub answers every A and AAAA query right away, so the numbers
+ * measure the proxy itself and no network access is needed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <math.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <resolv.h>
+
+#include <glib.h>
+
+#include "../src/connman.h"
+
+#define BENCH_PROXY	"127.0.0.1"
+#define BENCH_SERVER	"127.0.0.2"
+#define BENCH_DOMAIN	"bench.test"
+#define BENCH_TTL	3600
+
+#define MAX_QUERIES	65536
+#define QUERY_TIMEOUT	(2 * G_USEC_PER_SEC)
+
+static gint option_queries = 100000;
+static gint option_concurrency = 64;
+static gint option_names = 1000;
+static gdouble option_hit_ratio = 0.9;
+static gdouble option_zipf = 1.0;
+static gdouble option_tcp = 0.0;
+static gint option_port = 15353;
+static gint option_cache_size = 128 * 1024;
+static gint option_negative_size = 16 * 1024;
+static gint option_edns_size = 1232;
+static gchar *option_debug = NULL;
+
+static GOptionEntry options[] = {
+	{ "queries", 'n', 0, G_OPTION_ARG_INT, &option_queries,
+				"Number of queries to send", "NUM" },
+	{ "concurrency", 'c', 0, G_OPTION_ARG_INT, &option_concurrency,
+				"Number of queries in flight", "NUM" },
+	{ "names", 'N', 0, G_OPTION_ARG_INT, &option_names,
+				"Number of names that can be cached", "NUM" },
+	{ "hit-ratio", 'r', 0, G_OPTION_ARG_DOUBLE, &option_hit_ratio,
+				"Share of queries for cacheable names",
+				"0..1" },
+	{ "zipf", 'z', 0, G_OPTION_ARG_DOUBLE, &option_zipf,
+				"Zipf exponent of the name popularity, "
+				"0 for uniform", "S" },
+	{ "tcp", 't', 0, G_OPTION_ARG_DOUBLE, &option_tcp,
+				"Share of queries sent over TCP", "0..1" },
+	{ "port", 'p', 0, G_OPTION_ARG_INT, &option_port,
+				"Port of the proxy, the stub server uses "
+				"the next one", "PORT" },
+	{ "cache-size", 's', 0, G_OPTION_ARG_INT, &option_cache_size,
+				"DNSProxyCacheSize in bytes", "BYTES" },
+	{ "negative-size", 0, 0, G_OPTION_ARG_INT, &option_negative_size,
+				"DNSProxyNegativeCacheSize in bytes",
+				"BYTES" },
+	{ "edns-size", 0, 0, G_OPTION_ARG_INT, &option_edns_size,
+				"DNSProxyEDNSBufferSize in bytes", "BYTES" },
+	{ "debug", 'd', 0, G_OPTION_ARG_STRING, &option_debug,
+				"Enable debug output of the given files "
+				"(e.g. src/dnsproxy.c)", "FILE" },
+	{ NULL },
+};
+
+/*
+ * The parts of connmand that the proxy uses, reduced to what a single
+ * loopback listener with one always enabled server needs.
+ */
+
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, "DNSProxyCacheSize"))
+		return option_cache_size;
+
+	if (g_str_equal(key, "DNSProxyNegativeCacheSize"))
+		return option_negative_size;
+
+	if (g_str_equal(key, "DNSProxyEDNSBufferSize"))
+		return option_edns_size;
+
+	return 0;
+}
+
+bool connman_setting_get_bool(const char *key)
+{
+	return false;
+}
+
+int connman_inet_ifindex(const char *name)
+{
+	return if_nametoindex(name);
+}
+
+char *connman_inet_ifname(int index)
+{
+	char name[IF_NAMESIZE];
+
+	if (index < 0 || !if_indextoname(index, name))
+		return NULL;
+
+	return g_strdup(name);
+}
+
+int __connman_inet_get_interface_address(int index, int family,
+							void *address)
+{
+	if (family != AF_INET)
+		return -EAFNOSUPPORT;
+
+	return inet_pton(AF_INET, BENCH_PROXY, address) == 1 ? 0 : -EINVAL;
+}
+
+int __connman_resolvfile_append(int index, const char *domain,
+							const char *server)
+{
+	return 0;
+}
+
+int __connman_resolvfile_remove(int index, const char *domain,
+							const char *server)
+{
+	return 0;
+}
+
+bool __connman_service_index_is_default(int index)
+{
+	return true;
+}
+
+bool __connman_service_index_is_split_routing(int index)
+{
+	return false;
+}
+
+const char *__connman_service_get_ident(struct connman_service *service)
+{
+	return NULL;
+}
+
+int __connman_service_get_index(struct connman_service *service)
+{
+	return -1;
+}
+
+int __connman_util_get_random(uint64_t *val)
+{
+	*val = (uint64_t) g_random_int() << 32 | g_random_int();
+
+	return 0;
+}
+
+int connman_notifier_register(struct connman_notifier *notifier)
+{
+	return 0;
+}
+
+void connman_notifier_unregister(struct connman_notifier *notifier)
+{
+}
+
+/* Upstream server */
+
+struct stub_conn {
+	int sk;
+	guint watch;
+	unsigned char buf[4096 + 2];
+	size_t len;
+};
+
+static int stub_udp_sk = -1;
+static int stub_tcp_sk = -1;
+static guint stub_udp_watch;
+static guint stub_tcp_watch;
+static GSList *stub_conns;
+static unsigned int upstream_queries;
+
+static int question_end(const unsigned char *msg, int len)
+{
+	int pos = 12;
+
+	while (pos < len && msg[pos]) {
+		if (msg[pos] & 0xc0)
+			return -EINVAL;
+
+		pos += msg[pos] + 1;
+	}
+
+	pos += 1 + 4;
+
+	return pos <= len ? pos : -EINVAL;
+}
+
+static int stub_response(const unsigned char *query, int len,
+							unsigned char *resp)
+{
+	static const unsigned char ipv4[4] = { 192, 0, 2, 1 };
+	static const unsigned char ipv6[16] = { 0x20, 0x01, 0x0d, 0xb8,
+						0, 0, 0, 0, 0, 0, 0, 0,
+						0, 0, 0, 1 };
+	int end, type, pos;
+
+	end = question_end(query, len);
+	if (end < 0)
+		return end;
+
+	memcpy(resp, query, end);
+	resp[2] = 0x81;			/* qr, rd */
+	resp[3] = 0x80;			/* ra, no error */
+	memset(resp + 6, 0, 6);		/* no answers yet, no EDNS0 */
+
+	type = query[end - 4] << 8 | query[end - 3];
+	if (type != ns_t_a && type != ns_t_aaaa)
+		return end;
+
+	pos = end;
+	resp[pos++] = 0xc0;
+	resp[pos++] = 12;
+	resp[pos++] = type >> 8;
+	resp[pos++] = type & 0xff;
+	resp[pos++] = 0;
+	resp[pos++] = ns_c_in;
+	resp[pos++] = BENCH_TTL >> 24;
+	resp[pos++] = (BENCH_TTL >> 16) & 0xff;
+	resp[pos++] = (BENCH_TTL >> 8) & 0xff;
+	resp[pos++] = BENCH_TTL & 0xff;
+
+	if (type == ns_t_a) {
+		resp[pos++] = 0;
+		resp[pos++] = sizeof(ipv4);
+		memcpy(resp + pos, ipv4, sizeof(ipv4));
+		pos += sizeof(ipv4);
+	} else {
+		resp[pos++] = 0;
+		resp[pos++] = sizeof(ipv6);
+		memcpy(resp + pos, ipv6, sizeof(ipv6));
+		pos += sizeof(ipv6);
+	}
+
+	resp[7] = 1;
+
+	return pos;
+}
+
+static gboolean stub_udp_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	unsigned char query[4096], resp[4096 + 64];
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	ssize_t len;
+	int resp_len;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		stub_udp_watch = 0;
+		return FALSE;
+	}
+
+	for (;;) {
+		from_len = sizeof(from);
+		len = recvfrom(stub_udp_sk, query, sizeof(query), MSG_DONTWAIT,
+				(struct sockaddr *) &from, &from_len);
+		if (len < 0)
+			break;
+
+		upstream_queries++;
+
+		resp_len = stub_response(query, len, resp);
+		if (resp_len < 0)
+			continue;
+
+		sendto(stub_udp_sk, resp, resp_len, 0,
+				(struct sockaddr *) &from, from_len);
+	}
+
+	return TRUE;
+}
+
+static void stub_conn_free(gpointer data)
+{
+	struct stub_conn *conn = data;
+
+	if (conn->watch > 0)
+		g_source_remove(conn->watch);
+
+	close(conn->sk);
+	g_free(conn);
+}
+
+static gboolean stub_conn_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	struct stub_conn *conn = user_data;
+	unsigned char resp[4096 + 64];
+	size_t msg_len;
+	ssize_t len;
+	int resp_len;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		goto close;
+
+	len = recv(conn->sk, conn->buf + conn->len,
+				sizeof(conn->buf) - conn->len, MSG_DONTWAIT);
+	if (len <= 0) {
+		if (len < 0 && errno == EAGAIN)
+			return TRUE;
+
+		goto close;
+	}
+
+	conn->len += len;
+
+	while (conn->len >= 2) {
+		msg_len = conn->buf[0] << 8 | conn->buf[1];
+		if (msg_len + 2 > sizeof(conn->buf))
+			goto close;
+
+		if (conn->len < msg_len + 2)
+			break;
+
+		upstream_queries++;
+
+		resp_len = stub_response(conn->buf + 2, msg_len, resp + 2);
+		if (resp_len >= 0) {
+			resp[0] = resp_len >> 8;
+			resp[1] = resp_len & 0xff;
+
+			if (send(conn->sk, resp, resp_len + 2,
+						MSG_NOSIGNAL) < 0)
+				goto close;
+		}
+
+		conn->len -= msg_len + 2;
+		memmove(conn->buf, conn->buf + msg_len + 2, conn->len);
+	}
+
+	return TRUE;
+
+close:
+	conn->watch = 0;
+	stub_conns = g_slist_remove(stub_conns, conn);
+	stub_conn_free(conn);
+
+	return FALSE;
+}
+
+static guint add_watch(int sk, GIOCondition condition, GIOFunc func,
+							gpointer user_data)
+{
+	GIOChannel *channel;
+	guint watch;
+
+	channel = g_io_channel_unix_new(sk);
+	watch = g_io_add_watch(channel, condition, func, user_data);
+	g_io_channel_unref(channel);
+
+	return watch;
+}
+
+static gboolean stub_tcp_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	struct stub_conn *conn;
+	int sk;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		stub_tcp_watch = 0;
+		return FALSE;
+	}
+
+	sk = accept(stub_tcp_sk, NULL, NULL);
+	if (sk < 0)
+		return TRUE;
+
+	conn = g_new0(struct stub_conn, 1);
+	conn->sk = sk;
+	conn->watch = add_watch(sk, G_IO_IN | G_IO_ERR | G_IO_HUP,
+						stub_conn_event, conn);
+
+	stub_conns = g_slist_prepend(stub_conns, conn);
+
+	return TRUE;
+}
+
+static int bind_socket(int type, const char *address, int port)
+{
+	struct sockaddr_in sin;
+	int sk, one = 1;
+
+	sk = socket(AF_INET, type | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (sk < 0)
+		return -errno;
+
+	setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	inet_pton(AF_INET, address, &sin.sin_addr);
+
+	if (bind(sk, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+			(type == SOCK_STREAM && listen(sk, 64) < 0)) {
+		int err = -errno;
+
+		close(sk);
+		return err;
+	}
+
+	return sk;
+}
+
+static int stub_start(int port)
+{
+	stub_udp_sk = bind_socket(SOCK_DGRAM, BENCH_SERVER, port);
+	if (stub_udp_sk < 0)
+		return stub_udp_sk;
+
+	stub_tcp_sk = bind_socket(SOCK_STREAM, BENCH_SERVER, port);
+	if (stub_tcp_sk < 0) {
+		close(stub_udp_sk);
+		return stub_tcp_sk;
+	}
+
+	stub_udp_watch = add_watch(stub_udp_sk, G_IO_IN | G_IO_ERR,
+						stub_udp_event, NULL);
+	stub_tcp_watch = add_watch(stub_tcp_sk, G_IO_IN | G_IO_ERR,
+						stub_tcp_event, NULL);
+
+	return 0;
+}
+
+static void stub_stop(void)
+{
+	g_slist_free_full(stub_conns, stub_conn_free);
+	stub_conns = NULL;
+
+	if (stub_udp_watch > 0)
+		g_source_remove(stub_udp_watch);
+	if (stub_tcp_watch > 0)
+		g_source_remove(stub_tcp_watch);
+
+	close(stub_udp_sk);
+	close(stub_tcp_sk);
+}
+
+/* Clients */
+
+struct query {
+	bool active;
+	gint64 sent;
+	int sk;
+	guint watch;
+	unsigned char *msg;
+	size_t msg_len;
+	unsigned char buf[512 + 2];
+	size_t len;
+};
+
+static struct query queries[MAX_QUERIES];
+static GMainLoop *main_loop;
+static struct sockaddr_in proxy_addr;
+static int udp_sk = -1;
+static guint udp_watch;
+static guint timeout_watch;
+
+static double *name_cdf;
+static unsigned int next_id;
+static unsigned int next_miss;
+static bool warming_up;
+static bool stopping;
+
+static unsigned int total;
+static unsigned int sent;
+static unsigned int in_flight;
+static unsigned int answered;
+static unsigned int failed;
+static unsigned int timeouts;
+static unsigned int sent_udp;
+static unsigned int sent_tcp;
+static guint32 *latencies;
+
+static void fill(void);
+
+static void build_cdf(void)
+{
+	double sum = 0;
+	int i;
+
+	name_cdf = g_new(double, option_names);
+
+	for (i = 0; i < option_names; i++) {
+		sum += 1.0 / pow(i + 1, option_zipf);
+		name_cdf[i] = sum;
+	}
+
+	for (i = 0; i < option_names; i++)
+		name_cdf[i] /= sum;
+}
+
+static int pick_name(void)
+{
+	double x = g_random_double();
+	int low = 0, high = option_names - 1;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+
+		if (name_cdf[mid] < x)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static size_t build_query(unsigned char *msg, unsigned int id,
+							const char *name)
+{
+	char **labels;
+	size_t pos = 12;
+	int i;
+
+	memset(msg, 0, 12);
+	msg[0] = id >> 8;
+	msg[1] = id & 0xff;
+	msg[2] = 0x01;			/* rd */
+	msg[5] = 1;			/* qdcount */
+
+	labels = g_strsplit(name, ".", 0);
+	for (i = 0; labels[i]; i++) {
+		size_t len = strlen(labels[i]);
+
+		msg[pos++] = len;
+		memcpy(msg + pos, labels[i], len);
+		pos += len;
+	}
+	g_strfreev(labels);
+
+	msg[pos++] = 0;
+	msg[pos++] = 0;
+	msg[pos++] = ns_t_a;
+	msg[pos++] = 0;
+	msg[pos++] = ns_c_in;
+
+	return pos;
+}
+
+static void query_release(unsigned int id)
+{
+	struct query *query = &queries[id];
+
+	if (query->watch > 0)
+		g_source_remove(query->watch);
+
+	if (query->sk >= 0)
+		close(query->sk);
+
+	g_free(query->msg);
+	memset(query, 0, sizeof(*query));
+	query->sk = -1;
+
+	in_flight--;
+}
+
+static void query_done(unsigned int id, const unsigned char *resp,
+							size_t len)
+{
+	if (!resp || len < 12 || (resp[3] & 0x0f) != 0)
+		failed++;
+	else if (!warming_up)
+		latencies[answered++] =
+			g_get_monotonic_time() - queries[id].sent;
+	else
+		answered++;
+
+	query_release(id);
+}
+
+static gboolean udp_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	unsigned char buf[4096];
+	unsigned int id;
+	ssize_t len;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		udp_watch = 0;
+		return FALSE;
+	}
+
+	while ((len = recv(udp_sk, buf, sizeof(buf), MSG_DONTWAIT)) >= 2) {
+		id = buf[0] << 8 | buf[1];
+
+		if (queries[id].active && queries[id].sk < 0)
+			query_done(id, buf, len);
+	}
+
+	fill();
+
+	return TRUE;
+}
+
+static gboolean tcp_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	unsigned int id = GPOINTER_TO_UINT(user_data);
+	struct query *query = &queries[id];
+	size_t msg_len;
+	ssize_t len;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		goto error;
+
+	if (query->msg) {
+		if (send(query->sk, query->msg, query->msg_len,
+					MSG_NOSIGNAL) != (ssize_t) query->msg_len)
+			goto error;
+
+		g_free(query->msg);
+		query->msg = NULL;
+
+		query->watch = add_watch(query->sk,
+					G_IO_IN | G_IO_ERR | G_IO_HUP,
+					tcp_event, user_data);
+		return FALSE;
+	}
+
+	len = recv(query->sk, query->buf + query->len,
+			sizeof(query->buf) - query->len, MSG_DONTWAIT);
+	if (len < 0 && errno == EAGAIN)
+		return TRUE;
+	if (len <= 0)
+		goto error;
+
+	query->len += len;
+	if (query->len < 2)
+		return TRUE;
+
+	msg_len = query->buf[0] << 8 | query->buf[1];
+	if (msg_len + 2 > sizeof(query->buf))
+		goto error;
+	if (query->len < msg_len + 2)
+		return TRUE;
+
+	query->watch = 0;
+	query_done(id, query->buf + 2, msg_len);
+	fill();
+
+	return FALSE;
+
+error:
+	query->watch = 0;
+	query_done(id, NULL, 0);
+	fill();
+
+	return FALSE;
+}
+
+static unsigned int alloc_id(void)
+{
+	unsigned int id;
+
+	while (queries[next_id].active)
+		next_id = (next_id + 1) % MAX_QUERIES;
+
+	id = next_id;
+	next_id = (next_id + 1) % MAX_QUERIES;
+
+	return id;
+}
+
+static void send_query(void)
+{
+	unsigned char msg[512 + 2];
+	struct query *query;
+	unsigned int id;
+	char *name;
+	size_t len;
+
+	if (warming_up)
+		name = g_strdup_printf("host%u." BENCH_DOMAIN, sent);
+	else if (g_random_double() < option_hit_ratio)
+		name = g_strdup_printf("host%d." BENCH_DOMAIN, pick_name());
+	else
+		name = g_strdup_printf("miss%u." BENCH_DOMAIN, next_miss++);
+
+	id = alloc_id();
+	query = &queries[id];
+	query->active = true;
+	query->sk = -1;
+
+	len = build_query(msg + 2, id, name);
+	g_free(name);
+
+	sent++;
+	in_flight++;
+	query->sent = g_get_monotonic_time();
+
+	if (warming_up || g_random_double() >= option_tcp) {
+		sent_udp++;
+
+		if (send(udp_sk, msg + 2, len, 0) < 0)
+			query_done(id, NULL, 0);
+
+		return;
+	}
+
+	sent_tcp++;
+
+	msg[0] = len >> 8;
+	msg[1] = len & 0xff;
+	query->msg = g_malloc(len + 2);
+	memcpy(query->msg, msg, len + 2);
+	query->msg_len = len + 2;
+
+	query->sk = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC |
+							SOCK_NONBLOCK, 0);
+	if (query->sk < 0 || (connect(query->sk,
+				(struct sockaddr *) &proxy_addr,
+				sizeof(proxy_addr)) < 0 &&
+				errno != EINPROGRESS)) {
+		query_done(id, NULL, 0);
+		return;
+	}
+
+	query->watch = add_watch(query->sk, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+					tcp_event, GUINT_TO_POINTER(id));
+}
+
+static void fill(void)
+{
+	while (!stopping && sent < total &&
+			in_flight < (unsigned int) option_concurrency)
+		send_query();
+
+	if (in_flight == 0 && (sent == total || stopping))
+		g_main_loop_quit(main_loop);
+}
+
+static gboolean timeout_event(gpointer user_data)
+{
+	gint64 now = g_get_monotonic_time();
+	unsigned int id;
+
+	for (id = 0; id < MAX_QUERIES; id++) {
+		if (!queries[id].active ||
+				now - queries[id].sent < QUERY_TIMEOUT)
+			continue;
+
+		timeouts++;
+		query_release(id);
+	}
+
+	fill();
+
+	return TRUE;
+}
+
+static void run(unsigned int count, bool warmup)
+{
+	warming_up = warmup;
+	total = count;
+	sent = answered = failed = timeouts = 0;
+	sent_udp = sent_tcp = 0;
+
+	fill();
+
+	if (in_flight > 0)
+		g_main_loop_run(main_loop);
+}
+
+static void read_memory(unsigned long *rss, unsigned long *peak)
+{
+	char *contents, *line;
+
+	*rss = *peak = 0;
+
+	if (!g_file_get_contents("/proc/self/status", &contents, NULL, NULL))
+		return;
+
+	line = strstr(contents, "VmHWM:");
+	if (line)
+		*peak = strtoul(line + 6, NULL, 10);
+
+	line = strstr(contents, "VmRSS:");
+	if (line)
+		*rss = strtoul(line + 6, NULL, 10);
+
+	g_free(contents);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	guint32 x = *(const guint32 *) a, y = *(const guint32 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double p)
+{
+	unsigned int i;
+
+	if (answered == 0)
+		return 0;
+
+	i = p * answered;
+	if (i >= answered)
+		i = answered - 1;
+
+	return latencies[i] / 1000.0;
+}
+
+static void report(gint64 elapsed, unsigned int upstream,
+			unsigned long rss_before, unsigned long rss_after,
+			unsigned long peak)
+{
+	double seconds = elapsed / (double) G_USEC_PER_SEC;
+
+	qsort(latencies, answered, sizeof(*latencies), compare_latency);
+
+	printf("queries   %u (udp %u tcp %u) concurrency %d\n",
+				total, sent_udp, sent_tcp, option_concurrency);
+	printf("answers   %u failed %u timeouts %u\n",
+				answered, failed, timeouts);
+	printf("time      %.3f s, %.0f queries/s\n", seconds,
+				seconds > 0 ? answered / seconds : 0);
+	printf("latency   p50 %.3f ms p99 %.3f ms p999 %.3f ms "
+				"max %.3f ms\n", percentile(0.5),
+				percentile(0.99), percentile(0.999),
+				percentile(1));
+	printf("upstream  %u queries, %.1f%% answered by the cache\n",
+				upstream, total > 0 ?
+				100.0 * (total - MIN(upstream, total)) / total :
+				0);
+	printf("memory    rss %lu kB (%+ld kB) peak %lu kB\n", rss_after,
+				(long) rss_after - (long) rss_before, peak);
+}
+
+static void sig_term(int sig)
+{
+	stopping = true;
+	g_main_loop_quit(main_loop);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct sigaction sa;
+	unsigned long rss_before, rss_after, peak;
+	unsigned int upstream;
+	gint64 start, elapsed;
+	int err, index, i;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		if (error) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_queries <= 0 || option_names <= 0 ||
+			option_concurrency <= 0 ||
+			option_concurrency >= MAX_QUERIES / 2 ||
+			option_port <= 0 || option_port >= 65535) {
+		g_printerr("Invalid arguments\n");
+		exit(1);
+	}
+
+	__connman_log_init(argv[0], option_debug, FALSE, FALSE,
+						"dnsproxy-bench", VERSION);
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	for (i = 0; i < MAX_QUERIES; i++)
+		queries[i].sk = -1;
+
+	err = stub_start(option_port + 1);
+	if (err < 0) {
+		g_printerr("Failed to start the stub server on %s:%d: %s\n",
+				BENCH_SERVER, option_port + 1, strerror(-err));
+		exit(1);
+	}
+
+	__connman_dnsproxy_set_listen_port(option_port);
+	__connman_dnsproxy_set_server_port(option_port + 1);
+
+	err = __connman_dnsproxy_init();
+	if (err < 0) {
+		g_printerr("Failed to start the proxy on %s:%d: %s\n",
+				BENCH_PROXY, option_port, strerror(-err));
+		exit(1);
+	}
+
+	index = connman_inet_ifindex("lo");
+	__connman_dnsproxy_append(index, NULL, BENCH_SERVER);
+
+	memset(&proxy_addr, 0, sizeof(proxy_addr));
+	proxy_addr.sin_family = AF_INET;
+	proxy_addr.sin_port = htons(option_port);
+	inet_pton(AF_INET, BENCH_PROXY, &proxy_addr.sin_addr);
+
+	udp_sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (udp_sk < 0 || connect(udp_sk, (struct sockaddr *) &proxy_addr,
+						sizeof(proxy_addr)) < 0) {
+		g_printerr("Failed to create the client socket\n");
+		exit(1);
+	}
+
+	udp_watch = add_watch(udp_sk, G_IO_IN | G_IO_ERR, udp_event, NULL);
+	timeout_watch = g_timeout_add(100, timeout_event, NULL);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_term;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	build_cdf();
+	latencies = g_new(guint32, option_queries);
+
+	/* Put every cacheable name into the cache first */
+	run(option_names, true);
+
+	read_memory(&rss_before, &peak);
+	upstream = upstream_queries;
+	start = g_get_monotonic_time();
+
+	run(option_queries, false);
+
+	elapsed = g_get_monotonic_time() - start;
+	upstream = upstream_queries - upstream;
+	read_memory(&rss_after, &peak);
+
+	report(elapsed, upstream, rss_before, rss_after, peak);
+
+	g_source_remove(timeout_watch);
+	if (udp_watch > 0)
+		g_source_remove(udp_watch);
+	close(udp_sk);
+
+	for (i = 0; i < MAX_QUERIES; i++)
+		if (queries[i].active)
+			query_release(i);
+
+	__connman_dnsproxy_cleanup();
+
+	stub_stop();
+
+	g_free(latencies);
+	g_free(name_cdf);
+
+	g_main_loop_unref(main_loop);
+
+	__connman_log_cleanup(FALSE);
+
+	return 0;
+}
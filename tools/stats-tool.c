@@ -105,6 +105,10 @@ static bool option_summary = false;
 static char *option_info_file_name = NULL;
 static time_t option_start_ts = -1;
 static char *option_last_file_name = NULL;
+static time_t option_range_start = -1;
+static time_t option_range_end = -1;
+static gint option_bucket = 0;
+static bool option_roaming = false;
 
 static bool parse_start_ts(const char *key, const char *value,
 					gpointer user_data, GError **error)
@@ -119,6 +123,32 @@ static bool parse_start_ts(const char *key, const char *value,
 	return true;
 }
 
+static bool parse_range(const char *key, const char *value,
+					gpointer user_data, GError **error)
+{
+	GTimeVal start, end;
+	gchar **tokens;
+	bool ret = false;
+
+	tokens = g_strsplit(value, ",", 2);
+	if (g_strv_length(tokens) != 2)
+		goto out;
+
+	if (!g_time_val_from_iso8601(tokens[0], &start) ||
+			!g_time_val_from_iso8601(tokens[1], &end) ||
+			end.tv_sec < start.tv_sec)
+		goto out;
+
+	option_range_start = start.tv_sec;
+	option_range_end = end.tv_sec;
+	ret = true;
+
+out:
+	g_strfreev(tokens);
+
+	return ret;
+}
+
 static GOptionEntry options[] = {
 	{ "create", 'c', 0, G_OPTION_ARG_INT, &option_create,
 			"Create a .data file with NR faked entries", "NR" },
@@ -135,6 +165,15 @@ static GOptionEntry options[] = {
 			"(example 2010-11-05T23:00:12Z)", "TS"},
 	{ "last", 'l', 0, G_OPTION_ARG_FILENAME, &option_last_file_name,
 			  "Start values from last .data file" },
+	{ "range", 'r', 0, G_OPTION_ARG_CALLBACK, parse_range,
+			"Usage between two times "
+			"(example 2010-11-05T00:00:00Z,2010-11-06T00:00:00Z)",
+			"FROM,TO" },
+	{ "bucket", 'b', 0, G_OPTION_ARG_INT, &option_bucket,
+			"Split the range into buckets of SECONDS",
+			"SECONDS" },
+	{ "roaming", 'R', 0, G_OPTION_ARG_NONE, &option_roaming,
+			"Show roaming instead of home usage (used with range)" },
 	{ NULL },
 };
 
@@ -356,6 +395,138 @@ static void stats_print_diff(struct stats_file *file)
 	}
 }
 
+/* Records are numbered from 0 for the oldest one in the ring buffer */
+static struct stats_record *get_record(struct stats_file *file, int index)
+{
+	int begin = get_index(file, get_begin(file));
+
+	return file->first + (begin + 1 + index) % file->max_nr;
+}
+
+static int stats_search(struct stats_file *file, time_t ts)
+{
+	int low = 0, high = file->nr;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+
+		if (get_record(file, mid)->ts < ts)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static unsigned int counter_delta(unsigned int cur, unsigned int last)
+{
+	return cur >= last ? cur - last : cur;
+}
+
+static void stats_add_delta(struct connman_stats_data *usage,
+				struct stats_record *cur,
+				struct stats_record *last)
+{
+	usage->rx_packets += counter_delta(cur->data.rx_packets,
+						last->data.rx_packets);
+	usage->tx_packets += counter_delta(cur->data.tx_packets,
+						last->data.tx_packets);
+	usage->rx_bytes += counter_delta(cur->data.rx_bytes,
+						last->data.rx_bytes);
+	usage->tx_bytes += counter_delta(cur->data.tx_bytes,
+						last->data.tx_bytes);
+	usage->rx_errors += counter_delta(cur->data.rx_errors,
+						last->data.rx_errors);
+	usage->tx_errors += counter_delta(cur->data.tx_errors,
+						last->data.tx_errors);
+	usage->rx_dropped += counter_delta(cur->data.rx_dropped,
+						last->data.rx_dropped);
+	usage->tx_dropped += counter_delta(cur->data.tx_dropped,
+						last->data.tx_dropped);
+	usage->time += counter_delta(cur->data.time, last->data.time);
+}
+
+static void stats_print_usage(time_t ts, struct connman_stats_data *usage)
+{
+	char buffer[30];
+
+	strftime(buffer, 30, "%d-%m-%Y %T", localtime(&ts));
+	printf("%lld %s %u %u %u %u %u %u %u %u %u\n",
+		(long long int)ts, buffer,
+		usage->rx_packets,
+		usage->tx_packets,
+		usage->rx_bytes,
+		usage->tx_bytes,
+		usage->rx_errors,
+		usage->tx_errors,
+		usage->rx_dropped,
+		usage->tx_dropped,
+		usage->time);
+}
+
+/*
+ * Same as __connman_stats_get_range(): the usage of a record is the
+ * difference to the previous record of the same kind.
+ */
+static void stats_print_range(struct stats_file *file, time_t start,
+				time_t end, int bucket, bool roaming)
+{
+	struct connman_stats_data usage;
+	struct stats_record *prev = NULL;
+	time_t bucket_start = start;
+	bool used = false;
+	int i, first;
+
+	printf("%s usage\n", roaming ? "roaming" : "home");
+	printf("ts ts rx_packets tx_packets rx_bytes tx_bytes rx_errors "
+		"tx_errors rx_dropped tx_dropped time\n\n");
+
+	first = stats_search(file, start);
+
+	for (i = first; i > 0; i--) {
+		struct stats_record *rec = get_record(file, i - 1);
+
+		if (!rec->roaming == !roaming) {
+			prev = rec;
+			break;
+		}
+	}
+
+	memset(&usage, 0, sizeof(usage));
+
+	for (i = first; i < file->nr; i++) {
+		struct stats_record *rec = get_record(file, i);
+
+		if (rec->ts >= end)
+			break;
+
+		if (!rec->roaming != !roaming)
+			continue;
+
+		if (!prev) {
+			prev = rec;
+			continue;
+		}
+
+		if (bucket > 0 && rec->ts >= bucket_start + bucket) {
+			if (used)
+				stats_print_usage(bucket_start, &usage);
+
+			bucket_start = rec->ts - (rec->ts - start) % bucket;
+			memset(&usage, 0, sizeof(usage));
+			used = false;
+		}
+
+		stats_add_delta(&usage, rec, prev);
+		used = true;
+		prev = rec;
+	}
+
+	if (used || bucket <= 0)
+		stats_print_usage(bucket_start, &usage);
+}
+
 static void update_max_nr_entries(struct stats_file *file)
 {
 	file->max_nr = (file->len - sizeof(struct stats_file_header)) /
@@ -910,6 +1081,11 @@ int main(int argc, char *argv[])
 	if (option_summary)
 		stats_print_diff(data_file);
 
+	if (option_range_start != -1)
+		stats_print_range(data_file, option_range_start,
+					option_range_end, option_bucket,
+					option_roaming);
+
 	if (option_info_file_name)
 		history_file_update(data_file, option_info_file_name);
 